@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
@@ -46,10 +47,19 @@
 #include "hw/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/sockets.h"
+#include "hw/xen.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
 
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
     do { fprintf(stdout, "arch_init: " fmt, ## __VA_ARGS__); } while (0)
@@ -106,13 +116,16 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+#define RAM_SAVE_FLAG_POSTCOPY 0x01 /* was RAM_SAVE_FLAG_FULL, obsolete */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_CHANNELS 0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_CHANNEL_SYNC 0x200
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -190,6 +203,8 @@ static struct {
     uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
+    /* Cache statistics, kept after the cache is freed */
+    PageCacheStats stats;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
@@ -216,6 +231,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_bytes;
+    uint64_t compress_pages;
+    uint64_t compress_incompressible;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -265,6 +283,52 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+static const PageCacheStats *xbzrle_cache_stats(void)
+{
+    if (XBZRLE.cache) {
+        cache_get_stats(XBZRLE.cache, &XBZRLE.stats);
+    }
+    return &XBZRLE.stats;
+}
+
+uint64_t xbzrle_mig_pages_cache_evictions(void)
+{
+    return xbzrle_cache_stats()->evictions;
+}
+
+XBZRLECacheWayStatsList *xbzrle_mig_cache_way_stats(void)
+{
+    const PageCacheStats *stats = xbzrle_cache_stats();
+    XBZRLECacheWayStatsList *head = NULL, **next = &head;
+    unsigned int i;
+
+    for (i = 0; i < stats->ways; i++) {
+        XBZRLECacheWayStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->way = i;
+        entry->value->hits = stats->way_hits[i];
+        *next = entry;
+        next = &entry->next;
+    }
+    return head;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_pages_incompressible(void)
+{
+    return acct_info.compress_incompressible;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -343,285 +407,1463 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
-static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
-static uint64_t migration_dirty_pages;
-static uint32_t last_version;
 
-static inline
-ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
-                                                 ram_addr_t start)
-{
-    unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
-    unsigned long nr = base + (start >> TARGET_PAGE_BITS);
-    unsigned long size = base + (int128_get64(mr->size) >> TARGET_PAGE_BITS);
+/* Multithreaded page compression
+ *
+ * Pages to be compressed are copied into a ring of slots, each of which is
+ * served by its own thread.  Slots are written to the stream in the order
+ * in which they were filled, so the destination sees the same sequence of
+ * pages as without compression; only the oldest slot is ever waited for.
+ */
+typedef struct CompressSlot {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* Protected by lock */
+    bool pending;       /* page copied in, waiting to be compressed */
+    bool done;          /* compressed data ready to be written */
+    bool quit;
+
+    /* Owned by the compression thread while pending is set */
+    z_stream stream;
+    uint8_t *page;
+    uint8_t *buf;
+    size_t len;         /* compressed length, 0 if the page did not shrink */
+    int64_t busy_ns;
 
-    unsigned long next = find_next_bit(migration_bitmap, size, nr);
+    RAMBlock *block;
+    ram_addr_t offset;
+} CompressSlot;
 
-    if (next < size) {
-        clear_bit(next, migration_bitmap);
-        migration_dirty_pages--;
-    }
-    return (next - base) << TARGET_PAGE_BITS;
-}
+typedef struct CompressThreadAcct {
+    uint64_t pages;
+    uint64_t bytes;
+    int64_t busy_ns;
+} CompressThreadAcct;
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
+static struct {
+    CompressSlot *slots;
+    int nb_slots;
+    int head;           /* oldest filled slot */
+    int filled;
+    /* Kept after migration ends, for query-migrate */
+    CompressThreadAcct *acct;
+    int nb_acct;
+} Compress;
+
+CompressThreadStatsList *compress_mig_thread_stats(void)
 {
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+    CompressThreadStatsList *head = NULL, **next = &head;
+    int i;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    for (i = 0; i < Compress.nb_acct; i++) {
+        CompressThreadStatsList *entry = g_malloc0(sizeof(*entry));
 
-    if (!ret) {
-        migration_dirty_pages++;
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->thread = i;
+        entry->value->pages = Compress.acct[i].pages;
+        entry->value->bytes = Compress.acct[i].bytes;
+        entry->value->busy_time = Compress.acct[i].busy_ns / 1000000;
+        *next = entry;
+        next = &entry->next;
     }
-    return ret;
+    return head;
 }
 
-static void migration_bitmap_sync(void)
+static void compress_slot_page(CompressSlot *slot)
 {
-    RAMBlock *block;
-    ram_addr_t addr;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    static int64_t start_time;
-    static int64_t num_dirty_pages_period;
-    int64_t end_time;
+    z_stream *zs = &slot->stream;
+    int64_t start = get_clock();
+    int ret;
 
-    if (!start_time) {
-        start_time = qemu_get_clock_ms(rt_clock);
+    deflateReset(zs);
+    zs->next_in = slot->page;
+    zs->avail_in = TARGET_PAGE_SIZE;
+    zs->next_out = slot->buf;
+    zs->avail_out = TARGET_PAGE_SIZE;
+
+    /* The output buffer is one page, so anything that does not shrink
+     * ends with Z_OK or Z_BUF_ERROR and goes out uncompressed.
+     */
+    ret = deflate(zs, Z_FINISH);
+    if (ret == Z_STREAM_END && zs->total_out < TARGET_PAGE_SIZE) {
+        slot->len = zs->total_out;
+    } else {
+        slot->len = 0;
     }
+    slot->busy_ns += get_clock() - start;
+}
 
-    trace_migration_bitmap_sync_start();
-    memory_global_sync_dirty_bitmap(get_system_memory());
+static void *do_compress_thread(void *opaque)
+{
+    CompressSlot *slot = opaque;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
+    qemu_mutex_lock(&slot->lock);
+    while (!slot->quit) {
+        if (!slot->pending) {
+            qemu_cond_wait(&slot->cond, &slot->lock);
+            continue;
         }
-    }
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
-    end_time = qemu_get_clock_ms(rt_clock);
+        qemu_mutex_unlock(&slot->lock);
 
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > start_time + 1000) {
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
-            / (end_time - start_time);
-        start_time = end_time;
-        num_dirty_pages_period = 0;
+        compress_slot_page(slot);
+
+        qemu_mutex_lock(&slot->lock);
+        slot->pending = false;
+        slot->done = true;
+        qemu_cond_signal(&slot->cond);
     }
+    qemu_mutex_unlock(&slot->lock);
+    return NULL;
 }
 
-/*
- * ram_save_block: Writes a page of memory to the stream f
- *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
- */
-
-static int ram_save_block(QEMUFile *f, bool last_stage)
+static void compress_threads_save_cleanup(void)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
-    int bytes_sent = 0;
-    MemoryRegion *mr;
-    ram_addr_t current_addr;
+    int i;
 
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    for (i = 0; i < Compress.nb_slots; i++) {
+        CompressSlot *slot = &Compress.slots[i];
 
-    while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
-        if (complete_round && block == last_seen_block &&
-            offset >= last_offset) {
-            break;
-        }
-        if (offset >= block->length) {
-            offset = 0;
-            block = QTAILQ_NEXT(block, next);
-            if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
-                complete_round = true;
-            }
-        } else {
-            uint8_t *p;
-            int cont = (block == last_sent_block) ?
-                RAM_SAVE_FLAG_CONTINUE : 0;
+        qemu_mutex_lock(&slot->lock);
+        slot->quit = true;
+        qemu_cond_signal(&slot->cond);
+        qemu_mutex_unlock(&slot->lock);
+        qemu_thread_join(&slot->thread);
 
-            p = memory_region_get_ram_ptr(mr) + offset;
+        qemu_cond_destroy(&slot->cond);
+        qemu_mutex_destroy(&slot->lock);
+        deflateEnd(&slot->stream);
+        g_free(slot->page);
+        g_free(slot->buf);
+    }
+    g_free(Compress.slots);
+    Compress.slots = NULL;
+    Compress.nb_slots = 0;
+    Compress.filled = 0;
+}
 
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent += 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
+static int compress_threads_save_setup(void)
+{
+    int i, level = migrate_compress_level();
 
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+    Compress.nb_slots = migrate_compress_threads();
+    Compress.slots = g_new0(CompressSlot, Compress.nb_slots);
+    Compress.head = 0;
+    Compress.filled = 0;
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
-                break;
-            }
+    g_free(Compress.acct);
+    Compress.nb_acct = Compress.nb_slots;
+    Compress.acct = g_new0(CompressThreadAcct, Compress.nb_acct);
+
+    for (i = 0; i < Compress.nb_slots; i++) {
+        CompressSlot *slot = &Compress.slots[i];
+
+        if (deflateInit(&slot->stream, level) != Z_OK) {
+            DPRINTF("Error initializing compression stream\n");
+            Compress.nb_slots = i;
+            compress_threads_save_cleanup();
+            return -1;
         }
+        slot->page = g_malloc(TARGET_PAGE_SIZE);
+        slot->buf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_mutex_init(&slot->lock);
+        qemu_cond_init(&slot->cond);
+        qemu_thread_create(&slot->thread, do_compress_thread, slot,
+                           QEMU_THREAD_JOINABLE);
     }
-    last_seen_block = block;
-    last_offset = offset;
-
-    return bytes_sent;
+    return 0;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+/* Wait for the oldest slot and write it to the stream */
+static int compress_flush_slot(QEMUFile *f)
 {
-    return migration_dirty_pages;
-}
+    int idx = Compress.head;
+    CompressSlot *slot = &Compress.slots[idx];
+    CompressThreadAcct *acct = &Compress.acct[idx];
+    int cont, bytes_sent;
+
+    qemu_mutex_lock(&slot->lock);
+    while (!slot->done) {
+        qemu_cond_wait(&slot->cond, &slot->lock);
+    }
+    slot->done = false;
+    qemu_mutex_unlock(&slot->lock);
+
+    cont = (slot->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (slot->len) {
+        bytes_sent = save_block_hdr(f, slot->block, slot->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, slot->len);
+        qemu_put_buffer(f, slot->buf, slot->len);
+        bytes_sent += 4 + slot->len;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+        acct->pages++;
+        acct->bytes += slot->len;
+    } else {
+        bytes_sent = save_block_hdr(f, slot->block, slot->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, slot->page, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        acct_info.compress_incompressible++;
+    }
+    acct->busy_ns = slot->busy_ns;
+    last_sent_block = slot->block;
 
-uint64_t ram_bytes_remaining(void)
-{
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    Compress.head = (Compress.head + 1) % Compress.nb_slots;
+    Compress.filled--;
+    return bytes_sent;
 }
 
-uint64_t ram_bytes_transferred(void)
+/* Write out all queued pages; needed before the end of each section */
+static int compress_flush(QEMUFile *f)
 {
-    return bytes_transferred;
+    int bytes_sent = 0;
+
+    while (Compress.filled) {
+        bytes_sent += compress_flush_slot(f);
+    }
+    return bytes_sent;
 }
 
-uint64_t ram_bytes_total(void)
+/* Queue a page for compression.  The header is only written when the slot
+ * is flushed, so the bytes returned belong to an older page, if any.
+ */
+static int compress_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         uint8_t *p)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
+    CompressSlot *slot;
+    int bytes_sent = 0;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    if (Compress.filled == Compress.nb_slots) {
+        bytes_sent = compress_flush_slot(f);
+    }
 
-    return total;
-}
+    slot = &Compress.slots[(Compress.head + Compress.filled) %
+                           Compress.nb_slots];
+    slot->block = block;
+    slot->offset = offset;
+    memcpy(slot->page, p, TARGET_PAGE_SIZE);
 
-static void migration_end(void)
-{
-    if (migration_bitmap) {
-        memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
-        migration_bitmap = NULL;
-    }
+    qemu_mutex_lock(&slot->lock);
+    slot->pending = true;
+    qemu_cond_signal(&slot->cond);
+    qemu_mutex_unlock(&slot->lock);
 
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
-        XBZRLE.cache = NULL;
-    }
+    Compress.filled++;
+    return bytes_sent;
 }
 
-static void ram_migration_cancel(void *opaque)
-{
-    migration_end();
-}
+/* Destination side: pages are inflated straight into guest memory by a
+ * pool of threads.  ram_load() waits for all of them at the end of each
+ * section, so a page is never written twice concurrently.
+ */
+typedef struct DecompressSlot {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* Protected by lock */
+    bool pending;
+    bool quit;
+    /* Protected by Decompress.lock */
+    bool busy;
+
+    z_stream stream;
+    uint8_t *buf;
+    size_t len;
+    void *host;
+} DecompressSlot;
 
-static void reset_ram_globals(void)
+static struct {
+    DecompressSlot *slots;
+    int nb_slots;
+    int next;
+    QemuMutex lock;
+    QemuCond cond;
+    bool error;
+} Decompress;
+
+static bool decompress_slot_page(DecompressSlot *slot)
 {
-    last_seen_block = NULL;
-    last_sent_block = NULL;
-    last_offset = 0;
-    last_version = ram_list.version;
-}
+    z_stream *zs = &slot->stream;
+    int ret;
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+    inflateReset(zs);
+    zs->next_in = slot->buf;
+    zs->avail_in = slot->len;
+    zs->next_out = slot->host;
+    zs->avail_out = TARGET_PAGE_SIZE;
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
-{
-    RAMBlock *block;
-    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    ret = inflate(zs, Z_FINISH);
+    return ret == Z_STREAM_END && zs->total_out == TARGET_PAGE_SIZE;
+}
 
-    migration_bitmap = bitmap_new(ram_pages);
-    bitmap_set(migration_bitmap, 0, ram_pages);
-    migration_dirty_pages = ram_pages;
+static void *do_decompress_thread(void *opaque)
+{
+    DecompressSlot *slot = opaque;
 
-    qemu_mutex_lock_ramlist();
-    bytes_transferred = 0;
-    reset_ram_globals();
+    qemu_mutex_lock(&slot->lock);
+    while (!slot->quit) {
+        bool ok;
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            DPRINTF("Error creating cache\n");
-            return -1;
+        if (!slot->pending) {
+            qemu_cond_wait(&slot->cond, &slot->lock);
+            continue;
         }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
-    }
+        slot->pending = false;
+        qemu_mutex_unlock(&slot->lock);
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+        ok = decompress_slot_page(slot);
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+        qemu_mutex_lock(&Decompress.lock);
+        if (!ok) {
+            Decompress.error = true;
+        }
+        slot->busy = false;
+        qemu_cond_broadcast(&Decompress.cond);
+        qemu_mutex_unlock(&Decompress.lock);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+        qemu_mutex_lock(&slot->lock);
     }
+    qemu_mutex_unlock(&slot->lock);
+    return NULL;
+}
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+static int decompress_threads_load_setup(void)
+{
+    int i;
 
+    Decompress.nb_slots = migrate_decompress_threads();
+    Decompress.slots = g_new0(DecompressSlot, Decompress.nb_slots);
+    Decompress.next = 0;
+    Decompress.error = false;
+    qemu_mutex_init(&Decompress.lock);
+    qemu_cond_init(&Decompress.cond);
+
+    for (i = 0; i < Decompress.nb_slots; i++) {
+        DecompressSlot *slot = &Decompress.slots[i];
+
+        if (inflateInit(&slot->stream) != Z_OK) {
+            fprintf(stderr, "Failed to initialize decompression stream\n");
+            Decompress.nb_slots = i;
+            ram_decompress_threads_join();
+            return -1;
+        }
+        slot->buf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_mutex_init(&slot->lock);
+        qemu_cond_init(&slot->cond);
+        qemu_thread_create(&slot->thread, do_decompress_thread, slot,
+                           QEMU_THREAD_JOINABLE);
+    }
     return 0;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+void ram_decompress_threads_join(void)
 {
-    int ret;
     int i;
-    int64_t t0;
-    int total_sent = 0;
 
-    qemu_mutex_lock_ramlist();
+    if (!Decompress.slots) {
+        return;
+    }
 
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
+    for (i = 0; i < Decompress.nb_slots; i++) {
+        DecompressSlot *slot = &Decompress.slots[i];
+
+        qemu_mutex_lock(&slot->lock);
+        slot->quit = true;
+        qemu_cond_signal(&slot->cond);
+        qemu_mutex_unlock(&slot->lock);
+        qemu_thread_join(&slot->thread);
+
+        qemu_cond_destroy(&slot->cond);
+        qemu_mutex_destroy(&slot->lock);
+        inflateEnd(&slot->stream);
+        g_free(slot->buf);
     }
+    g_free(Decompress.slots);
+    Decompress.slots = NULL;
+    Decompress.nb_slots = 0;
+    qemu_cond_destroy(&Decompress.cond);
+    qemu_mutex_destroy(&Decompress.lock);
+}
 
-    t0 = qemu_get_clock_ns(rt_clock);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+/* Wait until all queued pages are in guest memory */
+static int decompress_wait(void)
+{
+    int i, ret;
+
+    if (!Decompress.slots) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&Decompress.lock);
+    for (i = 0; i < Decompress.nb_slots; i++) {
+        while (Decompress.slots[i].busy) {
+            qemu_cond_wait(&Decompress.cond, &Decompress.lock);
+        }
+    }
+    ret = Decompress.error ? -EINVAL : 0;
+    Decompress.error = false;
+    qemu_mutex_unlock(&Decompress.lock);
+    return ret;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressSlot *slot = NULL;
+    uint32_t len;
+    int i;
+
+    len = qemu_get_be32(f);
+    if (len == 0 || len >= TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load compressed page - bad length %u\n",
+                len);
+        return -1;
+    }
+
+    if (!Decompress.slots && decompress_threads_load_setup() < 0) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&Decompress.lock);
+    while (!slot) {
+        for (i = 0; i < Decompress.nb_slots; i++) {
+            int idx = (Decompress.next + i) % Decompress.nb_slots;
+
+            if (!Decompress.slots[idx].busy) {
+                slot = &Decompress.slots[idx];
+                Decompress.next = (idx + 1) % Decompress.nb_slots;
+                break;
+            }
+        }
+        if (!slot) {
+            qemu_cond_wait(&Decompress.cond, &Decompress.lock);
+        }
+    }
+    slot->busy = true;
+    qemu_mutex_unlock(&Decompress.lock);
+
+    qemu_get_buffer(f, slot->buf, len);
+    slot->len = len;
+    slot->host = host;
+
+    qemu_mutex_lock(&slot->lock);
+    slot->pending = true;
+    qemu_cond_signal(&slot->cond);
+    qemu_mutex_unlock(&slot->lock);
+    return 0;
+}
+
+/* Multi-channel RAM transfer
+ *
+ * Pages are spread over extra connections by page number, so successive
+ * copies of a page always use the same connection and cannot overtake each
+ * other.  Each channel has a thread that takes pages from a short queue and
+ * writes them straight from guest RAM; the migration thread accounts them
+ * against the rate limit as it queues them.  The main stream announces the
+ * channels in the setup section and carries a sync marker at completion,
+ * and the destination waits for every channel to reach that marker before
+ * it loads device state.
+ *
+ * When a queue is full, the page is left dirty and the iteration ends.  The
+ * migration thread then waits for the queue to drain to half its length
+ * after dropping the iothread lock, see ram_channels_wait().  The last
+ * stage runs with the guest stopped and still waits for queue space.
+ */
+#define RAM_CHANNEL_QUEUE_LEN 256
+
+typedef struct RAMChannelPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *host;
+    int fill;           /* byte of a duplicate page, -1 for a normal page */
+} RAMChannelPage;
+
+typedef struct RAMChannel {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QEMUFile *file;
+    int fd;
+
+    /* Protected by lock */
+    RAMChannelPage queue[RAM_CHANNEL_QUEUE_LEN];
+    int head;
+    int count;
+    uint32_t sync_req;  /* sync marker the source asked for */
+    uint32_t synced;    /* last sync marker written or read */
+    bool quit;
+    bool done;          /* destination thread has stopped */
+    int error;
+
+    /* Owned by the channel thread */
+    RAMBlock *last_block;
+} RAMChannel;
+
+typedef struct RAMChannelAcct {
+    uint64_t pages;
+    uint64_t bytes;
+} RAMChannelAcct;
+
+static struct {
+    RAMChannel *ch;
+    int nb;
+    uint32_t sync_seq;
+    /* Kept after migration ends, for query-migrate */
+    RAMChannelAcct *acct;
+    int nb_acct;
+
+    /* Channel whose full queue stopped the last iteration, protected by
+     * wait_lock.  It is taken after the channel's lock and is never
+     * destroyed, so ram_channels_wait() can use it while the channels are
+     * freed by a cancel.
+     */
+    RAMChannel *full;
+    bool wait_init;
+    QemuMutex wait_lock;
+    QemuCond wait_cond;
+} Channels;
+
+/* Called with ch->lock held */
+static void ram_channel_wake(RAMChannel *ch)
+{
+    qemu_mutex_lock(&Channels.wait_lock);
+    if (Channels.full == ch) {
+        Channels.full = NULL;
+        qemu_cond_broadcast(&Channels.wait_cond);
+    }
+    qemu_mutex_unlock(&Channels.wait_lock);
+}
+
+/* Wait for the queue that stopped the last iteration to drain.  Called by
+ * the migration thread without the iothread lock.
+ */
+void ram_channels_wait(void)
+{
+    if (!Channels.wait_init) {
+        return;
+    }
+
+    qemu_mutex_lock(&Channels.wait_lock);
+    while (Channels.full) {
+        qemu_cond_wait(&Channels.wait_cond, &Channels.wait_lock);
+    }
+    qemu_mutex_unlock(&Channels.wait_lock);
+}
+
+MigrationChannelStatsList *ram_channel_stats(void)
+{
+    MigrationChannelStatsList *head = NULL, **next = &head;
+    int i;
+
+    for (i = 0; i < Channels.nb_acct; i++) {
+        MigrationChannelStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->channel = i;
+        entry->value->pages = Channels.acct[i].pages;
+        entry->value->bytes = Channels.acct[i].bytes;
+        *next = entry;
+        next = &entry->next;
+    }
+    return head;
+}
+
+static void ram_channel_send_page(RAMChannel *ch, RAMChannelAcct *acct,
+                                  RAMChannelPage *page)
+{
+    QEMUFile *f = ch->file;
+    int cont = (page->block == ch->last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    size_t bytes;
+
+    if (page->fill >= 0) {
+        bytes = save_block_hdr(f, page->block, page->offset, cont,
+                               RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, page->fill);
+        bytes += 1;
+    } else {
+        bytes = save_block_hdr(f, page->block, page->offset, cont,
+                               RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, page->host, TARGET_PAGE_SIZE);
+        bytes += TARGET_PAGE_SIZE;
+    }
+    ch->last_block = page->block;
+    acct->pages++;
+    acct->bytes += bytes;
+}
+
+static void *do_ram_channel_send_thread(void *opaque)
+{
+    RAMChannel *ch = opaque;
+    RAMChannelAcct *acct = &Channels.acct[ch - Channels.ch];
+    QEMUFile *f = ch->file;
+
+    qemu_mutex_lock(&ch->lock);
+    while (true) {
+        if (ch->count) {
+            RAMChannelPage page = ch->queue[ch->head];
+
+            ch->head = (ch->head + 1) % RAM_CHANNEL_QUEUE_LEN;
+            ch->count--;
+            if (ch->count == RAM_CHANNEL_QUEUE_LEN / 2) {
+                ram_channel_wake(ch);
+            }
+            qemu_cond_broadcast(&ch->cond);
+            qemu_mutex_unlock(&ch->lock);
+
+            ram_channel_send_page(ch, acct, &page);
+
+            qemu_mutex_lock(&ch->lock);
+            ch->error = qemu_file_get_error(f);
+        } else if (ch->synced != ch->sync_req) {
+            uint32_t seq = ch->sync_req;
+            int ret;
+
+            qemu_mutex_unlock(&ch->lock);
+            qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL_SYNC);
+            qemu_put_be32(f, seq);
+            ret = qemu_fflush(f);
+
+            qemu_mutex_lock(&ch->lock);
+            ch->error = ret < 0 ? ret : qemu_file_get_error(f);
+            ch->synced = seq;
+            qemu_cond_broadcast(&ch->cond);
+        } else if (ch->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&ch->cond, &ch->lock);
+        }
+    }
+    qemu_mutex_unlock(&ch->lock);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return NULL;
+}
+
+static void ram_channels_save_setup(QEMUFile *f)
+{
+    int *fds;
+    int i, n = migrate_take_channel_fds(&fds);
+
+    g_free(Channels.acct);
+    Channels.acct = NULL;
+    Channels.nb_acct = 0;
+    if (!n) {
+        return;
+    }
+
+    if (!Channels.wait_init) {
+        qemu_mutex_init(&Channels.wait_lock);
+        qemu_cond_init(&Channels.wait_cond);
+        Channels.wait_init = true;
+    }
+
+    Channels.ch = g_new0(RAMChannel, n);
+    Channels.nb = n;
+    Channels.sync_seq = 0;
+    Channels.acct = g_new0(RAMChannelAcct, n);
+    Channels.nb_acct = n;
+
+    for (i = 0; i < n; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        ch->fd = fds[i];
+        ch->file = qemu_fopen_socket(fds[i], "wb");
+        qemu_mutex_init(&ch->lock);
+        qemu_cond_init(&ch->cond);
+        qemu_thread_create(&ch->thread, do_ram_channel_send_thread, ch,
+                           QEMU_THREAD_JOINABLE);
+    }
+    g_free(fds);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+    qemu_put_be32(f, n);
+}
+
+/* Stop the sender threads once their queues are empty.  When @abort is
+ * true the connections are shut down first, so that a thread blocked on
+ * a stalled peer returns instead of sending the rest of its queue.
+ */
+static void ram_channels_save_cleanup(bool abort)
+{
+    int i;
+
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        if (abort) {
+            shutdown(ch->fd, SHUT_RDWR);
+        }
+        qemu_mutex_lock(&ch->lock);
+        ch->quit = true;
+        qemu_cond_broadcast(&ch->cond);
+        qemu_mutex_unlock(&ch->lock);
+    }
+
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        qemu_thread_join(&ch->thread);
+        qemu_fclose(ch->file);
+        qemu_cond_destroy(&ch->cond);
+        qemu_mutex_destroy(&ch->lock);
+    }
+    g_free(Channels.ch);
+    Channels.ch = NULL;
+    Channels.nb = 0;
+
+    if (Channels.wait_init) {
+        qemu_mutex_lock(&Channels.wait_lock);
+        Channels.full = NULL;
+        qemu_cond_broadcast(&Channels.wait_cond);
+        qemu_mutex_unlock(&Channels.wait_lock);
+    }
+}
+
+/* Queue a page for its channel.  If the queue is full, wait for space when
+ * @wait is true, otherwise return -1.
+ */
+static int ram_channel_queue_page(RAMBlock *block, ram_addr_t offset,
+                                  uint8_t *p, bool wait)
+{
+    ram_addr_t page_nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    RAMChannel *ch = &Channels.ch[page_nr % Channels.nb];
+    RAMChannelPage *page;
+    bool dup = is_dup_page(p);
+    int bytes;
+
+    qemu_mutex_lock(&ch->lock);
+    if (ch->count == RAM_CHANNEL_QUEUE_LEN && !wait) {
+        qemu_mutex_lock(&Channels.wait_lock);
+        Channels.full = ch;
+        qemu_mutex_unlock(&Channels.wait_lock);
+        qemu_mutex_unlock(&ch->lock);
+        return -1;
+    }
+    while (ch->count == RAM_CHANNEL_QUEUE_LEN) {
+        qemu_cond_wait(&ch->cond, &ch->lock);
+    }
+    page = &ch->queue[(ch->head + ch->count) % RAM_CHANNEL_QUEUE_LEN];
+    page->block = block;
+    page->offset = offset;
+    page->host = p;
+    page->fill = dup ? *p : -1;
+    ch->count++;
+    qemu_cond_broadcast(&ch->cond);
+    qemu_mutex_unlock(&ch->lock);
+
+    if (dup) {
+        acct_info.dup_pages++;
+        bytes = 8 + 1;
+    } else {
+        acct_info.norm_pages++;
+        bytes = 8 + TARGET_PAGE_SIZE;
+    }
+    migrate_account_channel_bytes(bytes);
+    return bytes;
+}
+
+static int ram_channels_error(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < Channels.nb && !ret; i++) {
+        qemu_mutex_lock(&Channels.ch[i].lock);
+        ret = Channels.ch[i].error;
+        qemu_mutex_unlock(&Channels.ch[i].lock);
+    }
+    return ret;
+}
+
+/* Make every channel write a sync marker after the pages queued so far,
+ * wait for them to be sent, then put the same marker in the main stream.
+ */
+static int ram_channels_sync(QEMUFile *f)
+{
+    uint32_t seq;
+    int i;
+
+    if (!Channels.nb) {
+        return 0;
+    }
+
+    seq = ++Channels.sync_seq;
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        qemu_mutex_lock(&ch->lock);
+        ch->sync_req = seq;
+        qemu_cond_broadcast(&ch->cond);
+        qemu_mutex_unlock(&ch->lock);
+    }
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        qemu_mutex_lock(&ch->lock);
+        while (ch->synced != seq) {
+            qemu_cond_wait(&ch->cond, &ch->lock);
+        }
+        qemu_mutex_unlock(&ch->lock);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL_SYNC);
+    qemu_put_be32(f, seq);
+    return ram_channels_error();
+}
+
+static ram_addr_t last_offset;
+static unsigned long *migration_bitmap;
+static uint64_t migration_dirty_pages;
+static uint32_t last_version;
+
+static inline
+ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
+                                                 ram_addr_t start)
+{
+    unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
+    unsigned long nr = base + (start >> TARGET_PAGE_BITS);
+    unsigned long size = base + (int128_get64(mr->size) >> TARGET_PAGE_BITS);
+
+    unsigned long next = find_next_bit(migration_bitmap, size, nr);
+
+    if (next < size) {
+        clear_bit(next, migration_bitmap);
+        migration_dirty_pages--;
+    }
+    return (next - base) << TARGET_PAGE_BITS;
+}
+
+static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
+                                              ram_addr_t offset)
+{
+    bool ret;
+    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+
+    ret = test_and_set_bit(nr, migration_bitmap);
+
+    if (!ret) {
+        migration_dirty_pages++;
+    }
+    return ret;
+}
+
+/* Auto-converge: once the guest has dirtied more than half of what was sent
+ * during MIG_THROTTLE_HIGH_PERIODS measurement periods while the expected
+ * downtime is still too long, throttle the vCPUs down some more.
+ */
+#define MIG_THROTTLE_INITIAL      20
+#define MIG_THROTTLE_INCREMENT    10
+#define MIG_THROTTLE_HIGH_PERIODS 2
+
+static int64_t dirty_period_start;
+static int64_t num_dirty_pages_period;
+static uint64_t bytes_xfer_prev;
+static int dirty_rate_high_cnt;
+
+static void mig_throttle_guest_down(void)
+{
+    int pct = cpu_throttle_get_percentage();
+
+    cpu_throttle_set(pct ? pct + MIG_THROTTLE_INCREMENT
+                         : MIG_THROTTLE_INITIAL);
+}
+
+static void migration_bitmap_sync(void)
+{
+    RAMBlock *block;
+    ram_addr_t addr;
+    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    MigrationState *s = migrate_get_current();
+    int64_t end_time;
+
+    if (!dirty_period_start) {
+        dirty_period_start = qemu_get_clock_ms(rt_clock);
+        bytes_xfer_prev = ram_bytes_transferred();
+    }
+
+    trace_migration_bitmap_sync_start();
+    memory_global_sync_dirty_bitmap(get_system_memory());
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
+            if (memory_region_test_and_clear_dirty(block->mr,
+                                                   addr, TARGET_PAGE_SIZE,
+                                                   DIRTY_MEMORY_MIGRATION)) {
+                migration_bitmap_set_dirty(block->mr, addr);
+                /* counted even if it is still pending from an earlier
+                 * sync, the guest did write to it again */
+                num_dirty_pages_period++;
+            }
+        }
+    }
+    trace_migration_bitmap_sync_end(migration_dirty_pages
+                                    - num_dirty_pages_init);
+    s->dirty_sync_count++;
+    end_time = qemu_get_clock_ms(rt_clock);
+
+    /* more than 1 second = 1000 millisecons */
+    if (end_time > dirty_period_start + 1000) {
+        int64_t elapsed = end_time - dirty_period_start;
+        uint64_t bytes_xfer_now = ram_bytes_transferred();
+        uint64_t bytes_dirty_period = num_dirty_pages_period *
+                                      TARGET_PAGE_SIZE;
+
+        s->dirty_pages_rate = num_dirty_pages_period * 1000 / elapsed;
+
+        if (migrate_auto_converge()) {
+            if (bytes_dirty_period > (bytes_xfer_now - bytes_xfer_prev) / 2 &&
+                s->expected_downtime > migrate_max_downtime() / 1000000) {
+                if (++dirty_rate_high_cnt >= MIG_THROTTLE_HIGH_PERIODS) {
+                    mig_throttle_guest_down();
+                    dirty_rate_high_cnt = 0;
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+            }
+        }
+
+        dirty_period_start = end_time;
+        num_dirty_pages_period = 0;
+        bytes_xfer_prev = bytes_xfer_now;
+    }
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f, or queues it
+ *                 for compression
+ *
+ * Returns:  The number of pages written or queued.
+ *           0 means no dirty pages, or that a channel queue is full
+ *
+ * The number of bytes actually written is stored in *bytes_sent.
+ */
+
+static int ram_save_block(QEMUFile *f, bool last_stage, int *bytes_sent)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int pages = 0;
+    MemoryRegion *mr;
+    ram_addr_t current_addr;
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        mr = block->mr;
+        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+            }
+        } else {
+            uint8_t *p;
+            bool zero_copy = true;
+            int cont = (block == last_sent_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            p = memory_region_get_ram_ptr(mr) + offset;
+
+            if (Channels.nb) {
+                /* the main stream does not carry the page at all */
+                *bytes_sent = ram_channel_queue_page(block, offset, p,
+                                                     last_stage);
+                if (*bytes_sent < 0) {
+                    /* the queue is full, send the page next time */
+                    migration_bitmap_set_dirty(mr, offset);
+                    *bytes_sent = 0;
+                } else {
+                    pages = 1;
+                }
+                break;
+            }
+
+            /* In doubt sent page as normal */
+            *bytes_sent = -1;
+            if (is_dup_page(p)) {
+                acct_info.dup_pages++;
+                *bytes_sent = save_block_hdr(f, block, offset, cont,
+                                             RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, *p);
+                *bytes_sent += 1;
+            } else if (Compress.slots) {
+                /* the header is written, and last_sent_block updated,
+                 * when the slot is flushed */
+                *bytes_sent = compress_page(f, block, offset, p);
+                pages = 1;
+                break;
+            } else if (migrate_use_xbzrle()) {
+                current_addr = block->offset + offset;
+                *bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                               offset, cont, last_stage);
+                if (!last_stage) {
+                    /* cache entries can be freed on eviction before the
+                     * page is flushed, so this one has to be copied */
+                    p = get_cached_data(XBZRLE.cache, current_addr);
+                    zero_copy = false;
+                }
+            }
+
+            /* XBZRLE overflow or normal page */
+            if (*bytes_sent == -1) {
+                *bytes_sent = save_block_hdr(f, block, offset, cont,
+                                             RAM_SAVE_FLAG_PAGE);
+                if (zero_copy) {
+                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                } else {
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                }
+                *bytes_sent += TARGET_PAGE_SIZE;
+                acct_info.norm_pages++;
+            }
+
+            /* if page is unmodified, continue to the next */
+            if (*bytes_sent > 0) {
+                last_sent_block = block;
+                pages = 1;
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    return pages;
+}
+
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static void migration_end(void)
+{
+    if (migration_bitmap) {
+        memory_global_dirty_log_stop();
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+    }
+
+    if (XBZRLE.cache) {
+        cache_get_stats(XBZRLE.cache, &XBZRLE.stats);
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.decoded_buf);
+        XBZRLE.cache = NULL;
+    }
+
+    compress_threads_save_cleanup();
+    ram_channels_save_cleanup(false);
+    cpu_throttle_stop();
+}
+
+/* Post-copy migration
+ *
+ * When asked to, the source stops, lists the pages it has not sent yet in
+ * the RAM section, and sends the device state.  The destination starts
+ * right away: it drops the listed pages from its RAM and registers the RAM
+ * with userfaultfd, so that the first access to a missing page blocks until
+ * the page arrives.  Pages that fault are asked for over the main
+ * connection, in the other direction, and the source sends them ahead of
+ * the others, which it pushes in RAM order meanwhile.
+ */
+
+#define POSTCOPY_BATCH 64
+
+typedef struct PostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(PostcopyRequest) next;
+} PostcopyRequest;
+
+/* Source side */
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QEMUFile *file;     /* page requests from the destination */
+    int fd;
+    bool running;
+
+    /* Protected by lock */
+    QSIMPLEQ_HEAD(, PostcopyRequest) requests;
+    /* Kept after migration ends, for query-migrate */
+    uint64_t nb_requests;
+} PostcopySave;
+
+uint64_t ram_postcopy_requests(void)
+{
+    return PostcopySave.nb_requests;
+}
+
+static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
+                                                         ram_addr_t offset)
+{
+    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+    bool ret = test_and_clear_bit(nr, migration_bitmap);
+
+    if (ret) {
+        migration_dirty_pages--;
+    }
+    return ret;
+}
+
+static void *do_postcopy_request_thread(void *opaque)
+{
+    QEMUFile *f = PostcopySave.file;
+
+    while (true) {
+        PostcopyRequest *req;
+        RAMBlock *block;
+        ram_addr_t offset;
+        char id[256];
+        uint8_t len;
+
+        offset = qemu_get_be64(f);
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        qemu_mutex_lock_ramlist();
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        qemu_mutex_unlock_ramlist();
+
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "post-copy: bad page request %s:" RAM_ADDR_FMT
+                    "\n", id, offset);
+            continue;
+        }
+
+        req = g_new(PostcopyRequest, 1);
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+        qemu_mutex_lock(&PostcopySave.lock);
+        QSIMPLEQ_INSERT_TAIL(&PostcopySave.requests, req, next);
+        PostcopySave.nb_requests++;
+        qemu_mutex_unlock(&PostcopySave.lock);
+    }
+    return NULL;
+}
+
+/* Called with the ramlist lock held, once the VM is stopped */
+static int ram_postcopy_save_setup(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret, fd;
+
+    /* pages still being compressed or on a channel have to land before
+     * the destination drops what it is going to receive again */
+    bytes_transferred += compress_flush(f);
+    ret = ram_channels_sync(f);
+    compress_threads_save_cleanup();
+    ram_channels_save_cleanup(false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        uint64_t i, npages = block->length >> TARGET_PAGE_BITS;
+        uint8_t *map = g_malloc0(DIV_ROUND_UP(npages, 8));
+
+        for (i = 0; i < npages; i++) {
+            if (test_bit(base + i, migration_bitmap)) {
+                map[i / 8] |= 1 << (i % 8);
+            }
+        }
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, npages);
+        qemu_put_buffer(f, map, DIV_ROUND_UP(npages, 8));
+        g_free(map);
+    }
+    qemu_put_byte(f, 0);
+
+    fd = dup(qemu_get_fd(f));
+    if (fd < 0) {
+        return -errno;
+    }
+    PostcopySave.fd = fd;
+    PostcopySave.file = qemu_fopen_socket(fd, "rb");
+    PostcopySave.nb_requests = 0;
+    QSIMPLEQ_INIT(&PostcopySave.requests);
+    qemu_mutex_init(&PostcopySave.lock);
+    qemu_thread_create(&PostcopySave.thread, do_postcopy_request_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    PostcopySave.running = true;
+
+    /* the pages that follow go to another thread on the destination */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+    return 0;
+}
+
+static void ram_postcopy_save_cleanup(void)
+{
+    PostcopyRequest *req;
+
+    if (!PostcopySave.running) {
+        return;
+    }
+
+    shutdown(PostcopySave.fd, SHUT_RD);
+    qemu_thread_join(&PostcopySave.thread);
+    qemu_fclose(PostcopySave.file);
+
+    while ((req = QSIMPLEQ_FIRST(&PostcopySave.requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&PostcopySave.requests, next);
+        g_free(req);
+    }
+    qemu_mutex_destroy(&PostcopySave.lock);
+    PostcopySave.running = false;
+}
+
+static bool ram_postcopy_next_request(RAMBlock **block, ram_addr_t *offset)
+{
+    PostcopyRequest *req;
+
+    qemu_mutex_lock(&PostcopySave.lock);
+    req = QSIMPLEQ_FIRST(&PostcopySave.requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&PostcopySave.requests, next);
+    }
+    qemu_mutex_unlock(&PostcopySave.lock);
+
+    if (!req) {
+        return false;
+    }
+    *block = req->block;
+    *offset = req->offset;
+    g_free(req);
+    return true;
+}
+
+/* The VM is stopped, so a single pass over the bitmap finds every page */
+static bool ram_postcopy_next_dirty(RAMBlock **pblock, ram_addr_t *poffset)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+
+    if (!block) {
+        block = QTAILQ_FIRST(&ram_list.blocks);
+    }
+
+    for (; block; block = QTAILQ_NEXT(block, next), offset = 0) {
+        offset = migration_bitmap_find_and_reset_dirty(block->mr, offset);
+        if (offset < block->length) {
+            last_seen_block = block;
+            last_offset = offset;
+            *pblock = block;
+            *poffset = offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int ram_postcopy_send_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes;
+
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        bytes = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes += 1;
+    } else {
+        acct_info.norm_pages++;
+        bytes = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes += TARGET_PAGE_SIZE;
+    }
+    last_sent_block = block;
+    return bytes;
+}
+
+/*
+ * ram_postcopy_send: Sends up to POSTCOPY_BATCH of the pages that the
+ *                    destination is missing, those it asked for first
+ *
+ * Returns:  1 if there are more pages to send
+ *           0 when all pages were sent and the end of the stream written
+ *           negative on error
+ */
+int ram_postcopy_send(QEMUFile *f)
+{
+    int i, ret;
+
+    qemu_mutex_lock_ramlist();
+    for (i = 0; i < POSTCOPY_BATCH; i++) {
+        RAMBlock *block;
+        ram_addr_t offset;
+
+        if (ram_postcopy_next_request(&block, &offset)) {
+            if (!migration_bitmap_test_and_reset_dirty(block->mr, offset)) {
+                /* already on its way */
+                continue;
+            }
+        } else if (!ram_postcopy_next_dirty(&block, &offset)) {
+            break;
+        }
+        bytes_transferred += ram_postcopy_send_page(f, block, offset);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    /* a vCPU may be waiting for one of these */
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (migration_dirty_pages) {
+        return 1;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    bytes_transferred += 8;
+    ram_postcopy_save_cleanup();
+    migration_end();
+    return 0;
+}
+
+static void ram_migration_cancel(void *opaque)
+{
+    ram_postcopy_save_cleanup();
+    ram_channels_save_cleanup(true);
+    migration_end();
+}
+
+static void reset_ram_globals(void)
+{
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+    last_version = ram_list.version;
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    migration_bitmap = bitmap_new(ram_pages);
+    bitmap_set(migration_bitmap, 0, ram_pages);
+    migration_dirty_pages = ram_pages;
+
+    qemu_mutex_lock_ramlist();
+    bytes_transferred = 0;
+    reset_ram_globals();
+    dirty_period_start = 0;
+    num_dirty_pages_period = 0;
+    dirty_rate_high_cnt = 0;
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            DPRINTF("Error creating cache\n");
+            return -1;
+        }
+        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        acct_clear();
+    }
+
+    if (migrate_use_compress()) {
+        if (compress_threads_save_setup() < 0) {
+            qemu_mutex_unlock_ramlist();
+            return -1;
+        }
+        acct_clear();
+    }
+
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    ram_channels_save_setup(f);
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int total_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    t0 = qemu_get_clock_ns(rt_clock);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent = 0;
 
-        bytes_sent = ram_save_block(f, false);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, false, &bytes_sent) == 0) {
             break;
         }
         total_sent += bytes_sent;
@@ -642,8 +1884,18 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    /* queued pages must not cross the end of the section */
+    total_sent += compress_flush(f);
     qemu_mutex_unlock_ramlist();
 
+    /* a channel that failed does not show up in the main stream */
+    if (ret >= 0) {
+        int error = ram_channels_error();
+        if (error) {
+            ret = error;
+        }
+    }
+
     if (ret < 0) {
         bytes_transferred += total_sent;
         return ret;
@@ -658,28 +1910,38 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
+    if (migrate_postcopy_active()) {
+        ret = ram_postcopy_save_setup(f);
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return ret;
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
     while (true) {
-        int bytes_sent;
+        int bytes_sent = 0;
 
-        bytes_sent = ram_save_block(f, true);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, true, &bytes_sent) == 0) {
             break;
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += compress_flush(f);
+    ret = ram_channels_sync(f);
     migration_end();
 
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    return 0;
+    return ret;
 }
 
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
@@ -766,6 +2028,567 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+static void ram_handle_fill(void *host, uint8_t ch)
+{
+    /* Reading a page that was never written does not allocate it, so leave
+     * pages that are already zero alone: restoring a snapshot or receiving
+     * a migration into fresh RAM then only allocates the pages in use.
+     */
+    if (ch == 0 && is_dup_page(host) && *(uint8_t *)host == 0) {
+        return;
+    }
+
+    memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+    if (ch == 0 &&
+        (!kvm_enabled() || kvm_has_sync_mmu()) &&
+        getpagesize() <= TARGET_PAGE_SIZE) {
+        qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
+/* Like host_from_stream_offset, for a thread other than the main loop: the
+ * block list is walked under the ramlist lock and the block must have a host
+ * mapping.  *@last_block is the thread's RAM_SAVE_FLAG_CONTINUE block.
+ */
+static void *ram_thread_host(QEMUFile *f, RAMBlock **last_block,
+                             ram_addr_t offset, int flags)
+{
+    RAMBlock *block = *last_block;
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        char id[256];
+        uint8_t len;
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        qemu_mutex_lock_ramlist();
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        qemu_mutex_unlock_ramlist();
+
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return NULL;
+        }
+        *last_block = block;
+    }
+
+    if (!block || !block->host || offset >= block->length) {
+        fprintf(stderr, "Ack, bad migration thread stream!\n");
+        return NULL;
+    }
+    return block->host + offset;
+}
+
+static void *do_ram_channel_recv_thread(void *opaque)
+{
+    RAMChannel *ch = opaque;
+    QEMUFile *f = ch->file;
+    ram_addr_t addr;
+    int flags, ret;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret || (flags & RAM_SAVE_FLAG_EOS)) {
+            break;
+        }
+
+        if (flags & RAM_SAVE_FLAG_CHANNEL_SYNC) {
+            uint32_t seq = qemu_get_be32(f);
+
+            if (qemu_file_get_error(f)) {
+                continue;
+            }
+            qemu_mutex_lock(&ch->lock);
+            ch->synced = seq;
+            qemu_cond_broadcast(&ch->cond);
+            qemu_mutex_unlock(&ch->lock);
+        } else if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            void *host = ram_thread_host(f, &ch->last_block, addr, flags);
+
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                ram_handle_fill(host, qemu_get_byte(f));
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
+        } else {
+            fprintf(stderr, "Unknown flags 0x%x on migration channel\n",
+                    flags);
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    qemu_mutex_lock(&ch->lock);
+    ch->error = ret;
+    ch->done = true;
+    qemu_cond_broadcast(&ch->cond);
+    qemu_mutex_unlock(&ch->lock);
+    return NULL;
+}
+
+static int ram_channels_load_setup(uint32_t n)
+{
+    int i;
+
+    if (Channels.nb || n == 0 || n > MAX_MIGRATE_CHANNELS) {
+        fprintf(stderr, "Bad number of migration channels %u\n", n);
+        return -EINVAL;
+    }
+
+    Channels.ch = g_new0(RAMChannel, n);
+    for (i = 0; i < n; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        ch->fd = migrate_incoming_accept_channel();
+        if (ch->fd < 0) {
+            fprintf(stderr, "Could not accept migration channel %d\n", i);
+            return -EINVAL;
+        }
+        ch->file = qemu_fopen_socket(ch->fd, "rb");
+        qemu_mutex_init(&ch->lock);
+        qemu_cond_init(&ch->cond);
+        qemu_thread_create(&ch->thread, do_ram_channel_recv_thread, ch,
+                           QEMU_THREAD_JOINABLE);
+        Channels.nb++;
+    }
+    return 0;
+}
+
+/* Wait until every channel has applied the pages sent before sync marker
+ * @seq, so that device state is loaded on top of complete RAM.
+ */
+static int ram_channels_load_sync(uint32_t seq)
+{
+    int i, ret = 0;
+
+    if (!Channels.nb) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+
+        qemu_mutex_lock(&ch->lock);
+        while (ch->synced != seq && !ch->done) {
+            qemu_cond_wait(&ch->cond, &ch->lock);
+        }
+        if (ch->synced != seq && !ret) {
+            ret = ch->error ? ch->error : -EINVAL;
+        }
+        qemu_mutex_unlock(&ch->lock);
+    }
+    return ret;
+}
+
+void ram_channels_join(void)
+{
+    int i;
+
+    for (i = 0; i < Channels.nb; i++) {
+        RAMChannel *ch = &Channels.ch[i];
+        bool done;
+
+        qemu_mutex_lock(&ch->lock);
+        done = ch->done;
+        qemu_mutex_unlock(&ch->lock);
+
+        /* everything that matters was received by the last sync; do not
+         * wait for the end of a stream that a failed source never sends */
+        if (!done) {
+            shutdown(ch->fd, SHUT_RDWR);
+        }
+        qemu_thread_join(&ch->thread);
+        qemu_fclose(ch->file);
+        qemu_cond_destroy(&ch->cond);
+        qemu_mutex_destroy(&ch->lock);
+    }
+    g_free(Channels.ch);
+    Channels.ch = NULL;
+    Channels.nb = 0;
+}
+
+/* Destination side of post-copy */
+static struct {
+    unsigned long *missing;     /* pages the source has not sent yet */
+    unsigned long *requested;   /* missing pages that were asked for */
+    QemuMutex lock;             /* protects the two bitmaps */
+    QEMUFile *file;
+    int fd;
+    int uffd;
+    int quit_fds[2];
+    QemuThread fault_thread;
+    QemuThread recv_thread;
+    bool started;
+} PostcopyLoad;
+
+/* The RAM section of the switch lists, for each block, a bitmap of the
+ * pages that the source is going to send again.
+ */
+static int ram_postcopy_load_discard(QEMUFile *f)
+{
+    uint8_t len;
+
+    if (!PostcopyLoad.missing) {
+        PostcopyLoad.missing =
+            bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    }
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+        unsigned long base;
+        uint64_t i, npages;
+        uint8_t *map;
+        char id[256];
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        npages = qemu_get_be64(f);
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || npages != block->length >> TARGET_PAGE_BITS) {
+            fprintf(stderr, "post-copy: bad page list for block %s\n", id);
+            return -EINVAL;
+        }
+
+        map = g_malloc(DIV_ROUND_UP(npages, 8));
+        qemu_get_buffer(f, map, DIV_ROUND_UP(npages, 8));
+        base = block->offset >> TARGET_PAGE_BITS;
+        for (i = 0; i < npages; i++) {
+            if (map[i / 8] & (1 << (i % 8))) {
+                set_bit(base + i, PostcopyLoad.missing);
+            }
+        }
+        g_free(map);
+
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+    }
+    return 0;
+}
+
+bool ram_postcopy_incoming_started(void)
+{
+    return PostcopyLoad.started;
+}
+
+#ifdef CONFIG_USERFAULTFD
+static void ram_postcopy_request_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t buf[8 + 1 + 256];
+    size_t len = strlen(block->idstr);
+
+    stq_be_p(buf, offset);
+    buf[8] = len;
+    memcpy(buf + 9, block->idstr, len);
+    if (qemu_send_full(PostcopyLoad.fd, buf, 9 + len, 0) != 9 + len) {
+        fprintf(stderr, "post-copy: could not request page %s:" RAM_ADDR_FMT
+                ": %s\n", block->idstr, offset, strerror(errno));
+    }
+}
+
+static void ram_postcopy_handle_fault(uint64_t address)
+{
+    uint8_t *host = (uint8_t *)(uintptr_t)
+        (address & ~(uint64_t)(TARGET_PAGE_SIZE - 1));
+    struct uffdio_zeropage zero;
+    RAMBlock *block;
+    ram_addr_t offset;
+    unsigned long nr;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (host >= block->host && host < block->host + block->length) {
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+    if (!block) {
+        fprintf(stderr, "post-copy: fault outside of RAM at %p\n", host);
+        return;
+    }
+    offset = host - block->host;
+    nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+    qemu_mutex_lock(&PostcopyLoad.lock);
+    if (test_bit(nr, PostcopyLoad.missing)) {
+        bool request = !test_and_set_bit(nr, PostcopyLoad.requested);
+
+        qemu_mutex_unlock(&PostcopyLoad.lock);
+        if (request) {
+            ram_postcopy_request_page(block, offset);
+        }
+        return;
+    }
+    qemu_mutex_unlock(&PostcopyLoad.lock);
+
+    /* Either the page arrived after the fault was raised, or it is a zero
+     * page that was dropped with MADV_DONTNEED before the switch.
+     */
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = TARGET_PAGE_SIZE;
+    zero.mode = 0;
+    if (ioctl(PostcopyLoad.uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+        errno == EEXIST) {
+        ioctl(PostcopyLoad.uffd, UFFDIO_WAKE, &zero.range);
+    }
+}
+
+static void *do_postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = PostcopyLoad.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = PostcopyLoad.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        struct uffd_msg msg;
+        ssize_t len;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(PostcopyLoad.uffd, &msg, sizeof(msg));
+        if (len != sizeof(msg)) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            fprintf(stderr, "post-copy: cannot read userfaultfd\n");
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            ram_postcopy_handle_fault(msg.arg.pagefault.address);
+        }
+    }
+    return NULL;
+}
+
+/* Map the page with its contents, which also wakes up whoever faulted on
+ * it, and only then mark it as received.
+ */
+static int ram_postcopy_place_page(RAMBlock *block, ram_addr_t offset,
+                                   uint8_t *buf)
+{
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    struct uffdio_copy copy;
+    int ret;
+
+    copy.dst = (uintptr_t)block->host + offset;
+    copy.src = (uintptr_t)buf;
+    copy.len = TARGET_PAGE_SIZE;
+    copy.mode = 0;
+    do {
+        ret = ioctl(PostcopyLoad.uffd, UFFDIO_COPY, &copy);
+    } while (ret < 0 && errno == EAGAIN);
+    if (ret < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    qemu_mutex_lock(&PostcopyLoad.lock);
+    clear_bit(nr, PostcopyLoad.missing);
+    qemu_mutex_unlock(&PostcopyLoad.lock);
+    return 0;
+}
+
+static void ram_postcopy_incoming_cleanup(void)
+{
+    char c = 0;
+
+    if (qemu_write_full(PostcopyLoad.quit_fds[1], &c, 1) != 1) {
+        abort();
+    }
+    qemu_thread_join(&PostcopyLoad.fault_thread);
+    close(PostcopyLoad.quit_fds[0]);
+    close(PostcopyLoad.quit_fds[1]);
+
+    /* every page is there, so this is where RAM turns into plain memory */
+    close(PostcopyLoad.uffd);
+    qemu_fclose(PostcopyLoad.file);
+
+    g_free(PostcopyLoad.missing);
+    g_free(PostcopyLoad.requested);
+    PostcopyLoad.missing = NULL;
+    PostcopyLoad.requested = NULL;
+    qemu_mutex_destroy(&PostcopyLoad.lock);
+}
+
+static void *do_postcopy_recv_thread(void *opaque)
+{
+    QEMUFile *f = PostcopyLoad.file;
+    RAMBlock *last_block = NULL;
+    uint8_t *buf = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int flags, ret;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret || (flags & RAM_SAVE_FLAG_EOS)) {
+            break;
+        }
+        if (!(flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE))) {
+            fprintf(stderr, "Unknown flags 0x%x in post-copy stream\n",
+                    flags);
+            ret = -EINVAL;
+            break;
+        }
+        if (!ram_thread_host(f, &last_block, addr, flags)) {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(buf, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        } else {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        }
+        ret = qemu_file_get_error(f);
+        if (ret == 0) {
+            ret = ram_postcopy_place_page(last_block, addr, buf);
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        /* The missing pages are gone along with the source.  Anything that
+         * faults on one of them stays blocked until QEMU exits.
+         */
+        fprintf(stderr, "post-copy migration failed: %s\n", strerror(-ret));
+        qemu_system_shutdown_request();
+        return NULL;
+    }
+
+    ram_postcopy_incoming_cleanup();
+    DPRINTF("post-copy migration complete\n");
+    return NULL;
+}
+
+/* Called after the RAM section of the switch, before device state is
+ * loaded: from now on @f carries the missing pages and is read by another
+ * thread.
+ */
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    struct uffdio_api api;
+    RAMBlock *block;
+
+    if (!PostcopyLoad.missing || PostcopyLoad.started) {
+        fprintf(stderr, "post-copy: unexpected device state package\n");
+        return -EINVAL;
+    }
+    if (xen_enabled() || getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "post-copy: not supported with this guest RAM\n");
+        return -ENOTSUP;
+    }
+
+    PostcopyLoad.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (PostcopyLoad.uffd < 0) {
+        fprintf(stderr, "post-copy: userfaultfd: %s\n", strerror(errno));
+        return -errno;
+    }
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(PostcopyLoad.uffd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "post-copy: userfaultfd API: %s\n", strerror(errno));
+        close(PostcopyLoad.uffd);
+        return -ENOTSUP;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->length >> TARGET_PAGE_BITS);
+        unsigned long nr = find_next_bit(PostcopyLoad.missing, end, base);
+        struct uffdio_register reg;
+
+        /* drop the stale copies, so that the first access faults */
+        while (nr < end) {
+            unsigned long last = find_next_zero_bit(PostcopyLoad.missing,
+                                                    end, nr);
+
+            if (qemu_madvise(block->host + ((nr - base) << TARGET_PAGE_BITS),
+                             (last - nr) << TARGET_PAGE_BITS,
+                             QEMU_MADV_DONTNEED) < 0) {
+                fprintf(stderr, "post-copy: cannot drop pages of %s\n",
+                        block->idstr);
+                close(PostcopyLoad.uffd);
+                return -ENOTSUP;
+            }
+            nr = find_next_bit(PostcopyLoad.missing, end, last);
+        }
+
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(PostcopyLoad.uffd, UFFDIO_REGISTER, &reg) < 0 ||
+            !(reg.ioctls & ((uint64_t)1 << _UFFDIO_COPY))) {
+            fprintf(stderr, "post-copy: cannot register %s: %s\n",
+                    block->idstr, strerror(errno));
+            close(PostcopyLoad.uffd);
+            return -ENOTSUP;
+        }
+    }
+
+    if (qemu_pipe(PostcopyLoad.quit_fds) < 0) {
+        close(PostcopyLoad.uffd);
+        return -errno;
+    }
+
+    PostcopyLoad.file = f;
+    PostcopyLoad.fd = qemu_get_fd(f);
+    socket_set_block(PostcopyLoad.fd);
+    PostcopyLoad.requested =
+        bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    qemu_mutex_init(&PostcopyLoad.lock);
+    qemu_thread_create(&PostcopyLoad.fault_thread, do_postcopy_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&PostcopyLoad.recv_thread, do_postcopy_recv_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    PostcopyLoad.started = true;
+    return 0;
+}
+#else
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    fprintf(stderr, "post-copy: not supported on this host\n");
+    return -ENOTSUP;
+}
+#endif
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -823,43 +2646,73 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
+        if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            ret = ram_channels_load_setup(qemu_get_be32(f));
+            if (ret < 0) {
+                goto done;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_CHANNEL_SYNC) {
+            ret = ram_channels_load_sync(qemu_get_be32(f));
+            if (ret < 0) {
+                fprintf(stderr, "Failed to load RAM from migration "
+                        "channels\n");
+                goto done;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_postcopy_load_discard(f);
+            if (ret < 0) {
+                goto done;
+            }
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu()) &&
-                getpagesize() <= TARGET_PAGE_SIZE) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
-#endif
+            ram_handle_fill(host, ch);
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             if (load_xbzrle(f, addr, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            if (load_compressed_page(f, host) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -869,6 +2722,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (decompress_wait() < 0) {
+        fprintf(stderr, "Failed to load compressed page - inflate error!\n");
+        if (ret == 0) {
+            ret = -EINVAL;
+        }
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
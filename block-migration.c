@@ -21,7 +21,9 @@
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
+#include "block/thread-pool.h"
 #include <assert.h>
+#include <zlib.h>
 
 #define BLOCK_SIZE                       (1 << 20)
 #define BDRV_SECTORS_PER_DIRTY_CHUNK     (BLOCK_SIZE >> BDRV_SECTOR_BITS)
@@ -29,9 +31,18 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_COMPRESSED         0x10
+#define BLK_MIG_FLAG_DUP_BLOCK          0x20
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Maximum number of blocks being read or waiting to be sent */
+#define BLK_MIG_MAX_QUEUED              64
+
+/* Deduplication identifies blocks by their SHA-256 digest */
+#define BLK_MIG_DIGEST_SIZE             32
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -53,6 +64,7 @@ typedef struct BlkMigDevState {
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
+    struct BlkMigSent **sent;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -65,8 +77,22 @@ typedef struct BlkMigBlock {
     BlockDriverAIOCB *aiocb;
     int ret;
     QSIMPLEQ_ENTRY(BlkMigBlock) entry;
+
+    /* Filled in by blk_mig_prepare */
+    bool zero;
+    bool has_digest;
+    uint8_t digest[BLK_MIG_DIGEST_SIZE];
+    uint8_t *zbuf;
+    int zlen;
 } BlkMigBlock;
 
+/* A full block whose contents the destination has at bmds/sector */
+typedef struct BlkMigSent {
+    uint8_t digest[BLK_MIG_DIGEST_SIZE];
+    BlkMigDevState *bmds;
+    int64_t sector;
+} BlkMigSent;
+
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
@@ -79,24 +105,166 @@ typedef struct BlkMigState {
     int prev_progress;
     int bulk_completed;
     long double prev_time_offset;
+
+    bool zero_blocks;
+    bool compress;
+    bool dedup;
+    GHashTable *sent;
+    int64_t blocks_sent;
+    int64_t bytes_sent;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
 
+static void blk_free(BlkMigBlock *blk)
+{
+    g_free(blk->zbuf);
+    g_free(blk->buf);
+    g_free(blk);
+}
+
+static guint blk_mig_digest_hash(gconstpointer key)
+{
+    guint hash;
+
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean blk_mig_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, BLK_MIG_DIGEST_SIZE);
+}
+
+static bool blk_mig_needs_prepare(void)
+{
+    return block_mig_state.zero_blocks || block_mig_state.compress ||
+           block_mig_state.dedup;
+}
+
+/* Look at the contents of a block that was just read, to find out how to
+ * send it.  Runs in the thread pool.
+ */
+static int blk_mig_prepare(void *opaque)
+{
+    BlkMigBlock *blk = opaque;
+    size_t len = blk->nr_sectors * BDRV_SECTOR_SIZE;
+
+    if (block_mig_state.zero_blocks && buffer_is_zero(blk->buf, len)) {
+        blk->zero = true;
+        return 0;
+    }
+
+#if GLIB_CHECK_VERSION(2, 16, 0)
+    if (block_mig_state.dedup &&
+        blk->nr_sectors == BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+        gsize digest_len = sizeof(blk->digest);
+
+        g_checksum_update(checksum, blk->buf, len);
+        g_checksum_get_digest(checksum, blk->digest, &digest_len);
+        g_checksum_free(checksum);
+        blk->has_digest = true;
+    }
+#endif
+
+    if (block_mig_state.compress) {
+        uLongf zlen = compressBound(len);
+
+        blk->zbuf = g_malloc(zlen);
+        if (compress2(blk->zbuf, &zlen, blk->buf, len, Z_BEST_SPEED) == Z_OK &&
+            zlen < len) {
+            blk->zlen = zlen;
+        } else {
+            g_free(blk->zbuf);
+            blk->zbuf = NULL;
+        }
+    }
+    return 0;
+}
+
+/* Forget what the destination had at the location of @blk, and return an
+ * already sent block with the same contents, if there is one.
+ */
+static BlkMigSent *blk_mig_dedup(BlkMigBlock *blk)
+{
+    BlkMigDevState *bmds = blk->bmds;
+    int64_t chunk = blk->sector / BDRV_SECTORS_PER_DIRTY_CHUNK;
+    BlkMigSent *sent;
+
+    if (!block_mig_state.dedup) {
+        return NULL;
+    }
+
+    sent = bmds->sent[chunk];
+    if (sent) {
+        if (g_hash_table_lookup(block_mig_state.sent, sent->digest) == sent) {
+            g_hash_table_remove(block_mig_state.sent, sent->digest);
+        }
+        g_free(sent);
+        bmds->sent[chunk] = NULL;
+    }
+
+    if (!blk->has_digest || blk->zero) {
+        return NULL;
+    }
+
+    sent = g_hash_table_lookup(block_mig_state.sent, blk->digest);
+    if (sent) {
+        return sent;
+    }
+
+    sent = g_new(BlkMigSent, 1);
+    memcpy(sent->digest, blk->digest, BLK_MIG_DIGEST_SIZE);
+    sent->bmds = bmds;
+    sent->sector = blk->sector;
+    bmds->sent[chunk] = sent;
+    g_hash_table_insert(block_mig_state.sent, sent->digest, sent);
+    return NULL;
+}
+
+static void blk_put_device_name(QEMUFile *f, BlockDriverState *bs)
+{
+    int len = strlen(bs->device_name);
+
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bs->device_name, len);
+}
+
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
-    int len;
+    int64_t start = qemu_ftell(f);
+    BlkMigSent *dup = blk_mig_dedup(blk);
+    int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (blk->zero) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    } else if (dup) {
+        flags |= BLK_MIG_FLAG_DUP_BLOCK;
+    } else if (blk->zbuf) {
+        flags |= BLK_MIG_FLAG_COMPRESSED;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    blk_put_device_name(f, blk->bmds->bs);
+
+    if (blk->zero) {
+        /* nothing else to send */
+    } else if (dup) {
+        blk_put_device_name(f, dup->bmds->bs);
+        qemu_put_be64(f, dup->sector);
+    } else if (blk->zbuf) {
+        qemu_put_be32(f, blk->zlen);
+        qemu_put_buffer(f, blk->zbuf, blk->zlen);
+    } else {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    block_mig_state.blocks_sent++;
+    block_mig_state.bytes_sent += qemu_ftell(f) - start;
 }
 
 int blk_mig_active(void)
@@ -177,6 +345,21 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
 
+/* Blocks still count as submitted and in flight until they are prepared,
+ * so that a newer copy of the same chunk cannot overtake them.
+ */
+static void blk_mig_block_ready(void *opaque, int ret)
+{
+    BlkMigBlock *blk = opaque;
+
+    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+
+    block_mig_state.submitted--;
+    block_mig_state.read_done++;
+    assert(block_mig_state.submitted >= 0);
+}
+
 static void blk_mig_read_cb(void *opaque, int ret)
 {
     long double curr_time = qemu_get_clock_ns(rt_clock);
@@ -186,12 +369,14 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     block_mig_state.prev_time_offset = curr_time;
 
-    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
-    bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+    if (ret == 0 && blk_mig_needs_prepare()) {
+        ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
-    assert(block_mig_state.submitted >= 0);
+        thread_pool_submit_aio(pool, blk_mig_prepare, blk,
+                               blk_mig_block_ready, blk);
+        return;
+    }
+    blk_mig_block_ready(blk, 0);
 }
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -226,7 +411,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
+    blk = g_malloc0(sizeof(BlkMigBlock));
     blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
@@ -277,6 +462,11 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
         bmds->completed_sectors = 0;
         bmds->shared_base = block_mig_state.shared_base;
         alloc_aio_bitmap(bmds);
+        if (block_mig_state.dedup) {
+            bmds->sent = g_new0(BlkMigSent *,
+                                DIV_ROUND_UP(sectors,
+                                             BDRV_SECTORS_PER_DIRTY_CHUNK));
+        }
         drive_get_ref(drive_get_by_blockdev(bs));
         bdrv_set_in_use(bs, 1);
 
@@ -301,6 +491,16 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.blocks_sent = 0;
+    block_mig_state.bytes_sent = 0;
+
+    block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.compress = migrate_compress_blocks();
+    block_mig_state.dedup = migrate_dedup_blocks();
+    if (block_mig_state.dedup) {
+        block_mig_state.sent = g_hash_table_new(blk_mig_digest_hash,
+                                                blk_mig_digest_equal);
+    }
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -371,7 +571,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
-            blk = g_malloc(sizeof(BlkMigBlock));
+            blk = g_malloc0(sizeof(BlkMigBlock));
             blk->buf = g_malloc(BLOCK_SIZE);
             blk->bmds = bmds;
             blk->sector = sector;
@@ -395,10 +595,11 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                 if (ret < 0) {
                     goto error;
                 }
+                if (blk_mig_needs_prepare()) {
+                    blk_mig_prepare(blk);
+                }
                 blk_send(f, blk);
-
-                g_free(blk->buf);
-                g_free(blk);
+                blk_free(blk);
             }
 
             bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
@@ -412,8 +613,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_free(blk);
     return ret;
 }
 
@@ -456,8 +656,7 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
 
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
 
         block_mig_state.read_done--;
         block_mig_state.transferred++;
@@ -495,15 +694,31 @@ static void blk_mig_cleanup(void)
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.bmds_list, entry);
         bdrv_set_in_use(bmds->bs, 0);
         drive_put_ref(drive_get_by_blockdev(bmds->bs));
+        if (bmds->sent) {
+            int64_t i, chunks = DIV_ROUND_UP(bmds->total_sectors,
+                                             BDRV_SECTORS_PER_DIRTY_CHUNK);
+
+            for (i = 0; i < chunks; i++) {
+                g_free(bmds->sent[i]);
+            }
+            g_free(bmds->sent);
+        }
         g_free(bmds->aio_bitmap);
         g_free(bmds);
     }
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
+    }
+
+    if (block_mig_state.sent) {
+        g_hash_table_destroy(block_mig_state.sent);
+        block_mig_state.sent = NULL;
     }
+
+    DPRINTF("Sent %" PRId64 " blocks in %" PRId64 " bytes\n",
+            block_mig_state.blocks_sent, block_mig_state.bytes_sent);
 }
 
 static void block_migration_cancel(void *opaque)
@@ -536,6 +751,25 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/* Keep enough reads in flight to fill the rate limit.  Zero, compressed and
+ * duplicate blocks take less than BLOCK_SIZE on the wire, so estimate what
+ * the queued blocks will take from the blocks sent so far.
+ */
+static bool blk_mig_can_queue(QEMUFile *f)
+{
+    int queued = block_mig_state.submitted + block_mig_state.read_done;
+    int64_t block_bytes = BLOCK_SIZE;
+
+    if (queued >= BLK_MIG_MAX_QUEUED) {
+        return false;
+    }
+    if (block_mig_state.blocks_sent) {
+        block_bytes = block_mig_state.bytes_sent / block_mig_state.blocks_sent;
+        block_bytes = MAX(block_bytes, BDRV_SECTOR_SIZE);
+    }
+    return queued * block_bytes < qemu_file_get_rate_limit(f);
+}
+
 static int block_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
@@ -553,9 +787,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     blk_mig_reset_dirty_cursor();
 
     /* control the rate of transfer */
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    while (blk_mig_can_queue(f)) {
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
             if (blk_mig_save_bulked_block(f) == 0) {
@@ -639,11 +871,74 @@ static uint64_t block_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return pending;
 }
 
+static BlockDriverState *blk_get_device(QEMUFile *f)
+{
+    char device_name[256];
+    BlockDriverState *bs;
+    int len;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)device_name, len);
+    device_name[len] = '\0';
+
+    bs = bdrv_find(device_name);
+    if (!bs) {
+        fprintf(stderr, "Error unknown block device %s\n", device_name);
+    }
+    return bs;
+}
+
+/* Read the data of a device block into @buf, which can hold BLOCK_SIZE
+ * bytes.  The block is @nr_sectors long.
+ */
+static int blk_load_data(QEMUFile *f, int flags, uint8_t *buf, int nr_sectors)
+{
+    size_t len = nr_sectors * BDRV_SECTOR_SIZE;
+
+    if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+        memset(buf, 0, len);
+    } else if (flags & BLK_MIG_FLAG_DUP_BLOCK) {
+        BlockDriverState *src = blk_get_device(f);
+        int64_t sector = qemu_get_be64(f);
+
+        if (!src) {
+            return -EINVAL;
+        }
+        if (nr_sectors != BDRV_SECTORS_PER_DIRTY_CHUNK || sector < 0 ||
+            sector + nr_sectors > bdrv_getlength(src) >> BDRV_SECTOR_BITS) {
+            fprintf(stderr, "Invalid duplicate block reference\n");
+            return -EINVAL;
+        }
+        return bdrv_read(src, sector, buf, nr_sectors);
+    } else if (flags & BLK_MIG_FLAG_COMPRESSED) {
+        uLongf zbound = compressBound(BLOCK_SIZE);
+        uLongf out_len = BLOCK_SIZE;
+        uint32_t zlen = qemu_get_be32(f);
+        uint8_t *zbuf;
+        int ret;
+
+        if (zlen > zbound) {
+            fprintf(stderr, "Invalid compressed block size %u\n", zlen);
+            return -EINVAL;
+        }
+        zbuf = g_malloc(zlen);
+        qemu_get_buffer(f, zbuf, zlen);
+        ret = uncompress(buf, &out_len, zbuf, zlen);
+        g_free(zbuf);
+        if (ret != Z_OK || out_len != len) {
+            fprintf(stderr, "Error decompressing block\n");
+            return -EINVAL;
+        }
+    } else {
+        qemu_get_buffer(f, buf, BLOCK_SIZE);
+    }
+    return 0;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
-    int len, flags;
-    char device_name[256];
+    int flags;
     int64_t addr;
     BlockDriverState *bs, *bs_prev = NULL;
     uint8_t *buf;
@@ -658,15 +953,8 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
         addr >>= BDRV_SECTOR_BITS;
 
         if (flags & BLK_MIG_FLAG_DEVICE_BLOCK) {
-            /* get device name */
-            len = qemu_get_byte(f);
-            qemu_get_buffer(f, (uint8_t *)device_name, len);
-            device_name[len] = '\0';
-
-            bs = bdrv_find(device_name);
+            bs = blk_get_device(f);
             if (!bs) {
-                fprintf(stderr, "Error unknown block device %s\n",
-                        device_name);
                 return -EINVAL;
             }
 
@@ -675,7 +963,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
                 if (total_sectors <= 0) {
                     error_report("Error getting length of block device %s",
-                                 device_name);
+                                 bs->device_name);
                     return -EINVAL;
                 }
             }
@@ -688,8 +976,10 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
 
             buf = g_malloc(BLOCK_SIZE);
 
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            ret = blk_load_data(f, flags, buf, nr_sectors);
+            if (ret == 0) {
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+            }
 
             g_free(buf);
             if (ret < 0) {
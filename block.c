@@ -27,6 +27,7 @@
 #include "monitor/monitor.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/shared-cache.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -86,16 +87,24 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
-
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
 
+/* A named set of devices that share an aggregate I/O limit.  Members are
+ * the devices whose throttle_group points here; the group lives as long as
+ * it has members.
+ */
+struct BlockThrottleGroup {
+    char *name;
+    BlockIOLimit io_limits;
+    ThrottleState throttle_state;
+    int refcount;
+    QLIST_ENTRY(BlockThrottleGroup) list;
+};
+
+static QLIST_HEAD(, BlockThrottleGroup) throttle_groups =
+    QLIST_HEAD_INITIALIZER(throttle_groups);
+
 static QLIST_HEAD(, BlockDriver) bdrv_drivers =
     QLIST_HEAD_INITIALIZER(bdrv_drivers);
 
@@ -125,6 +134,29 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
+/* How far beyond the caller's request a bulk extent lookup may look */
+#define BDRV_EXTENT_CACHE_RANGE (64 * 1024 * 1024 / BDRV_SECTOR_SIZE)
+
+/*
+ * Forget cached allocation state after [sector_num, sector_num + nb_sectors)
+ * was modified.  Lookups that are still in flight will not store their result
+ * either since it may predate the modification.
+ */
+static void bdrv_invalidate_extent_cache(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         int64_t nb_sectors)
+{
+    int n = bs->extent_cache_count;
+
+    bs->extent_cache_generation++;
+
+    if (n && sector_num < bs->extent_cache[n - 1].sector_num +
+                          bs->extent_cache[n - 1].nb_sectors &&
+        sector_num + nb_sectors > bs->extent_cache[0].sector_num) {
+        bs->extent_cache_count = 0;
+    }
+}
+
 /* throttling disk I/O limits */
 void bdrv_io_limits_disable(BlockDriverState *bs)
 {
@@ -137,11 +169,6 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
         qemu_free_timer(bs->block_timer);
         bs->block_timer = NULL;
     }
-
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
 }
 
 static void bdrv_block_timer(void *opaque)
@@ -160,19 +187,46 @@ void bdrv_io_limits_enable(BlockDriverState *bs)
 
 bool bdrv_io_limits_enabled(BlockDriverState *bs)
 {
-    BlockIOLimit *io_limits = &bs->io_limits;
-    return io_limits->bps[BLOCK_IO_LIMIT_READ]
-         || io_limits->bps[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
-         || io_limits->iops[BLOCK_IO_LIMIT_READ]
-         || io_limits->iops[BLOCK_IO_LIMIT_WRITE]
-         || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
+    return throttle_enabled(&bs->throttle_state) ||
+           (bs->throttle_group &&
+            throttle_enabled(&bs->throttle_group->throttle_state));
+}
+
+static void bdrv_throttle_group_leave(BlockDriverState *bs)
+{
+    BlockThrottleGroup *tg = bs->throttle_group;
+
+    if (!tg) {
+        return;
+    }
+
+    bs->throttle_group = NULL;
+    if (--tg->refcount == 0) {
+        QLIST_REMOVE(tg, list);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, bool is_write,
+                                   int64_t now)
+{
+    int64_t wait, group_wait;
+
+    wait = throttle_compute_wait(&bs->throttle_state, is_write, now);
+    if (bs->throttle_group) {
+        group_wait = throttle_compute_wait(&bs->throttle_group->throttle_state,
+                                           is_write, now);
+        wait = MAX(wait, group_wait);
+    }
+    return wait;
 }
 
 static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      bool is_write, int nb_sectors)
 {
-    int64_t wait_time = -1;
+    uint64_t bytes = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t now, wait;
 
     if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
         qemu_co_queue_wait(&bs->throttled_reqs);
@@ -185,12 +239,21 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      * be still in throttled_reqs queue.
      */
 
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+    for (;;) {
+        now = qemu_get_clock_ns(vm_clock);
+        wait = bdrv_io_limits_wait(bs, is_write, now);
+        if (!wait) {
+            break;
+        }
+        qemu_mod_timer(bs->block_timer, now + wait);
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
+    throttle_account(&bs->throttle_state, is_write, bytes);
+    if (bs->throttle_group) {
+        throttle_account(&bs->throttle_group->throttle_state, is_write, bytes);
+    }
+
     qemu_co_queue_next(&bs->throttled_reqs);
 }
 
@@ -310,6 +373,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     }
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
+    bs->aio_context = qemu_get_aio_context();
 
     return bs;
 }
@@ -768,6 +832,9 @@ int bdrv_open_backing_file(BlockDriverState *bs)
     /* backing files always opened read-only */
     back_flags = bs->open_flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT);
 
+    /* the whole backing chain shares the cache setting of the device */
+    bs->backing_hd->shared_cache_size = bs->shared_cache_size;
+
     ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
     if (ret < 0) {
         bdrv_delete(bs->backing_hd);
@@ -775,6 +842,11 @@ int bdrv_open_backing_file(BlockDriverState *bs)
         bs->open_flags |= BDRV_O_NO_BACKING;
         return ret;
     }
+
+    if (bs->shared_cache_size) {
+        bs->backing_hd->shared_cache =
+            shared_cache_open(bs->backing_hd, bs->shared_cache_size);
+    }
     return 0;
 }
 
@@ -1141,12 +1213,15 @@ void bdrv_reopen_abort(BDRVReopenState *reopen_state)
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /* Let users such as the NBD server and data plane let go of bs first */
+    notifier_list_notify(&bs->close_notifiers, bs);
+    assert(bdrv_get_aio_context(bs) == qemu_get_aio_context());
+
     bdrv_flush(bs);
     if (bs->job) {
         block_job_cancel_sync(bs->job);
     }
     bdrv_drain_all();
-    notifier_list_notify(&bs->close_notifiers, bs);
 
     if (bs->drv) {
         if (bs == bs_snapshots) {
@@ -1156,6 +1231,10 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_delete(bs->backing_hd);
             bs->backing_hd = NULL;
         }
+        if (bs->shared_cache) {
+            shared_cache_close(bs->shared_cache);
+            bs->shared_cache = NULL;
+        }
         bs->drv->bdrv_close(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
@@ -1166,6 +1245,7 @@ void bdrv_close(BlockDriverState *bs)
         bs->opaque = NULL;
         bs->drv = NULL;
         bs->copy_on_read = 0;
+        bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
         bs->backing_file[0] = '\0';
         bs->backing_format[0] = '\0';
         bs->total_sectors = 0;
@@ -1208,6 +1288,9 @@ void bdrv_close_all(void)
  * can be arbitrarily complex and a constant flow of I/O can come until the
  * coroutine is complete.  Because of this, it is not possible to have a
  * function to drain a single device's I/O queue.
+ *
+ * Devices that were moved to another AioContext are drained by the thread
+ * that owns it and are skipped here.
  */
 void bdrv_drain_all(void)
 {
@@ -1221,6 +1304,9 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+                continue;
+            }
             if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
                 qemu_co_queue_restart_all(&bs->throttled_reqs);
                 busy = true;
@@ -1230,6 +1316,9 @@ void bdrv_drain_all(void)
 
     /* If requests are still pending there is a bug somewhere */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+            continue;
+        }
         assert(QLIST_EMPTY(&bs->tracked_requests));
         assert(qemu_co_queue_empty(&bs->throttled_reqs));
     }
@@ -1267,12 +1356,10 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttle_state     = bs_src->throttle_state;
+    bs_dest->throttle_group     = bs_src->throttle_group;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
     bs_dest->block_timer        = bs_src->block_timer;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
@@ -1321,6 +1408,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->throttle_group == NULL);
     assert(bs_new->block_timer == NULL);
 
     tmp = *bs_new;
@@ -1340,6 +1428,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->throttle_group == NULL);
     assert(bs_new->block_timer == NULL);
 
     bdrv_rebind(bs_new);
@@ -1381,6 +1470,7 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_make_anon(bs);
 
     bdrv_close(bs);
+    bdrv_throttle_group_leave(bs);
 
     assert(bs != bs_snapshots);
     g_free(bs);
@@ -1594,6 +1684,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
         bdrv_flush(bs);
     }
 
@@ -2212,6 +2303,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
                                   &bounce_qiov);
     }
+    bdrv_invalidate_extent_cache(bs, cluster_sector_num, cluster_nb_sectors);
 
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
@@ -2280,7 +2372,11 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->shared_cache) {
+        ret = shared_cache_co_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
 
 out:
     tracked_request_end(&req);
@@ -2372,6 +2468,10 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
+    if (bs->shared_cache) {
+        shared_cache_invalidate(bs->shared_cache, sector_num, nb_sectors);
+    }
+
     if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
     } else {
@@ -2386,6 +2486,8 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
 
+    bdrv_invalidate_extent_cache(bs, sector_num, nb_sectors);
+
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
@@ -2428,6 +2530,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (bdrv_in_use(bs))
         return -EBUSY;
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -2435,6 +2538,33 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     return ret;
 }
 
+/**
+ * Reserve storage for the given byte range, growing the image if the range
+ * ends beyond its current end. This is only a hint for drivers that allocate
+ * space lazily; -ENOTSUP is returned if the driver can't do it.
+ */
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t length)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_preallocate) {
+        return -ENOTSUP;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+
+    ret = drv->bdrv_preallocate(bs, offset, length);
+    if (ret == 0) {
+        ret = refresh_total_sectors(bs, (offset + length) >> BDRV_SECTOR_BITS);
+    }
+    return ret;
+}
+
 /**
  * Length of a allocated file in bytes. Sparse files are counted by actual
  * allocated space. Return < 0 if error or unknown.
@@ -2454,6 +2584,23 @@ int64_t bdrv_get_allocated_file_size(BlockDriverState *bs)
     return -ENOTSUP;
 }
 
+/**
+ * Return a host file descriptor that can be read directly at the guest
+ * offsets of @bs, or -ENOTSUP if the image is not a plain file or if reads
+ * must go through the block layer (I/O throttling, copy-on-read).
+ */
+int bdrv_get_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_fd || bs->io_limits_enabled || bs->copy_on_read) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_fd(bs);
+}
+
 /**
  * Length of a file in bytes. Return < 0 if error or unknown.
  */
@@ -2483,14 +2630,124 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
+static void bdrv_throttle_config(ThrottleState *ts, BlockIOLimit *io_limits)
+{
+    throttle_set_limit(ts, THROTTLE_BPS_TOTAL,
+                       io_limits->bps[BLOCK_IO_LIMIT_TOTAL],
+                       io_limits->bps_max[BLOCK_IO_LIMIT_TOTAL]);
+    throttle_set_limit(ts, THROTTLE_BPS_READ,
+                       io_limits->bps[BLOCK_IO_LIMIT_READ],
+                       io_limits->bps_max[BLOCK_IO_LIMIT_READ]);
+    throttle_set_limit(ts, THROTTLE_BPS_WRITE,
+                       io_limits->bps[BLOCK_IO_LIMIT_WRITE],
+                       io_limits->bps_max[BLOCK_IO_LIMIT_WRITE]);
+    throttle_set_limit(ts, THROTTLE_OPS_TOTAL,
+                       io_limits->iops[BLOCK_IO_LIMIT_TOTAL],
+                       io_limits->iops_max[BLOCK_IO_LIMIT_TOTAL]);
+    throttle_set_limit(ts, THROTTLE_OPS_READ,
+                       io_limits->iops[BLOCK_IO_LIMIT_READ],
+                       io_limits->iops_max[BLOCK_IO_LIMIT_READ]);
+    throttle_set_limit(ts, THROTTLE_OPS_WRITE,
+                       io_limits->iops[BLOCK_IO_LIMIT_WRITE],
+                       io_limits->iops_max[BLOCK_IO_LIMIT_WRITE]);
+}
+
 /* throttling disk io limits */
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits)
 {
     bs->io_limits = *io_limits;
+    bdrv_throttle_config(&bs->throttle_state, io_limits);
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+/* Enable, disable or re-evaluate throttling after a live limit change */
+static void bdrv_io_limits_apply(BlockDriverState *bs)
+{
+    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_enable(bs);
+    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_disable(bs);
+    } else if (bs->block_timer) {
+        qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+void bdrv_update_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+    bdrv_throttle_config(&bs->throttle_state, io_limits);
+    bdrv_io_limits_apply(bs);
+}
+
+static bool bdrv_io_limits_zero(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Set the aggregate limits of the throttle group @group and make @bs a
+ * member of it.  All-zero limits remove @bs from the group instead; the
+ * limits of the remaining members are left alone in that case.
+ */
+void bdrv_set_io_limits_group(BlockDriverState *bs, const char *group,
+                              BlockIOLimit *io_limits)
+{
+    BlockThrottleGroup *tg;
+    BlockDriverState *member;
+
+    if (bdrv_io_limits_zero(io_limits)) {
+        if (bs->throttle_group && !strcmp(bs->throttle_group->name, group)) {
+            bdrv_throttle_group_leave(bs);
+            bdrv_io_limits_apply(bs);
+        }
+        return;
+    }
+
+    QLIST_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(tg->name, group)) {
+            break;
+        }
+    }
+    if (!tg) {
+        tg = g_malloc0(sizeof(*tg));
+        tg->name = g_strdup(group);
+        QLIST_INSERT_HEAD(&throttle_groups, tg, list);
+    }
+
+    if (bs->throttle_group != tg) {
+        tg->refcount++;
+        bdrv_throttle_group_leave(bs);
+        bs->throttle_group = tg;
+    }
+
+    tg->io_limits = *io_limits;
+    bdrv_throttle_config(&tg->throttle_state, io_limits);
+
+    QTAILQ_FOREACH(member, &bdrv_states, list) {
+        if (member->throttle_group == tg) {
+            bdrv_io_limits_apply(member);
+        }
+    }
+}
+
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, uint64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
+void bdrv_set_shared_cache_size(BlockDriverState *bs, uint64_t size)
+{
+    bs->shared_cache_size = size;
+}
+
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
                        BlockdevOnError on_write_error)
 {
@@ -2664,6 +2921,10 @@ void bdrv_flush_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        /* devices in another AioContext are flushed by its thread */
+        if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+            continue;
+        }
         bdrv_flush(bs);
     }
 }
@@ -2688,6 +2949,144 @@ typedef struct BdrvCoIsAllocatedData {
     bool done;
 } BdrvCoIsAllocatedData;
 
+/*
+ * Append a run of sectors to an extent list, merging it into the last extent
+ * if that is in the same state.  Returns false if the list filled up before
+ * the whole run could be added.
+ */
+bool bdrv_extent_add(BlockExtent *extents, int *nb_extents, int max_extents,
+                     int64_t sector_num, int64_t nb_sectors, bool allocated)
+{
+    while (nb_sectors > 0) {
+        BlockExtent *last = *nb_extents ? &extents[*nb_extents - 1] : NULL;
+        int n;
+
+        if (last && last->allocated == allocated &&
+            last->nb_sectors < INT_MAX) {
+            assert(last->sector_num + last->nb_sectors == sector_num);
+            n = MIN(nb_sectors, INT_MAX - last->nb_sectors);
+            last->nb_sectors += n;
+        } else if (*nb_extents < max_extents) {
+            n = MIN(nb_sectors, INT_MAX);
+            extents[(*nb_extents)++] = (BlockExtent) {
+                .sector_num = sector_num,
+                .nb_sectors = n,
+                .allocated  = allocated,
+            };
+        } else {
+            return false;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return true;
+}
+
+/* Build an extent list for drivers that only implement is_allocated */
+static int coroutine_fn bdrv_co_get_extents_slow(BlockDriverState *bs,
+        int64_t sector_num, int64_t nb_sectors, BlockExtent *extents,
+        int max_extents)
+{
+    int n = 0;
+
+    while (nb_sectors > 0) {
+        int ret, pnum;
+
+        ret = bs->drv->bdrv_co_is_allocated(bs, sector_num,
+                                            MIN(nb_sectors, INT_MAX), &pnum);
+        if (ret < 0) {
+            return n ? n : ret;
+        }
+        if (pnum == 0) {
+            break;
+        }
+        if (!bdrv_extent_add(extents, &n, max_extents, sector_num, pnum,
+                             ret)) {
+            break;
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    return n ? n : -EIO;
+}
+
+static bool bdrv_extent_cache_lookup(BlockDriverState *bs, int64_t sector_num,
+                                     BlockExtent *ext)
+{
+    int i;
+
+    for (i = 0; i < bs->extent_cache_count; i++) {
+        BlockExtent *e = &bs->extent_cache[i];
+
+        if (sector_num >= e->sector_num &&
+            sector_num < e->sector_num + e->nb_sectors) {
+            ext->sector_num = sector_num;
+            ext->nb_sectors = e->sector_num + e->nb_sectors - sector_num;
+            ext->allocated = e->allocated;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Get the extent starting at 'sector_num', at most 'nb_sectors' long.  The
+ * range must be within the image.
+ *
+ * On a cache miss, drivers with a bulk lookup are asked about a larger area
+ * than requested and the result is kept in the extent cache, so walking an
+ * image with successive lookups asks the driver about each part only once.
+ */
+static int coroutine_fn bdrv_co_get_extent(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors,
+                                           BlockExtent *ext)
+{
+    BlockDriver *drv = bs->drv;
+    BlockExtent extents[BDRV_EXTENT_CACHE_SIZE];
+    uint64_t generation = bs->extent_cache_generation;
+    int n;
+
+    if (!drv->bdrv_co_get_extents && !drv->bdrv_co_is_allocated) {
+        *ext = (BlockExtent) {
+            .sector_num = sector_num,
+            .nb_sectors = MIN(nb_sectors, INT_MAX),
+            .allocated  = true,
+        };
+        return 0;
+    }
+
+    if (!bdrv_extent_cache_lookup(bs, sector_num, ext)) {
+        if (drv->bdrv_co_get_extents) {
+            n = drv->bdrv_co_get_extents(bs, sector_num,
+                    MIN(MAX(nb_sectors, BDRV_EXTENT_CACHE_RANGE),
+                        bs->total_sectors - sector_num),
+                    extents, ARRAY_SIZE(extents));
+        } else {
+            n = bdrv_co_get_extents_slow(bs, sector_num, nb_sectors,
+                                         extents, ARRAY_SIZE(extents));
+        }
+        if (n < 0) {
+            return n;
+        }
+        assert(n > 0 && extents[0].sector_num == sector_num);
+
+        if (generation == bs->extent_cache_generation) {
+            memcpy(bs->extent_cache, extents, n * sizeof(extents[0]));
+            bs->extent_cache_count = n;
+        }
+        *ext = extents[0];
+    }
+
+    if (ext->nb_sectors > nb_sectors) {
+        ext->nb_sectors = nb_sectors;
+    }
+    return 0;
+}
+
 /*
  * Returns true iff the specified sector is present in the disk image. Drivers
  * not implementing the functionality are assumed to not support backing files,
@@ -2706,7 +3105,9 @@ typedef struct BdrvCoIsAllocatedData {
 int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, int *pnum)
 {
+    BlockExtent ext;
     int64_t n;
+    int ret;
 
     if (sector_num >= bs->total_sectors) {
         *pnum = 0;
@@ -2718,12 +3119,14 @@ int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
         nb_sectors = n;
     }
 
-    if (!bs->drv->bdrv_co_is_allocated) {
-        *pnum = nb_sectors;
-        return 1;
+    ret = bdrv_co_get_extent(bs, sector_num, nb_sectors, &ext);
+    if (ret < 0) {
+        *pnum = 0;
+        return ret;
     }
 
-    return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    *pnum = ext.nb_sectors;
+    return ext.allocated;
 }
 
 /* Coroutine wrapper for bdrv_is_allocated() */
@@ -2813,6 +3216,146 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/*
+ * Describe the allocation state of a range of sectors as a list of extents.
+ * A sector counts as allocated if it is allocated in any image between TOP
+ * and BASE (exclusive), as with bdrv_co_is_allocated_above().
+ *
+ * The extents are contiguous and start at 'sector_num'.  Each is at most
+ * INT_MAX sectors long.  The range is clamped to the end of TOP, and no more
+ * than 'max_extents' extents are returned, so they may end before the range
+ * does.
+ *
+ * Returns the number of extents, which is 0 only if 'sector_num' is beyond
+ * the end of the image, or -errno.
+ */
+int coroutine_fn bdrv_co_get_extents_above(BlockDriverState *top,
+                                           BlockDriverState *base,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors,
+                                           BlockExtent *extents,
+                                           int max_extents)
+{
+    int64_t end;
+    int n = 0;
+
+    if (sector_num >= top->total_sectors || nb_sectors <= 0) {
+        return 0;
+    }
+    end = MIN(sector_num + nb_sectors, top->total_sectors);
+
+    while (sector_num < end) {
+        BlockDriverState *intermediate;
+        int64_t len = end - sector_num;
+        bool allocated = false;
+
+        for (intermediate = top; intermediate && intermediate != base;
+             intermediate = intermediate->backing_hd) {
+            BlockExtent ext;
+            int ret;
+
+            /* Backing files shorter than TOP are unallocated past their end */
+            if (sector_num >= intermediate->total_sectors) {
+                continue;
+            }
+
+            ret = bdrv_co_get_extent(intermediate, sector_num,
+                                     MIN(len, intermediate->total_sectors -
+                                              sector_num),
+                                     &ext);
+            if (ret < 0) {
+                return n ? n : ret;
+            }
+
+            len = ext.nb_sectors;
+            if (ext.allocated) {
+                allocated = true;
+                break;
+            }
+        }
+
+        if (!bdrv_extent_add(extents, &n, max_extents, sector_num, len,
+                             allocated)) {
+            break;
+        }
+        sector_num += len;
+    }
+
+    return n;
+}
+
+/*
+ * Describe the allocation state of a range of sectors in BS alone, see
+ * bdrv_co_get_extents_above().
+ */
+int coroutine_fn bdrv_co_get_extents(BlockDriverState *bs, int64_t sector_num,
+                                     int64_t nb_sectors, BlockExtent *extents,
+                                     int max_extents)
+{
+    return bdrv_co_get_extents_above(bs, bs->backing_hd, sector_num,
+                                     nb_sectors, extents, max_extents);
+}
+
+typedef struct BdrvCoGetExtentsData {
+    BlockDriverState *top;
+    BlockDriverState *base;
+    int64_t sector_num;
+    int64_t nb_sectors;
+    BlockExtent *extents;
+    int max_extents;
+    int ret;
+    bool done;
+} BdrvCoGetExtentsData;
+
+/* Coroutine wrapper for bdrv_get_extents_above() */
+static void coroutine_fn bdrv_get_extents_co_entry(void *opaque)
+{
+    BdrvCoGetExtentsData *data = opaque;
+
+    data->ret = bdrv_co_get_extents_above(data->top, data->base,
+                                          data->sector_num, data->nb_sectors,
+                                          data->extents, data->max_extents);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_extents_above().
+ *
+ * See bdrv_co_get_extents_above() for details.
+ */
+int bdrv_get_extents_above(BlockDriverState *top, BlockDriverState *base,
+                           int64_t sector_num, int64_t nb_sectors,
+                           BlockExtent *extents, int max_extents)
+{
+    Coroutine *co;
+    BdrvCoGetExtentsData data = {
+        .top = top,
+        .base = base,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .extents = extents,
+        .max_extents = max_extents,
+        .done = false,
+    };
+
+    co = qemu_coroutine_create(bdrv_get_extents_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        qemu_aio_wait();
+    }
+    return data.ret;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_extents().
+ */
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BlockExtent *extents, int max_extents)
+{
+    return bdrv_get_extents_above(bs, bs->backing_hd, sector_num, nb_sectors,
+                                  extents, max_extents);
+}
+
 BlockInfo *bdrv_query_info(BlockDriverState *bs)
 {
     BlockInfo *info = g_malloc0(sizeof(*info));
@@ -2868,6 +3411,29 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
                            bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
             info->inserted->iops_wr =
                            bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+            info->inserted->has_bps_max = true;
+            info->inserted->bps_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_bps_rd_max = true;
+            info->inserted->bps_rd_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_bps_wr_max = true;
+            info->inserted->bps_wr_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_WRITE];
+            info->inserted->has_iops_max = true;
+            info->inserted->iops_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_iops_rd_max = true;
+            info->inserted->iops_rd_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_iops_wr_max = true;
+            info->inserted->iops_wr_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_WRITE];
+        }
+
+        if (bs->throttle_group) {
+            info->inserted->has_group = true;
+            info->inserted->group = g_strdup(bs->throttle_group->name);
         }
     }
     return info;
@@ -2911,11 +3477,28 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->stats->has_metadata_cache = true;
+        s->stats->metadata_cache = g_malloc0(sizeof(*s->stats->metadata_cache));
+        bs->drv->bdrv_get_cache_stats(bs, s->stats->metadata_cache);
+    }
+
+    if (bs->shared_cache) {
+        s->stats->has_shared_cache = true;
+        s->stats->shared_cache = g_malloc0(sizeof(*s->stats->shared_cache));
+        shared_cache_get_stats(bs->shared_cache, s->stats->shared_cache);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
     }
 
+    if (bs->backing_hd) {
+        s->has_backing = true;
+        s->backing = bdrv_query_stats(bs->backing_hd);
+    }
+
     return s;
 }
 
@@ -2955,6 +3538,8 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -2964,7 +3549,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(!bs->dirty_bitmap);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bdrv_invalidate_extent_cache(bs, sector_num, nb_sectors);
+    return ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3119,12 +3706,16 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
-    if (drv->bdrv_snapshot_goto)
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
+    if (drv->bdrv_snapshot_goto) {
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
+        return ret;
+    }
 
     if (bs->file) {
         drv->bdrv_close(bs);
         ret = bdrv_snapshot_goto(bs->file, snapshot_id);
+        bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
         open_ret = drv->bdrv_open(bs, bs->open_flags);
         if (open_ret < 0) {
             bdrv_delete(bs->file);
@@ -3539,171 +4130,6 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->aiocb_info->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
-{
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
-}
-
 /**************************************************************/
 /* async block device emulation */
 
@@ -3759,7 +4185,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3841,7 +4267,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3875,7 +4301,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3902,7 +4328,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4081,6 +4507,8 @@ flush_parent:
 
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
+    bdrv_invalidate_extent_cache(bs, 0, INT64_MAX);
+
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs);
     }
@@ -4136,6 +4564,8 @@ static void coroutine_fn bdrv_discard_co_entry(void *opaque)
 int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
                                  int nb_sectors)
 {
+    int ret;
+
     if (!bs->drv) {
         return -ENOMEDIUM;
     } else if (bdrv_check_request(bs, sector_num, nb_sectors)) {
@@ -4149,7 +4579,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
 
     if (bs->drv->bdrv_co_discard) {
-        return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
+        ret = bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
         CoroutineIOCompletion co = {
@@ -4160,13 +4590,15 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
                                         bdrv_co_io_em_complete, &co);
         if (acb == NULL) {
             return -EIO;
-        } else {
-            qemu_coroutine_yield();
-            return co.ret;
         }
+        qemu_coroutine_yield();
+        ret = co.ret;
     } else {
         return 0;
     }
+
+    bdrv_invalidate_extent_cache(bs, sector_num, nb_sectors);
+    return ret;
 }
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
@@ -4368,6 +4800,59 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return bs->aio_context;
+}
+
+/*
+ * Return whether bs and every image below it can be moved out of the main
+ * loop with bdrv_set_aio_context().  I/O throttling relies on timers of the
+ * main loop, so throttled devices stay there.
+ */
+bool bdrv_supports_aio_context(BlockDriverState *bs)
+{
+    if (!bs) {
+        return true;
+    }
+    if (!bs->drv || !bs->drv->supports_aio_context || bs->io_limits_enabled) {
+        return false;
+    }
+    return bdrv_supports_aio_context(bs->file) &&
+           bdrv_supports_aio_context(bs->backing_hd);
+}
+
+/*
+ * Move bs and every image below it to new_context.  From then on requests
+ * may only be submitted from the thread that polls new_context, and their
+ * completions run there.  The caller makes sure that no requests are in
+ * flight.
+ *
+ * The main loop leaves devices in another AioContext alone in
+ * bdrv_drain_all() and bdrv_flush_all(), the thread that owns the context
+ * drains and flushes them.  Before bs is closed, its close notifiers must
+ * move it back to the main loop's context.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    if (!bs) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&bs->tracked_requests));
+
+    if (bs->drv && bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    bs->aio_context = new_context;
+    if (bs->drv && bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+
+    bdrv_set_aio_context(bs->file, new_context);
+    bdrv_set_aio_context(bs->backing_hd, new_context);
+}
+
 void bdrv_iostatus_enable(BlockDriverState *bs)
 {
     bs->iostatus_enabled = true;
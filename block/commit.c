@@ -24,6 +24,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Maximum number of copy requests in flight */
+    COMMIT_MAX_WORKERS = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -37,6 +40,12 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     int orig_overlay_flags;
+
+    int workers;
+    BlockJobCopyPool pool;
+
+    /* error that makes the job fail, set together with pool.failed */
+    int error;
 } CommitBlockJob;
 
 static int coroutine_fn commit_populate(BlockDriverState *bs,
@@ -44,14 +53,21 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
 {
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
     int ret = 0;
 
-    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
 
-    ret = bdrv_write(base, sector_num, buf, nb_sectors);
+    ret = bdrv_co_writev(base, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
@@ -59,6 +75,35 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static bool commit_error_is_fatal(CommitBlockJob *s, int ret)
+{
+    return s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+           s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+           (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC);
+}
+
+static BlockJobCopyResult coroutine_fn commit_copy(BlockJob *job,
+                                                   BlockJobCopyRequest *req)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+    int ret;
+
+    ret = commit_populate(s->top, s->base, req->sector_num, req->nb_sectors,
+                          req->buf);
+    if (ret >= 0) {
+        return BLOCK_JOB_COPY_DONE;
+    }
+
+    if (!commit_error_is_fatal(s, ret)) {
+        /* Ignored errors are retried, like the sequential loop did */
+        return BLOCK_JOB_COPY_RETRY;
+    }
+    if (s->error == 0) {
+        s->error = ret;
+    }
+    return BLOCK_JOB_COPY_FAILED;
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -66,11 +111,11 @@ static void coroutine_fn commit_run(void *opaque)
     BlockDriverState *top = s->top;
     BlockDriverState *base = s->base;
     BlockDriverState *overlay_bs;
+    BlockJobAllocMap map;
     int64_t sector_num, end;
+    bool finished;
     int ret = 0;
     int n = 0;
-    void *buf;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -93,7 +138,10 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
+
+    block_job_alloc_map_init(&map, top, base);
+    block_job_copy_pool_init(&s->pool, &s->common, s->workers,
+                             COMMIT_BUFFER_SIZE, commit_copy);
 
     for (sector_num = 0; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
@@ -102,32 +150,54 @@ static void coroutine_fn commit_run(void *opaque)
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
+         * Copy requests are left running, except when the job is paused:
+         * then they finish first so that no more progress is made.
          */
+        if (block_job_is_paused(&s->common)) {
+            block_job_copy_pool_drain(&s->pool);
+        }
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->pool.failed) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_co_is_allocated_above(top, base, sector_num,
-                                         COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                         &n);
+
+        block_job_copy_pool_resubmit(&s->pool);
+
+        /* Charge the data that was actually copied to the rate limit */
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                 s->pool.bytes_unaccounted);
+            s->pool.bytes_unaccounted = 0;
+            if (delay_ns > 0) {
+                goto wait;
+            }
+        }
+
+        /* Copy if allocated above the base, a buffer at a time.
+         * Unallocated areas are skipped in a single step.
+         */
+        ret = block_job_is_allocated(&map, sector_num, end, &n);
+        if (ret < 0) {
+            n = MIN(COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE, end - sector_num);
+        } else if (ret == 1) {
+            n = MIN(COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE, n);
+        }
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
         if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
+            if (!block_job_copy_pool_start(&s->pool, sector_num, n)) {
+                /* All requests wait to be retried or the job failed, go
+                 * back to sleep and look at this area again afterwards.
+                 */
+                n = 0;
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
+            continue;
         }
         if (ret < 0) {
-            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
-                s->on_error == BLOCKDEV_ON_ERROR_REPORT||
-                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto exit_free_buf;
+            if (commit_error_is_fatal(s, ret)) {
+                s->error = ret;
+                s->pool.failed = true;
+                break;
             } else {
                 n = 0;
                 continue;
@@ -137,15 +207,20 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
-    ret = 0;
+    /* Wait for the copy requests, copying again those that failed with an
+     * ignored error.
+     */
+    finished = block_job_copy_pool_finish(&s->pool);
+
+    ret = s->error;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end) {
-        /* success */
+    if (!block_job_is_cancelled(&s->common) && sector_num == end &&
+        ret == 0 && finished) {
+        /* success, all layers between top and base are dropped at once */
         ret = bdrv_drop_intermediate(active, top, base);
     }
 
-exit_free_buf:
-    qemu_vfree(buf);
+    block_job_copy_pool_cleanup(&s->pool);
 
 exit_restore_reopen:
     /* restore base open flags here if appropriate (e.g., change the base back
@@ -170,7 +245,7 @@ static void commit_set_speed(BlockJob *job, int64_t speed, Error **errp)
         error_set(errp, QERR_INVALID_PARAMETER, "speed");
         return;
     }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+    ratelimit_set_speed(&s->limit, speed, SLICE_TIME);
 }
 
 static BlockJobType commit_job_type = {
@@ -180,7 +255,7 @@ static BlockJobType commit_job_type = {
 };
 
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                  BlockDriverState *top, int64_t speed,
+                  BlockDriverState *top, int64_t speed, int workers,
                   BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -191,6 +266,11 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
     BlockDriverState *overlay_bs;
     Error *local_err = NULL;
 
+    if (workers < 1 || workers > COMMIT_MAX_WORKERS) {
+        error_set(errp, QERR_INVALID_PARAMETER, "workers");
+        return;
+    }
+
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -251,6 +331,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
     s->orig_overlay_flags  = orig_overlay_flags;
 
     s->on_error = on_error;
+    s->workers = workers;
     s->common.co = qemu_coroutine_create(commit_run);
 
     trace_commit_start(bs, base, top, s, s->common.co, opaque);
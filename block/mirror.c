@@ -18,7 +18,15 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
+#define INITIAL_IN_FLIGHT 16
+
+/* Every LATENCY_EPOCH completed writes the baseline latency of the target is
+ * measured again, so that the window follows changes in the target's load.
+ */
+#define LATENCY_EPOCH 256
+
+#define PROGRESS_INTERVAL 1000000000LL /* ns */
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -47,6 +55,22 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int ret;
+
+    /* true if unallocated parts of the target read as zeroes */
+    bool target_zero_init;
+
+    /* Window of in-flight operations, adapted to the target's latency */
+    int max_in_flight;
+    int64_t latency_avg;
+    int64_t latency_base;
+    int64_t latency_epoch_min;
+    int completions;
+    int epoch_completions;
+
+    /* Progress reporting */
+    int64_t bytes_copied;
+    int64_t last_progress_bytes;
+    int64_t last_progress_ns;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -54,6 +78,8 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    bool target_zero;
+    int64_t write_start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -69,6 +95,45 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Additive increase, multiplicative decrease of the in-flight window: as
+ * long as the target's write latency stays close to what it is with little
+ * load, it is not saturated and more requests can be submitted.  Once
+ * requests start queueing up on the target, halve the window.
+ */
+static void mirror_update_window(MirrorBlockJob *s, int64_t latency)
+{
+    if (s->latency_avg == 0) {
+        s->latency_avg = latency;
+    } else {
+        s->latency_avg += (latency - s->latency_avg) / 8;
+    }
+
+    if (s->latency_base == 0 || latency < s->latency_base) {
+        s->latency_base = latency;
+    }
+    if (s->latency_epoch_min == 0 || latency < s->latency_epoch_min) {
+        s->latency_epoch_min = latency;
+    }
+    if (++s->epoch_completions == LATENCY_EPOCH) {
+        s->latency_base = s->latency_epoch_min;
+        s->latency_epoch_min = 0;
+        s->epoch_completions = 0;
+    }
+
+    if (++s->completions < s->max_in_flight) {
+        return;
+    }
+    s->completions = 0;
+
+    if (s->latency_avg <= 2 * s->latency_base) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT);
+    } else {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    }
+    trace_mirror_update_window(s, s->max_in_flight, s->latency_avg,
+                               s->latency_base);
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -93,6 +158,9 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     if (s->cow_bitmap && ret >= 0) {
         bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
     }
+    if (ret >= 0) {
+        s->bytes_copied += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
 
     g_slice_free(MirrorOp, op);
     qemu_coroutine_enter(s->common.co, NULL);
@@ -102,7 +170,10 @@ static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
-    if (ret < 0) {
+    if (ret >= 0) {
+        mirror_update_window(s, qemu_get_clock_ns(rt_clock) -
+                                op->write_start_ns);
+    } else {
         BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
@@ -115,6 +186,21 @@ static void mirror_write_complete(void *opaque, int ret)
     mirror_iteration_done(op, ret);
 }
 
+static bool mirror_qiov_is_zero(QEMUIOVector *qiov, int nb_sectors)
+{
+    size_t bytes = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+    int i;
+
+    for (i = 0; i < qiov->niov && bytes > 0; i++) {
+        size_t len = MIN(qiov->iov[i].iov_len, bytes);
+        if (!buffer_is_zero(qiov->iov[i].iov_base, len)) {
+            return false;
+        }
+        bytes -= len;
+    }
+    return true;
+}
+
 static void mirror_read_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -132,6 +218,15 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+
+    /* Zeroes need not be written where the target reads as zero anyway */
+    if (op->target_zero && mirror_qiov_is_zero(&op->qiov, op->nb_sectors)) {
+        trace_mirror_skip_zero(s, op->sector_num, op->nb_sectors);
+        mirror_iteration_done(op, 0);
+        return;
+    }
+
+    op->write_start_ns = qemu_get_clock_ns(rt_clock);
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
@@ -234,6 +329,13 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->target_zero = false;
+    if (s->target_zero_init) {
+        int n;
+        op->target_zero = !bdrv_co_is_allocated(s->target, sector_num,
+                                                nb_sectors, &n) &&
+                          n >= nb_sectors;
+    }
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -282,6 +384,24 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+static void mirror_report_progress(MirrorBlockJob *s)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t elapsed = now - s->last_progress_ns;
+    int64_t throughput;
+
+    if (elapsed < PROGRESS_INTERVAL ||
+        s->bytes_copied == s->last_progress_bytes) {
+        return;
+    }
+
+    throughput = (s->bytes_copied - s->last_progress_bytes) *
+                 NANOSECONDS_PER_SECOND / elapsed;
+    block_job_progress(&s->common, throughput);
+    s->last_progress_bytes = s->bytes_copied;
+    s->last_progress_ns = now;
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
@@ -298,7 +418,6 @@ static void coroutine_fn mirror_run(void *opaque)
     BlockDriverInfo bdi;
     char backing_filename[1024];
     int ret = 0;
-    int n;
 
     if (block_job_is_cancelled(&s->common)) {
         goto immediate_exit;
@@ -327,36 +446,53 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    s->target_zero_init = !backing_filename[0] &&
+                          bdrv_has_zero_init(s->target);
+
     end = s->common.len >> BDRV_SECTOR_BITS;
     s->buf = qemu_blockalign(bs, s->buf_size);
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
+    s->max_in_flight = INITIAL_IN_FLIGHT;
 
     if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base;
         base = s->mode == MIRROR_SYNC_MODE_FULL ? NULL : bs->backing_hd;
         for (sector_num = 0; sector_num < end; ) {
-            int64_t next = (sector_num | (sectors_per_chunk - 1)) + 1;
-            ret = bdrv_co_is_allocated_above(bs, base,
-                                             sector_num, next - sector_num, &n);
+            BlockExtent extents[64];
+            int i;
 
+            ret = bdrv_co_get_extents_above(bs, base, sector_num,
+                                            end - sector_num, extents,
+                                            ARRAY_SIZE(extents));
             if (ret < 0) {
                 goto immediate_exit;
             }
 
-            assert(n > 0);
-            if (ret == 1) {
-                bdrv_set_dirty(bs, sector_num, n);
-                sector_num = next;
-            } else {
-                sector_num += n;
+            assert(ret > 0);
+            for (i = 0; i < ret; i++) {
+                if (extents[i].allocated) {
+                    bdrv_set_dirty(bs, extents[i].sector_num,
+                                   extents[i].nb_sectors);
+                }
+            }
+            sector_num = extents[ret - 1].sector_num +
+                         extents[ret - 1].nb_sectors;
+
+            /* Scanning a large image can take a while, do not hog the
+             * main loop meanwhile.
+             */
+            block_job_sleep_ns(&s->common, rt_clock, 0);
+            if (block_job_is_cancelled(&s->common)) {
+                goto immediate_exit;
             }
         }
     }
 
     bdrv_dirty_iter_init(bs, &s->hbi);
     last_pause_ns = qemu_get_clock_ns(rt_clock);
+    s->last_progress_ns = last_pause_ns;
     for (;;) {
         uint64_t delay_ns;
         int64_t cnt;
@@ -376,7 +512,7 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 qemu_coroutine_yield();
@@ -428,6 +564,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
 
         ret = 0;
+        mirror_report_progress(s);
         trace_mirror_before_sleep(s, cnt, s->synced);
         if (!s->synced) {
             /* Publish progress */
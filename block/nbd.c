@@ -47,10 +47,31 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS	16
+#define MAX_NBD_REQUESTS	64
+#define NBD_DEFAULT_WINDOW	16
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
+/* qemu-nbd has a limit of slightly less than 1M per request.  Try to
+ * remain aligned to 4K. */
+#define NBD_MAX_SECTORS 2040
+
+/* A request waiting for a free slot in the window */
+typedef struct NBDWaiter {
+    Coroutine *co;
+    struct nbd_request *request;
+    QEMUIOVector *qiov;
+    int offset;
+
+    /* Set if the request was sent as part of another one */
+    bool merged;
+    int ret;
+
+    QTAILQ_ENTRY(NBDWaiter) entry;
+} NBDWaiter;
+
+typedef QTAILQ_HEAD(, NBDWaiter) NBDWaiterList;
+
 typedef struct BDRVNBDState {
     int sock;
     uint32_t nbdflags;
@@ -58,24 +79,63 @@ typedef struct BDRVNBDState {
     size_t blocksize;
 
     CoMutex send_mutex;
-    CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    int window;
+    NBDWaiterList waiters;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
 
+    /* Read-ahead for sequential reads, disabled if readahead is 0 */
+    size_t readahead;
+    uint8_t *ra_buf;
+    int64_t ra_from;
+    int ra_len;
+    bool ra_valid;
+    bool ra_in_flight;
+    unsigned ra_generation;
+    CoQueue ra_wait;
+    int64_t last_read_end;
+
     int is_unix;
     char *host_spec;
     char *export_name; /* An NBD server may export several devices */
 } BDRVNBDState;
 
+static int nbd_parse_option(BDRVNBDState *s, const char *name,
+                            const char *value)
+{
+    char *end;
+    int64_t n;
+
+    if (!strcmp(name, "window")) {
+        n = strtol(value, &end, 10);
+        if (*end || n < 1 || n > MAX_NBD_REQUESTS) {
+            return -EINVAL;
+        }
+        s->window = n;
+    } else if (!strcmp(name, "readahead")) {
+        n = strtosz_suffix(value, &end, STRTOSZ_DEFSUFFIX_B);
+        if (n < 0 || *end || (n % BDRV_SECTOR_SIZE) ||
+            n > NBD_MAX_SECTORS * BDRV_SECTOR_SIZE) {
+            return -EINVAL;
+        }
+        s->readahead = n;
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
 {
     URI *uri;
     const char *p;
+    const char *socket_path = NULL;
     QueryParams *qp = NULL;
     int ret = 0;
+    int i;
 
     uri = uri_parse(filename);
     if (!uri) {
@@ -101,18 +161,24 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     }
 
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (s->is_unix && !qp->n) || (!s->is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        if (s->is_unix && !strcmp(qp->p[i].name, "socket")) {
+            socket_path = qp->p[i].value;
+            continue;
+        }
+        ret = nbd_parse_option(s, qp->p[i].name, qp->p[i].value);
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     if (s->is_unix) {
         /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        if (uri->server || uri->port || !socket_path) {
             ret = -EINVAL;
             goto out;
         }
-        s->host_spec = g_strdup(qp->p[0].value);
+        s->host_spec = g_strdup(socket_path);
     } else {
         /* nbd[+tcp]://host:port/export */
         if (!uri->server) {
@@ -182,17 +248,21 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_start(BDRVNBDState *s, NBDWaiter *w)
 {
     int i;
 
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (s->in_flight >= s->window) {
+        /* nbd_coroutine_end passes its slot to the first waiter */
+        w->co = qemu_coroutine_self();
+        QTAILQ_INSERT_TAIL(&s->waiters, w, entry);
+        qemu_coroutine_yield();
+        if (w->merged) {
+            return;
+        }
+    } else {
+        s->in_flight++;
     }
-    s->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
         if (s->recv_coroutine[i] == NULL) {
@@ -202,7 +272,7 @@ static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    w->request->handle = INDEX_TO_HANDLE(s, i);
 }
 
 static int nbd_have_request(void *opaque)
@@ -274,7 +344,7 @@ static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
         ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
     qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
@@ -313,12 +383,60 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
 static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
+    NBDWaiter *w;
+
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+
+    w = QTAILQ_FIRST(&s->waiters);
+    if (w) {
+        QTAILQ_REMOVE(&s->waiters, w, entry);
+        qemu_coroutine_enter(w->co, NULL);
+    } else {
+        s->in_flight--;
     }
 }
 
+/* Append the waiting requests that continue @w to it, so that they are
+ * sent as a single NBD request with the data described by @qiov.  Returns
+ * the number of requests moved to @merged.
+ */
+static int nbd_merge_waiters(BDRVNBDState *s, NBDWaiter *w,
+                             QEMUIOVector *qiov, NBDWaiterList *merged)
+{
+    struct nbd_request *request = w->request;
+    NBDWaiter *other;
+    bool found;
+    int n = 0;
+
+    do {
+        found = false;
+        QTAILQ_FOREACH(other, &s->waiters, entry) {
+            if (other->qiov &&
+                other->request->type == request->type &&
+                other->request->from == request->from + request->len &&
+                request->len + other->request->len <=
+                    NBD_MAX_SECTORS * BDRV_SECTOR_SIZE) {
+                break;
+            }
+        }
+        if (other) {
+            if (n == 0) {
+                qemu_iovec_init(qiov, w->qiov->niov + other->qiov->niov);
+                qemu_iovec_concat(qiov, w->qiov, w->offset, request->len);
+            }
+            QTAILQ_REMOVE(&s->waiters, other, entry);
+            QTAILQ_INSERT_TAIL(merged, other, entry);
+            qemu_iovec_concat(qiov, other->qiov, other->offset,
+                              other->request->len);
+            request->len += other->request->len;
+            found = true;
+            n++;
+        }
+    } while (found);
+
+    return n;
+}
+
 static int nbd_establish_connection(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -382,7 +500,10 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     int result;
 
     qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    QTAILQ_INIT(&s->waiters);
+    qemu_co_queue_init(&s->ra_wait);
+    s->window = NBD_DEFAULT_WINDOW;
+    s->last_read_end = -1;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename);
@@ -394,99 +515,270 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
      * TODO: Configurable retry-until-timeout behaviour.
      */
     result = nbd_establish_connection(bs);
+    if (result == 0 && s->readahead) {
+        s->ra_buf = qemu_blockalign(bs, s->readahead);
+    }
 
     return result;
 }
 
-static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
-                          int nb_sectors, QEMUIOVector *qiov,
-                          int offset)
+static int nbd_co_rw_1(BlockDriverState *bs, int type, int64_t sector_num,
+                       int nb_sectors, QEMUIOVector *qiov, int offset)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    NBDWaiter w = {
+        .request = &request,
+        .qiov = qiov,
+        .offset = offset,
+    };
+    NBDWaiterList merged = QTAILQ_HEAD_INITIALIZER(merged);
+    NBDWaiter *other, *next;
+    QEMUIOVector merged_qiov;
+    bool is_write = (type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
     ssize_t ret;
 
-    request.type = NBD_CMD_READ;
+    request.type = type;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    nbd_coroutine_start(s, &w);
+    if (w.merged) {
+        return w.ret;
+    }
+
+    if (nbd_merge_waiters(s, &w, &merged_qiov, &merged)) {
+        qiov = &merged_qiov;
+        offset = 0;
+    }
+
+    ret = nbd_co_send_request(s, &request, is_write ? qiov : NULL, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(s, &request, &reply, is_write ? NULL : qiov,
+                             offset);
     }
+
+    QTAILQ_FOREACH_SAFE(other, &merged, entry, next) {
+        QTAILQ_REMOVE(&merged, other, entry);
+        other->merged = true;
+        other->ret = -reply.error;
+        qemu_coroutine_enter(other->co, NULL);
+    }
+    if (qiov == &merged_qiov) {
+        qemu_iovec_destroy(&merged_qiov);
+    }
+
     nbd_coroutine_end(s, &request);
     return -reply.error;
+}
+
+typedef struct NBDSplitRequest {
+    BlockDriverState *bs;
+    Coroutine *co;
+    bool waiting;
+    int pending;
+    int ret;
+} NBDSplitRequest;
+
+typedef struct NBDChunk {
+    NBDSplitRequest *split;
+    int type;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int offset;
+} NBDChunk;
+
+static void coroutine_fn nbd_co_chunk(void *opaque)
+{
+    NBDChunk *chunk = opaque;
+    NBDSplitRequest *split = chunk->split;
+    int ret;
 
+    ret = nbd_co_rw_1(split->bs, chunk->type, chunk->sector_num,
+                      chunk->nb_sectors, chunk->qiov, chunk->offset);
+    if (ret < 0 && split->ret == 0) {
+        split->ret = ret;
+    }
+    if (--split->pending == 0 && split->waiting) {
+        qemu_coroutine_enter(split->co, NULL);
+    }
 }
 
-static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
-                           int nb_sectors, QEMUIOVector *qiov,
-                           int offset)
+/* Requests larger than NBD_MAX_SECTORS are split, and the pieces are sent
+ * together so that they fill the window.
+ */
+static int nbd_co_rw(BlockDriverState *bs, int type, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    NBDSplitRequest split = {
+        .bs = bs,
+        .co = qemu_coroutine_self(),
+    };
+    NBDChunk *chunks;
+    int i, n;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        return nbd_co_rw_1(bs, type, sector_num, nb_sectors, qiov, 0);
+    }
+
+    n = DIV_ROUND_UP(nb_sectors, NBD_MAX_SECTORS);
+    chunks = g_new(NBDChunk, n);
+    split.pending = n;
+
+    for (i = 0; i < n; i++) {
+        chunks[i] = (NBDChunk) {
+            .split = &split,
+            .type = type,
+            .sector_num = sector_num + i * NBD_MAX_SECTORS,
+            .nb_sectors = MIN(nb_sectors - i * NBD_MAX_SECTORS,
+                              NBD_MAX_SECTORS),
+            .qiov = qiov,
+            .offset = i * NBD_MAX_SECTORS * BDRV_SECTOR_SIZE,
+        };
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_chunk),
+                             &chunks[i]);
+    }
+
+    if (split.pending > 0) {
+        split.waiting = true;
+        qemu_coroutine_yield();
+    }
+
+    g_free(chunks);
+    return split.ret;
+}
 
-    request.type = NBD_CMD_WRITE;
-    if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
-        request.type |= NBD_CMD_FLAG_FUA;
+/* Drop read-ahead data that a write to [from, from + bytes) makes stale.
+ * A read-ahead request that is still in flight is not used either.
+ */
+static void nbd_readahead_invalidate(BDRVNBDState *s, int64_t from,
+                                     int64_t bytes)
+{
+    if (from < s->ra_from + s->ra_len && s->ra_from < from + bytes) {
+        s->ra_valid = false;
+        s->ra_generation++;
     }
+}
 
-    request.from = sector_num * 512;
-    request.len = nb_sectors * 512;
+static void coroutine_fn nbd_co_readahead(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVNBDState *s = bs->opaque;
+    unsigned generation = s->ra_generation;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = s->ra_buf,
+        .iov_len = s->ra_len,
+    };
+    int ret;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = nbd_co_rw_1(bs, NBD_CMD_READ, s->ra_from / BDRV_SECTOR_SIZE,
+                      s->ra_len / BDRV_SECTOR_SIZE, &qiov, 0);
+
+    s->ra_valid = (ret == 0 && generation == s->ra_generation);
+    s->ra_in_flight = false;
+    qemu_co_queue_restart_all(&s->ra_wait);
+}
+
+static void nbd_readahead_start(BlockDriverState *bs, int64_t from)
+{
+    BDRVNBDState *s = bs->opaque;
+    int64_t len = MIN((int64_t)s->readahead, s->size - from);
+
+    len &= BDRV_SECTOR_MASK;
+    if (s->ra_in_flight || len <= 0) {
+        return;
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+
+    s->ra_from = from;
+    s->ra_len = len;
+    s->ra_valid = false;
+    s->ra_in_flight = true;
+    qemu_coroutine_enter(qemu_coroutine_create(nbd_co_readahead), bs);
 }
 
-/* qemu-nbd has a limit of slightly less than 1M per request.  Try to
- * remain aligned to 4K. */
-#define NBD_MAX_SECTORS 2040
+/* Try to complete a read from the read-ahead buffer.  Returns true if
+ * the data was copied to @qiov.
+ */
+static bool nbd_readahead_copy(BlockDriverState *bs, int64_t from,
+                               int64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    for (;;) {
+        if (from < s->ra_from || from + bytes > s->ra_from + s->ra_len) {
+            return false;
+        }
+        if (!s->ra_in_flight) {
+            break;
+        }
+        qemu_co_queue_wait(&s->ra_wait);
+    }
+    if (!s->ra_valid) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, s->ra_buf + (from - s->ra_from), bytes);
+
+    /* The guest has consumed the buffer, fetch the next one */
+    if (from + bytes == s->ra_from + s->ra_len) {
+        nbd_readahead_start(bs, from + bytes);
+    }
+    return true;
+}
 
 static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
+    BDRVNBDState *s = bs->opaque;
+    int64_t from = sector_num * BDRV_SECTOR_SIZE;
+    int64_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    bool sequential;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    if (!s->readahead) {
+        return nbd_co_rw(bs, NBD_CMD_READ, sector_num, nb_sectors, qiov);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    sequential = (from == s->last_read_end);
+    s->last_read_end = from + bytes;
+
+    if (nbd_readahead_copy(bs, from, bytes, qiov)) {
+        return 0;
+    }
+
+    ret = nbd_co_rw(bs, NBD_CMD_READ, sector_num, nb_sectors, qiov);
+    if (ret == 0 && sequential) {
+        nbd_readahead_start(bs, from + bytes);
+    }
+    return ret;
 }
 
 static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
+    BDRVNBDState *s = bs->opaque;
+    int64_t from = sector_num * BDRV_SECTOR_SIZE;
+    int64_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    int type = NBD_CMD_WRITE;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+
+    if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
+        type |= NBD_CMD_FLAG_FUA;
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    /* A read-ahead sent while the write is in flight may see either old or
+     * new data, so invalidate again on completion.
+     */
+    nbd_readahead_invalidate(s, from, bytes);
+    ret = nbd_co_rw(bs, type, sector_num, nb_sectors, qiov);
+    nbd_readahead_invalidate(s, from, bytes);
+    return ret;
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
@@ -494,6 +786,7 @@ static int nbd_co_flush(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    NBDWaiter w = { .request = &request };
     ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
@@ -508,7 +801,7 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(s, &request);
+    nbd_coroutine_start(s, &w);
     ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
@@ -525,16 +818,18 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    NBDWaiter w = { .request = &request };
     ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
     request.type = NBD_CMD_TRIM;
-    request.from = sector_num * 512;;
+    request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
+    nbd_readahead_invalidate(s, request.from, request.len);
+    nbd_coroutine_start(s, &w);
     ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
@@ -542,12 +837,18 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
         nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
     nbd_coroutine_end(s, &request);
+    nbd_readahead_invalidate(s, request.from, request.len);
     return -reply.error;
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+
+    while (s->ra_in_flight) {
+        qemu_aio_wait();
+    }
+    qemu_vfree(s->ra_buf);
     g_free(s->export_name);
     g_free(s->host_spec);
 
@@ -173,6 +173,15 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     trace_qcow2_l2_allocate(bs, l1_index);
 
+    /*
+     * With lazy refcounts, the image is marked dirty before the new table is
+     * hooked up, so it doesn't need to wait for its refcount to hit the disk.
+     * If we crash, the refcounts are rebuilt when the image is opened again.
+     */
+    if (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) {
+        qcow2_mark_dirty(bs);
+    }
+
     /* allocate a new l2 entry */
 
     l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
@@ -180,9 +189,11 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* allocate a new entry in the l2 cache */
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -561,15 +562,140 @@ retry:
             size,
             (s->free_cluster_index - nb_clusters) << s->cluster_bits);
 #endif
+    if (s->batch_alloc) {
+        s->file_end = MAX(s->file_end,
+                          s->free_cluster_index << s->cluster_bits);
+    }
     return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
 }
 
+/*
+ * Batched allocation (BDRV_O_BATCH_ALLOC)
+ *
+ * Sequential writes into a growing image allocate a few clusters per request,
+ * and every one of these allocations dirties the same refcount block again.
+ * In batched mode, an allocation that would extend the image reserves a
+ * whole run of QCOW2_BATCH_ALLOC_SIZE bytes instead: its refcounts are
+ * increased in a single update and the image file is grown in one go if the
+ * protocol supports preallocation. Following allocations are carved out of
+ * the reserved run without touching any refcounts.
+ *
+ * Reserved clusters have a refcount of 1 on disk, so a crash leaks at most
+ * the unused part of one run, which qemu-img check -r leaks reclaims.
+ */
+
+/* Returns 0 if the reserved run is too short to satisfy the request */
+static int64_t take_reserved_clusters(BDRVQcowState *s, int nb_clusters)
+{
+    int64_t offset;
+
+    if (nb_clusters > s->nb_reserved_clusters) {
+        return 0;
+    }
+
+    offset = s->reserved_cluster_offset;
+    s->reserved_cluster_offset += (int64_t) nb_clusters << s->cluster_bits;
+    s->nb_reserved_clusters -= nb_clusters;
+
+    return offset;
+}
+
+static void free_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset = s->reserved_cluster_offset;
+    int64_t size = (int64_t) s->nb_reserved_clusters << s->cluster_bits;
+
+    if (size > 0) {
+        s->reserved_cluster_offset = 0;
+        s->nb_reserved_clusters = 0;
+        qcow2_free_clusters(bs, offset, size);
+    }
+}
+
+static bool alloc_extends_image(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return (s->free_cluster_index << s->cluster_bits) >= s->file_end;
+}
+
+static int64_t alloc_clusters_batched(BlockDriverState *bs, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset, run_size;
+    int nb_clusters;
+    int ret;
+
+    /* Whatever is left of the old run is too short, give it back */
+    free_reserved_clusters(bs);
+
+    nb_clusters = size_to_clusters(s, size);
+    run_size = MAX((int64_t) nb_clusters << s->cluster_bits,
+                   QCOW2_BATCH_ALLOC_SIZE);
+
+    offset = alloc_clusters_noref(bs, run_size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = update_refcount(bs, offset, run_size, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qcow2_reserve_clusters(bs, offset, size_to_clusters(s, run_size));
+
+    /* Growing the file ahead of time is only an optimisation */
+    bdrv_preallocate(bs->file, offset, run_size);
+
+    s->reserved_cluster_offset = offset;
+    s->nb_reserved_clusters = size_to_clusters(s, run_size);
+
+    return take_reserved_clusters(s, nb_clusters);
+}
+
+/*
+ * Drops the refcounts of reserved clusters that haven't been handed out yet.
+ * If they are at the end of the image file, the file is shrunk again.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset = s->reserved_cluster_offset;
+    int64_t size = (int64_t) s->nb_reserved_clusters << s->cluster_bits;
+    int64_t file_size;
+
+    if (size == 0) {
+        return;
+    }
+
+    free_reserved_clusters(bs);
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size > offset && file_size <= offset + size &&
+        bdrv_truncate(bs->file, offset) == 0) {
+        s->file_end = offset;
+    }
+}
+
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
 {
+    BDRVQcowState *s = bs->opaque;
     int64_t offset;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC);
+
+    if (s->batch_alloc) {
+        offset = take_reserved_clusters(s, size_to_clusters(s, size));
+        if (offset > 0) {
+            return offset;
+        } else if (alloc_extends_image(bs)) {
+            return alloc_clusters_batched(bs, size);
+        }
+    }
+
     offset = alloc_clusters_noref(bs, size);
     if (offset < 0) {
         return offset;
@@ -591,6 +717,13 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     uint64_t old_free_cluster_index;
     int i, refcount, ret;
 
+    /* Appending to the last allocation usually hits the reserved run */
+    if (s->nb_reserved_clusters > 0 && offset == s->reserved_cluster_offset) {
+        i = MIN(nb_clusters, s->nb_reserved_clusters);
+        take_reserved_clusters(s, i);
+        return i;
+    }
+
     /* Check how many clusters there are free */
     cluster_index = offset >> s->cluster_bits;
     for(i = 0; i < nb_clusters; i++) {
@@ -613,6 +746,9 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     }
 
     s->free_cluster_index = old_free_cluster_index;
+    if (s->batch_alloc) {
+        s->file_end = MAX(s->file_end, offset + ((int64_t) i << s->cluster_bits));
+    }
 
     return i;
 }
@@ -495,6 +495,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    /* Batched allocation is a runtime policy, nothing of it is on disk */
+    if ((flags & BDRV_O_BATCH_ALLOC) && !bs->read_only) {
+        s->file_end = bdrv_getlength(bs->file);
+        s->batch_alloc = s->file_end >= 0;
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -587,6 +593,39 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
     return (cluster_offset != 0);
 }
 
+/*
+ * Walk the L2 tables for a whole range while holding s->lock once, rather
+ * than taking it for every call to qcow2_co_is_allocated().
+ */
+static int coroutine_fn qcow2_co_get_extents(BlockDriverState *bs,
+        int64_t sector_num, int64_t nb_sectors, BlockExtent *extents,
+        int max_extents)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int n = 0;
+    int num, ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (nb_sectors > 0) {
+        num = MIN(nb_sectors, INT_MAX - s->cluster_sectors);
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, &num,
+                                       &cluster_offset);
+        if (ret < 0) {
+            break;
+        }
+        if (!bdrv_extent_add(extents, &n, max_extents, sector_num, num,
+                             cluster_offset != 0)) {
+            break;
+        }
+        sector_num += num;
+        nb_sectors -= num;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return n ? n : ret;
+}
+
 /* handle reading after the end of the backing file */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors)
@@ -873,6 +912,8 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    qcow2_release_reserved_clusters(bs);
+
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -1689,6 +1730,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_create        = qcow2_create,
     .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_get_extents  = qcow2_co_get_extents,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1717,6 +1759,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
+    .supports_aio_context = true,
 };
 
 static void bdrv_qcow2_init(void)
@@ -56,6 +56,9 @@
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Size of the cluster run reserved at once by batched allocation */
+#define QCOW2_BATCH_ALLOC_SIZE (8 * 1024 * 1024)
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 typedef struct QCowHeader {
@@ -160,6 +163,12 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Clusters reserved ahead of demand, see qcow2_alloc_clusters() */
+    bool batch_alloc;
+    int64_t reserved_cluster_offset;
+    int nb_reserved_clusters;
+    int64_t file_end;   /* end of the image file, only kept in batch mode */
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -315,6 +324,7 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
 void qcow2_free_any_clusters(BlockDriverState *bs,
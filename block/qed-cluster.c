@@ -111,6 +111,38 @@ out:
     g_free(find_cluster_cb);
 }
 
+/**
+ * Read ahead the next L2 table for sequential access
+ *
+ * A lookup that starts where the previous one ended is taken as part of a
+ * sequential stream.  The L2 table for the following L1 entry is then loaded
+ * in the background so the stream does not stall when it crosses into it.
+ */
+static void qed_readahead_l2(BDRVQEDState *s, uint64_t pos, size_t len)
+{
+    L2TableCache *l2_cache = &s->l2_cache;
+    unsigned int index = qed_l1_index(s, pos) + 1;
+    bool sequential = pos == l2_cache->next_pos;
+    uint64_t l2_offset;
+
+    l2_cache->next_pos = pos + len;
+
+    /* Read-ahead would only evict the table in use from a tiny cache */
+    if (!sequential || l2_cache->max_entries < 2 ||
+        index == l2_cache->readahead_index || index >= s->table_nelems) {
+        return;
+    }
+    l2_cache->readahead_index = index;
+
+    l2_offset = s->l1_table->offsets[index];
+    if (qed_offset_is_unalloc_cluster(l2_offset) ||
+        !qed_check_table_offset(s, l2_offset)) {
+        return;
+    }
+
+    qed_read_l2_table_ahead(s, l2_offset);
+}
+
 /**
  * Find the offset of a data cluster
  *
@@ -142,6 +174,8 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
      */
     len = MIN(len, (((pos >> s->l1_shift) + 1) << s->l1_shift) - pos);
 
+    qed_readahead_l2(s, pos, len);
+
     l2_offset = s->l1_table->offsets[qed_l1_index(s, pos)];
     if (qed_offset_is_unalloc_cluster(l2_offset)) {
         cb(opaque, QED_CLUSTER_L1, 0, len);
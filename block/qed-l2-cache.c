@@ -44,25 +44,41 @@
  *
  * An interesting case occurs when two requests need to access an L2 table that
  * is not in the cache.  Since the operation to read the table from the image
- * file takes some time to complete, both requests may see a cache miss and
- * start reading the L2 table from the image file.  The first to finish will
- * commit its L2 table into the cache.  When the second tries to commit its
- * table will be deleted in favor of the existing cache entry.
+ * file takes some time to complete, both requests may see a cache miss.  Only
+ * the first one starts reading the L2 table from the image file, the second
+ * one finds the read in flight and waits for it to complete.  Reads of
+ * different tables proceed in parallel.  Should a table still be committed
+ * twice, for example when read-ahead raced with a new L2 table allocation, the
+ * second copy is deleted in favor of the existing cache entry.
+ *
+ * The cache holds max_entries tables unless all of them are in use, in which
+ * case it grows temporarily.  The size can be set with the metadata-cache-size
+ * drive option.
  */
 
 #include "trace.h"
 #include "qed.h"
 
 /* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
+#define DEFAULT_L2_CACHE_SIZE 50
 
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of tables to keep cached, 0 for the default
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
     QTAILQ_INIT(&l2_cache->entries);
+    QLIST_INIT(&l2_cache->loads);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries ? max_entries : DEFAULT_L2_CACHE_SIZE;
+    l2_cache->next_pos = 0;
+    l2_cache->readahead_index = 0;
+    l2_cache->hits = 0;
+    l2_cache->misses = 0;
+    l2_cache->shared_misses = 0;
+    l2_cache->readahead = 0;
 }
 
 /**
@@ -72,6 +88,8 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
 {
     CachedL2Table *entry, *next_entry;
 
+    assert(QLIST_EMPTY(&l2_cache->loads));
+
     QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next_entry) {
         qemu_vfree(entry->table);
         g_free(entry);
@@ -164,7 +182,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
     /* Evict an unused cache entry so we have space.  If all entries are in use
      * we can grow the cache temporarily and we try to shrink back down later.
      */
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         CachedL2Table *next;
         QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next) {
             if (entry->ref > 1) {
@@ -176,7 +194,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             qed_unref_l2_cache_entry(entry);
 
             /* Stop evicting when we've shrunk back to max size */
-            if (l2_cache->n_entries < MAX_L2_CACHE_SIZE) {
+            if (l2_cache->n_entries < l2_cache->max_entries) {
                 break;
             }
         }
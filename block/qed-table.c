@@ -200,65 +200,159 @@ int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
     return ret;
 }
 
-typedef struct {
+typedef struct QEDL2Waiter {
     GenericCB gencb;
-    BDRVQEDState *s;
-    uint64_t l2_offset;
     QEDRequest *request;
-} QEDReadL2TableCB;
+    QSIMPLEQ_ENTRY(QEDL2Waiter) next;
+} QEDL2Waiter;
+
+/* An L2 table read in flight, completing all requests waiting for the table */
+struct QEDL2Load {
+    BDRVQEDState *s;
+    uint64_t offset;
+    CachedL2Table *l2_table;        /* entry being read, not yet committed */
+    QSIMPLEQ_HEAD(, QEDL2Waiter) waiters;
+    QLIST_ENTRY(QEDL2Load) next;
+};
+
+static QEDL2Load *qed_find_l2_load(BDRVQEDState *s, uint64_t offset)
+{
+    QEDL2Load *load;
+
+    QLIST_FOREACH(load, &s->l2_cache.loads, next) {
+        if (load->offset == offset) {
+            return load;
+        }
+    }
+    return NULL;
+}
 
 static void qed_read_l2_table_cb(void *opaque, int ret)
 {
-    QEDReadL2TableCB *read_l2_table_cb = opaque;
-    QEDRequest *request = read_l2_table_cb->request;
-    BDRVQEDState *s = read_l2_table_cb->s;
-    CachedL2Table *l2_table = request->l2_table;
-    uint64_t l2_offset = read_l2_table_cb->l2_offset;
+    QEDL2Load *load = opaque;
+    BDRVQEDState *s = load->s;
+    CachedL2Table *l2_table = load->l2_table;
+    QEDL2Waiter *waiter, *next_waiter;
+
+    QLIST_REMOVE(load, next);
 
     if (ret) {
         /* can't trust loaded L2 table anymore */
         qed_unref_l2_cache_entry(l2_table);
-        request->l2_table = NULL;
     } else {
-        l2_table->offset = l2_offset;
+        l2_table->offset = load->offset;
 
         qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
+    }
+
+    /* Hand out all references before completing anyone, a completion may
+     * commit other tables and would otherwise be free to evict this one.
+     */
+    QSIMPLEQ_FOREACH(waiter, &load->waiters, next) {
+        if (ret) {
+            waiter->request->l2_table = NULL;
+            continue;
+        }
 
         /* This is guaranteed to succeed because we just committed the entry
          * to the cache.
          */
-        request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, l2_offset);
-        assert(request->l2_table != NULL);
+        waiter->request->l2_table = qed_find_l2_cache_entry(&s->l2_cache,
+                                                            load->offset);
+        assert(waiter->request->l2_table != NULL);
+    }
+
+    trace_qed_read_l2_table_cb(s, load->offset, ret);
+
+    QSIMPLEQ_FOREACH_SAFE(waiter, &load->waiters, next, next_waiter) {
+        gencb_complete(&waiter->gencb, ret);
     }
+    g_free(load);
+}
 
-    gencb_complete(&read_l2_table_cb->gencb, ret);
+static QEDL2Load *qed_start_l2_load(BDRVQEDState *s, uint64_t offset)
+{
+    QEDL2Load *load = g_malloc(sizeof(*load));
+
+    load->s = s;
+    load->offset = offset;
+    load->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
+    load->l2_table->table = qed_alloc_table(s);
+    QSIMPLEQ_INIT(&load->waiters);
+    QLIST_INSERT_HEAD(&s->l2_cache.loads, load, next);
+    return load;
+}
+
+static void qed_issue_l2_load(BDRVQEDState *s, QEDL2Load *load)
+{
+    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
+    qed_read_table(s, load->offset, load->l2_table->table,
+                   qed_read_l2_table_cb, load);
 }
 
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque)
 {
-    QEDReadL2TableCB *read_l2_table_cb;
+    QEDL2Waiter *waiter;
+    QEDL2Load *load;
+    bool shared;
 
     qed_unref_l2_cache_entry(request->l2_table);
 
     /* Check for cached L2 entry */
     request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
     if (request->l2_table) {
+        s->l2_cache.hits++;
         cb(opaque, 0);
         return;
     }
 
-    request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
-    request->l2_table->table = qed_alloc_table(s);
+    /* Wait for the table if it is already being read */
+    load = qed_find_l2_load(s, offset);
+    shared = load != NULL;
+    if (!shared) {
+        load = qed_start_l2_load(s, offset);
+    }
 
-    read_l2_table_cb = gencb_alloc(sizeof(*read_l2_table_cb), cb, opaque);
-    read_l2_table_cb->s = s;
-    read_l2_table_cb->l2_offset = offset;
-    read_l2_table_cb->request = request;
+    s->l2_cache.misses++;
+    if (shared) {
+        s->l2_cache.shared_misses++;
+    }
+    trace_qed_read_l2_table(s, offset, shared);
 
-    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
-    qed_read_table(s, offset, request->l2_table->table,
-                   qed_read_l2_table_cb, read_l2_table_cb);
+    waiter = gencb_alloc(sizeof(*waiter), cb, opaque);
+    waiter->request = request;
+    QSIMPLEQ_INSERT_TAIL(&load->waiters, waiter, next);
+
+    if (!shared) {
+        qed_issue_l2_load(s, load);
+    }
+}
+
+/**
+ * Start reading an L2 table into the cache without waiting for it
+ *
+ * Nothing is done if the table is already cached or being read.  Requests that
+ * need the table before the read completes wait for it like for any other
+ * in-flight read.
+ */
+void qed_read_l2_table_ahead(BDRVQEDState *s, uint64_t offset)
+{
+    CachedL2Table *entry;
+
+    if (qed_find_l2_load(s, offset)) {
+        return;
+    }
+
+    entry = qed_find_l2_cache_entry(&s->l2_cache, offset);
+    if (entry) {
+        qed_unref_l2_cache_entry(entry);
+        return;
+    }
+
+    trace_qed_read_l2_table_ahead(s, offset);
+    s->l2_cache.readahead++;
+    qed_issue_l2_load(s, qed_start_l2_load(s, offset));
 }
 
 int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request, uint64_t offset)
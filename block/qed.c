@@ -378,6 +378,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     BDRVQEDState *s = bs->opaque;
     QEDHeader le_header;
     int64_t file_size;
+    unsigned int l2_cache_entries = 0;
     int ret;
 
     s->bs = bs;
@@ -468,8 +469,14 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
         bdrv_flush(bs->file);
     }
 
+    if (bs->metadata_cache_size) {
+        l2_cache_entries = MAX(bs->metadata_cache_size /
+                               (s->header.cluster_size * s->header.table_size),
+                               1);
+    }
+
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, l2_cache_entries);
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -529,6 +536,11 @@ static void bdrv_qed_close(BlockDriverState *bs)
         qed_write_header_sync(s);
     }
 
+    /* Wait for L2 table read-ahead before freeing the cache */
+    while (!QLIST_EMPTY(&s->l2_cache.loads)) {
+        qemu_aio_wait();
+    }
+
     qed_free_l2_cache(&s->l2_cache);
     qemu_vfree(s->l1_table);
 }
@@ -1448,6 +1460,19 @@ static int bdrv_qed_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void bdrv_qed_get_cache_stats(const BlockDriverState *bs,
+                                     BlockMetadataCacheStats *stats)
+{
+    BDRVQEDState *s = bs->opaque;
+
+    stats->hits = s->l2_cache.hits;
+    stats->misses = s->l2_cache.misses;
+    stats->shared_misses = s->l2_cache.shared_misses;
+    stats->readahead = s->l2_cache.readahead;
+    stats->entries = s->l2_cache.n_entries;
+    stats->max_entries = s->l2_cache.max_entries;
+}
+
 static int bdrv_qed_change_backing_file(BlockDriverState *bs,
                                         const char *backing_file,
                                         const char *backing_fmt)
@@ -1582,6 +1607,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_truncate            = bdrv_qed_truncate,
     .bdrv_getlength           = bdrv_qed_getlength,
     .bdrv_get_info            = bdrv_qed_get_info,
+    .bdrv_get_cache_stats     = bdrv_qed_get_cache_stats,
     .bdrv_change_backing_file = bdrv_qed_change_backing_file,
     .bdrv_invalidate_cache    = bdrv_qed_invalidate_cache,
     .bdrv_check               = bdrv_qed_check,
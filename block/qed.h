@@ -114,9 +114,25 @@ typedef struct CachedL2Table {
     int ref;
 } CachedL2Table;
 
+typedef struct QEDL2Load QEDL2Load;
+
 typedef struct {
     QTAILQ_HEAD(, CachedL2Table) entries;
     unsigned int n_entries;
+    unsigned int max_entries;       /* evict unused entries beyond this */
+
+    /* L2 table reads still in flight, shared by all requests for a table */
+    QLIST_HEAD(, QEDL2Load) loads;
+
+    /* Sequential access detection for read-ahead */
+    uint64_t next_pos;              /* end of the last lookup, in bytes */
+    unsigned int readahead_index;   /* L1 index last read ahead */
+
+    /* Statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t shared_misses;
+    uint64_t readahead;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -218,7 +234,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -237,6 +253,7 @@ int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                            uint64_t offset);
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque);
+void qed_read_l2_table_ahead(BDRVQEDState *s, uint64_t offset);
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque);
@@ -750,6 +750,7 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
 
     acb->bs = bs;
     acb->aio_type = type;
@@ -763,7 +764,8 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_offset = sector_num * 512;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
@@ -855,6 +857,28 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+#ifdef CONFIG_FALLOCATE
+static int raw_preallocate(BlockDriverState *bs, int64_t offset,
+                           int64_t length)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    do {
+        ret = fallocate(s->fd, 0, offset, length);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            return -ENOTSUP;
+        }
+        return -errno;
+    }
+
+    return 0;
+}
+#endif
+
 #ifdef __OpenBSD__
 static int64_t raw_getlength(BlockDriverState *bs)
 {
@@ -1006,6 +1030,17 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+static int raw_get_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* O_DIRECT requests bypass the page cache that zero-copy reads use */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+
 static int raw_create(const char *filename, QEMUOptionParameter *options)
 {
     int fd;
@@ -1135,6 +1170,78 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
     }
 }
 
+#ifdef CONFIG_FIEMAP
+#define RAW_FIEMAP_EXTENTS 32
+
+/*
+ * Map a range of the file with as few FIEMAP calls as possible, instead of
+ * one call per extent as raw_co_is_allocated() needs.
+ */
+static int coroutine_fn raw_co_get_extents(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors,
+                                           BlockExtent *extents,
+                                           int max_extents)
+{
+    BDRVRawState *s = bs->opaque;
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent fe[RAW_FIEMAP_EXTENTS];
+    } f;
+    int64_t end = sector_num + nb_sectors;
+    int n = 0;
+    int i, ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (sector_num < end) {
+        bool last = false;
+
+        f.fm.fm_start = sector_num * BDRV_SECTOR_SIZE;
+        f.fm.fm_length = (end - sector_num) * BDRV_SECTOR_SIZE;
+        f.fm.fm_flags = 0;
+        f.fm.fm_extent_count = RAW_FIEMAP_EXTENTS;
+        f.fm.fm_reserved = 0;
+        if (ioctl(s->fd, FS_IOC_FIEMAP, &f) == -1) {
+            /* Assume everything is allocated.  */
+            bdrv_extent_add(extents, &n, max_extents, sector_num,
+                            end - sector_num, true);
+            return n;
+        }
+
+        for (i = 0; i < f.fm.fm_mapped_extents; i++) {
+            struct fiemap_extent *fe = &f.fe[i];
+            int64_t data = fe->fe_logical / BDRV_SECTOR_SIZE;
+            int64_t hole = DIV_ROUND_UP(fe->fe_logical + fe->fe_length,
+                                        BDRV_SECTOR_SIZE);
+
+            data = MIN(MAX(data, sector_num), end);
+            hole = MIN(hole, end);
+            if (!bdrv_extent_add(extents, &n, max_extents, sector_num,
+                                 data - sector_num, false) ||
+                !bdrv_extent_add(extents, &n, max_extents, data,
+                                 hole - data, true)) {
+                return n;
+            }
+            sector_num = MAX(sector_num, hole);
+            last = fe->fe_flags & FIEMAP_EXTENT_LAST;
+        }
+
+        if (last || f.fm.fm_mapped_extents < RAW_FIEMAP_EXTENTS) {
+            /* No more data in the range */
+            bdrv_extent_add(extents, &n, max_extents, sector_num,
+                            end - sector_num, false);
+            break;
+        }
+    }
+
+    return n;
+}
+#endif
+
 static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors,
     BlockDriverCompletionFunc *cb, void *opaque)
@@ -1145,6 +1252,29 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1166,6 +1296,9 @@ static BlockDriver bdrv_file = {
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
     .bdrv_co_is_allocated = raw_co_is_allocated,
+#ifdef CONFIG_FIEMAP
+    .bdrv_co_get_extents = raw_co_get_extents,
+#endif
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1173,9 +1306,17 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_discard = raw_aio_discard,
 
     .bdrv_truncate = raw_truncate,
+#ifdef CONFIG_FALLOCATE
+    .bdrv_preallocate = raw_preallocate,
+#endif
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_get_fd = raw_get_fd,
+
+    .supports_aio_context = true,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .create_options = raw_create_options,
 };
@@ -1413,6 +1554,7 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData *acb;
+    ThreadPool *pool;
 
     if (fd_open(bs) < 0)
         return NULL;
@@ -1424,7 +1566,8 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1507,6 +1650,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .supports_aio_context = true,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
@@ -1632,6 +1778,9 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .supports_aio_context = true,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
@@ -1734,6 +1883,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .supports_aio_context = true,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
@@ -1856,6 +2008,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .supports_aio_context = true,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
 
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
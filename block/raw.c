@@ -42,11 +42,26 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
     return bdrv_co_is_allocated(bs->file, sector_num, nb_sectors, pnum);
 }
 
+static int coroutine_fn raw_co_get_extents(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors,
+                                           BlockExtent *extents,
+                                           int max_extents)
+{
+    return bdrv_co_get_extents(bs->file, sector_num, nb_sectors, extents,
+                               max_extents);
+}
+
 static int64_t raw_getlength(BlockDriverState *bs)
 {
     return bdrv_getlength(bs->file);
 }
 
+static int raw_get_fd(BlockDriverState *bs)
+{
+    return bdrv_get_fd(bs->file);
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     return bdrv_truncate(bs->file, offset);
@@ -128,11 +143,13 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_readv          = raw_co_readv,
     .bdrv_co_writev         = raw_co_writev,
     .bdrv_co_is_allocated   = raw_co_is_allocated,
+    .bdrv_co_get_extents    = raw_co_get_extents,
     .bdrv_co_discard        = raw_co_discard,
 
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
     .bdrv_truncate      = raw_truncate,
+    .bdrv_get_fd        = raw_get_fd,
 
     .bdrv_is_inserted   = raw_is_inserted,
     .bdrv_media_changed = raw_media_changed,
@@ -145,6 +162,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
+    .supports_aio_context = true,
 };
 
 static void bdrv_raw_init(void)
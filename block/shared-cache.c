@@ -0,0 +1,460 @@
+/*
+ * Shared backing file cache
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Many guests on a host are often started from the same read-only backing
+ * image.  Each QEMU process reads the same blocks of that image from storage,
+ * which hurts when they all boot at once.  This cache keeps backing file data
+ * in a file on tmpfs that every QEMU process using the image maps into its
+ * address space, so only the first reader of a block has to go to storage.
+ *
+ * The cache is keyed by the format driver and the identity (device, inode,
+ * size and modification time) of the image and of every image below it in
+ * the backing chain, so it is only shared by users of the same, unmodified
+ * chain opened the same way.  The cache file is named after a hash of the
+ * key and the full key is stored in its header and compared on attach.  It
+ * holds a direct-mapped table of fixed-size chunks.  A chunk that maps to an
+ * occupied slot evicts the chunk stored there.
+ *
+ * Each slot has a sequence count that is odd while a process fills the slot.
+ * Readers copy the data out and fall back to reading from the image if the
+ * count was odd or changed while they were copying.
+ *
+ * The first process creates the cache file with the requested size, later
+ * ones attach to it as it is.  Processes hold a shared lock on the file while
+ * attached and the last one to detach removes it.
+ *
+ * The cache directory is world-writable, so the file is only ever created
+ * exclusively with mode 0600, never opened through a symlink, and a file that
+ * is not owned by our effective uid or that others can access is not used.
+ * Caches are therefore only shared between processes of the same user.
+ */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "block/block_int.h"
+#include "block/shared-cache.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC          0x5153484341434845ULL /* "QSHCACHE" */
+#define SHARED_CACHE_VERSION        2
+#define SHARED_CACHE_CHUNK_SIZE     (64 * 1024)
+#define SHARED_CACHE_CHUNK_SECTORS  (SHARED_CACHE_CHUNK_SIZE / BDRV_SECTOR_SIZE)
+#define SHARED_CACHE_ALIGN          4096
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t nb_slots;
+    uint32_t key_len;       /* the key follows the header */
+    uint32_t reserved;
+} SharedCacheHeader;
+
+#define SHARED_CACHE_MAX_KEY_LEN    (SHARED_CACHE_ALIGN - \
+                                     sizeof(SharedCacheHeader))
+
+typedef struct {
+    uint64_t tag;           /* chunk index + 1, 0 for an empty slot */
+    uint32_t seq;           /* odd while the slot is being filled */
+    uint32_t reserved;
+} SharedCacheSlot;
+
+struct BlockSharedCache {
+    char *path;
+    int fd;
+    void *map;
+    size_t map_size;
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_slots;
+
+    /* Statistics of this process */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+static size_t shared_cache_data_offset(uint64_t nb_slots)
+{
+    return QEMU_ALIGN_UP(SHARED_CACHE_ALIGN +
+                         nb_slots * sizeof(SharedCacheSlot),
+                         SHARED_CACHE_ALIGN);
+}
+
+static const char *shared_cache_dir(void)
+{
+    if (access("/dev/shm", W_OK) == 0) {
+        return "/dev/shm";
+    }
+    return g_get_tmp_dir();
+}
+
+/* Describe the image and its backing chain, returns NULL if any of the
+ * images is not a regular file
+ */
+static char *shared_cache_key(BlockDriverState *bs)
+{
+    GString *key = g_string_new(NULL);
+    struct stat st;
+
+    for (; bs; bs = bs->backing_hd) {
+        if (!bs->drv || stat(bs->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+            g_string_free(key, true);
+            return NULL;
+        }
+        g_string_append_printf(key, "%s:%" PRIx64 ":%" PRIx64 ":%" PRIx64
+                               ":%" PRIx64 ";", bs->drv->format_name,
+                               (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                               (uint64_t)st.st_size, (uint64_t)st.st_mtime);
+    }
+    return g_string_free(key, false);
+}
+
+/* 64-bit FNV-1a, only used to name the cache file */
+static uint64_t shared_cache_hash(const char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *key; key++) {
+        hash ^= (uint8_t)*key;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Set up the cache file under a temporary name and move it into place, so
+ * that nobody ever sees it half initialized.  Losing the race against
+ * another process creating the same cache is fine.
+ */
+static int shared_cache_create(const char *path, const char *key,
+                               uint64_t nb_slots)
+{
+    SharedCacheHeader header = {
+        .magic      = SHARED_CACHE_MAGIC,
+        .version    = SHARED_CACHE_VERSION,
+        .chunk_size = SHARED_CACHE_CHUNK_SIZE,
+        .nb_slots   = nb_slots,
+        .key_len    = strlen(key),
+    };
+    char *tmp = g_strdup_printf("%s.%08x%08x", path, g_random_int(),
+                                g_random_int());
+    int fd, ret = 0;
+
+    fd = qemu_open(tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (ftruncate(fd, shared_cache_data_offset(nb_slots) +
+                      nb_slots * SHARED_CACHE_CHUNK_SIZE) < 0) {
+        ret = -errno;
+    } else if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+               pwrite(fd, key, header.key_len, sizeof(header)) !=
+                   header.key_len) {
+        ret = -EIO;
+    } else if (link(tmp, path) < 0 && errno != EEXIST) {
+        ret = -errno;
+    }
+
+    unlink(tmp);
+    qemu_close(fd);
+out:
+    g_free(tmp);
+    return ret;
+}
+
+/**
+ * Attach to the shared cache for an opened image
+ *
+ * @bs:         Image, it and its backing chain must be regular files
+ * @size:       Size of the cache in bytes if it has to be created
+ *
+ * Returns NULL if the image cannot be cached, the caller then simply reads
+ * from the image.
+ */
+BlockSharedCache *shared_cache_open(BlockDriverState *bs, uint64_t size)
+{
+    BlockSharedCache *c;
+    SharedCacheHeader *header;
+    struct stat st;
+    uint64_t nb_slots;
+    char *key, *path = NULL;
+    void *map;
+    int fd;
+
+    if (size < 2 * SHARED_CACHE_ALIGN + SHARED_CACHE_CHUNK_SIZE) {
+        return NULL;
+    }
+    nb_slots = (size - 2 * SHARED_CACHE_ALIGN) /
+               (SHARED_CACHE_CHUNK_SIZE + sizeof(SharedCacheSlot));
+
+    key = shared_cache_key(bs);
+    if (!key || strlen(key) > SHARED_CACHE_MAX_KEY_LEN) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    path = g_strdup_printf("%s/qemu-shared-cache-%d-%016" PRIx64,
+                           shared_cache_dir(), (int)geteuid(),
+                           shared_cache_hash(key));
+
+    fd = qemu_open(path, O_RDWR | O_NOFOLLOW);
+    if (fd < 0 && errno == ENOENT &&
+        shared_cache_create(path, key, nb_slots) == 0) {
+        fd = qemu_open(path, O_RDWR | O_NOFOLLOW);
+    }
+    if (fd < 0) {
+        goto fail;
+    }
+
+    /* Somebody else may have planted the file */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        errno = EPERM;
+        goto fail_fd;
+    }
+
+    if (flock(fd, LOCK_SH) < 0 || st.st_size < SHARED_CACHE_ALIGN) {
+        goto fail_fd;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail_fd;
+    }
+
+    header = map;
+    if (header->magic != SHARED_CACHE_MAGIC ||
+        header->version != SHARED_CACHE_VERSION ||
+        header->chunk_size != SHARED_CACHE_CHUNK_SIZE ||
+        header->nb_slots == 0 ||
+        shared_cache_data_offset(header->nb_slots) +
+            header->nb_slots * SHARED_CACHE_CHUNK_SIZE > st.st_size ||
+        header->key_len != strlen(key) ||
+        memcmp(header + 1, key, header->key_len)) {
+        munmap(map, st.st_size);
+        goto fail_fd;
+    }
+
+    c = g_malloc0(sizeof(*c));
+    c->path = path;
+    c->fd = fd;
+    c->map = map;
+    c->map_size = st.st_size;
+    c->nb_slots = header->nb_slots;
+    c->slots = (SharedCacheSlot *)((uint8_t *)map + SHARED_CACHE_ALIGN);
+    c->data = (uint8_t *)map + shared_cache_data_offset(c->nb_slots);
+
+    trace_shared_cache_open(c, bs->filename, path, c->nb_slots);
+    g_free(key);
+    return c;
+
+fail_fd:
+    qemu_close(fd);
+fail:
+    trace_shared_cache_open_failed(bs->filename, path ?: "", errno);
+    g_free(path);
+    g_free(key);
+    return NULL;
+}
+
+void shared_cache_close(BlockSharedCache *c)
+{
+    munmap(c->map, c->map_size);
+
+    /* Remove the cache file if nobody else is attached */
+    if (flock(c->fd, LOCK_EX | LOCK_NB) == 0) {
+        unlink(c->path);
+    }
+    qemu_close(c->fd);
+
+    g_free(c->path);
+    g_free(c);
+}
+
+static SharedCacheSlot *shared_cache_slot(BlockSharedCache *c, uint64_t chunk,
+                                          uint8_t **data)
+{
+    uint64_t index = chunk % c->nb_slots;
+
+    *data = c->data + index * SHARED_CACHE_CHUNK_SIZE;
+    return &c->slots[index];
+}
+
+/* Copy part of a chunk to @qiov, returns false if it is not cached */
+static bool shared_cache_read_chunk(BlockSharedCache *c, uint64_t chunk,
+                                    size_t offset, size_t bytes,
+                                    QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    slot = shared_cache_slot(c, chunk, &data);
+    seq = slot->seq;
+    smp_rmb();
+    if ((seq & 1) || slot->tag != chunk + 1) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, data + offset, bytes);
+
+    smp_rmb();
+    return slot->seq == seq;
+}
+
+static void shared_cache_write_chunk(BlockSharedCache *c, uint64_t chunk,
+                                     const uint8_t *buf)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    slot = shared_cache_slot(c, chunk, &data);
+    seq = slot->seq;
+    if (slot->tag == chunk + 1 && !(seq & 1)) {
+        return;
+    }
+
+    /* Leave the slot alone if another process is filling it */
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+        return;
+    }
+
+    if (slot->tag) {
+        c->evictions++;
+    }
+    slot->tag = chunk + 1;
+    memcpy(data, buf, SHARED_CACHE_CHUNK_SIZE);
+
+    smp_wmb();
+    slot->seq = seq + 2;
+}
+
+static bool shared_cache_lookup(BlockSharedCache *c, int64_t sector_num,
+                                int nb_sectors, QEMUIOVector *qiov)
+{
+    uint64_t pos = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = pos + nb_sectors * BDRV_SECTOR_SIZE;
+    size_t qiov_offset = 0;
+
+    while (pos < end) {
+        size_t offset = pos % SHARED_CACHE_CHUNK_SIZE;
+        size_t bytes = MIN(SHARED_CACHE_CHUNK_SIZE - offset, end - pos);
+
+        if (!shared_cache_read_chunk(c, pos / SHARED_CACHE_CHUNK_SIZE,
+                                     offset, bytes, qiov, qiov_offset)) {
+            return false;
+        }
+        pos += bytes;
+        qiov_offset += bytes;
+    }
+    return true;
+}
+
+/**
+ * Read from a backing file through the shared cache
+ *
+ * On a miss whole chunks are read from the image so that they can be added
+ * to the cache.  A partial chunk at the end of the image is never cached.
+ */
+int coroutine_fn shared_cache_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    BlockSharedCache *c = bs->shared_cache;
+    int64_t chunk_sector_num, end, i;
+    QEMUIOVector bounce_qiov;
+    struct iovec iov;
+    uint8_t *bounce;
+    int ret;
+
+    if (shared_cache_lookup(c, sector_num, nb_sectors, qiov)) {
+        c->hits++;
+        return 0;
+    }
+    c->misses++;
+
+    chunk_sector_num = QEMU_ALIGN_DOWN(sector_num, SHARED_CACHE_CHUNK_SECTORS);
+    end = MIN(QEMU_ALIGN_UP(sector_num + nb_sectors,
+                            SHARED_CACHE_CHUNK_SECTORS),
+              bs->total_sectors);
+
+    trace_shared_cache_co_readv_miss(bs, sector_num, nb_sectors,
+                                     chunk_sector_num, end - chunk_sector_num);
+
+    iov.iov_len = (end - chunk_sector_num) * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = bs->drv->bdrv_co_readv(bs, chunk_sector_num,
+                                 end - chunk_sector_num, &bounce_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = chunk_sector_num; i + SHARED_CACHE_CHUNK_SECTORS <= end;
+         i += SHARED_CACHE_CHUNK_SECTORS) {
+        shared_cache_write_chunk(c, i / SHARED_CACHE_CHUNK_SECTORS,
+                bounce + (i - chunk_sector_num) * BDRV_SECTOR_SIZE);
+    }
+
+    qemu_iovec_from_buf(qiov, 0,
+                        bounce + (sector_num - chunk_sector_num) *
+                                 BDRV_SECTOR_SIZE,
+                        nb_sectors * BDRV_SECTOR_SIZE);
+
+out:
+    qemu_vfree(bounce);
+    return ret;
+}
+
+/**
+ * Drop chunks that overlap a write to the image from the cache
+ *
+ * Backing files are read-only in normal operation, but block-commit can
+ * write to them.  This is called before the write is submitted, so that
+ * nobody can be served the old data from the cache once the image has
+ * changed.
+ */
+void shared_cache_invalidate(BlockSharedCache *c, int64_t sector_num,
+                             int nb_sectors)
+{
+    uint64_t chunk = sector_num / SHARED_CACHE_CHUNK_SECTORS;
+    uint64_t last = (sector_num + nb_sectors - 1) / SHARED_CACHE_CHUNK_SECTORS;
+
+    for (; chunk <= last; chunk++) {
+        SharedCacheSlot *slot;
+        uint8_t *data;
+        uint32_t seq;
+
+        slot = shared_cache_slot(c, chunk, &data);
+        seq = slot->seq;
+        if (slot->tag != chunk + 1 || (seq & 1) ||
+            !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+            continue;
+        }
+        slot->tag = 0;
+        smp_wmb();
+        slot->seq = seq + 2;
+    }
+}
+
+void shared_cache_get_stats(BlockSharedCache *c, BlockSharedCacheStats *stats)
+{
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+    stats->size = c->nb_slots * SHARED_CACHE_CHUNK_SIZE;
+}
@@ -23,6 +23,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Maximum number of copy requests in flight */
+    STREAM_MAX_WORKERS = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -33,6 +36,12 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char backing_file_id[1024];
+
+    int workers;
+    BlockJobCopyPool pool;
+
+    /* first error that was ignored or reported */
+    int error;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockDriverState *bs,
@@ -51,6 +60,63 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+/*
+ * Like bdrv_co_is_allocated_above() for the backing chain of @bs, but
+ * coalesces consecutive allocated runs that come from different images in
+ * the chain, so that they can be copied in a single request.
+ */
+static int coroutine_fn stream_is_allocated_below(BlockDriverState *bs,
+                                                  BlockDriverState *base,
+                                                  int64_t sector_num,
+                                                  int nb_sectors, int *pnum)
+{
+    int ret, n, total;
+
+    ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
+                                     sector_num, nb_sectors, pnum);
+    if (ret != 1) {
+        return ret;
+    }
+
+    total = *pnum;
+    while (total < nb_sectors) {
+        ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
+                                         sector_num + total,
+                                         nb_sectors - total, &n);
+        if (ret != 1 || n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    *pnum = total;
+    return 1;
+}
+
+static BlockJobCopyResult coroutine_fn stream_copy(BlockJob *job,
+                                                   BlockJobCopyRequest *req)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+    BlockErrorAction action;
+    int ret;
+
+    ret = stream_populate(job->bs, req->sector_num, req->nb_sectors,
+                          req->buf);
+    if (ret >= 0) {
+        return BLOCK_JOB_COPY_DONE;
+    }
+
+    action = block_job_error_action(job, job->bs, s->on_error, true, -ret);
+    if (action == BDRV_ACTION_STOP) {
+        return BLOCK_JOB_COPY_RETRY;
+    }
+    if (s->error == 0) {
+        s->error = ret;
+    }
+    return action == BDRV_ACTION_REPORT ? BLOCK_JOB_COPY_FAILED
+                                        : BLOCK_JOB_COPY_SKIPPED;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -78,11 +144,11 @@ static void coroutine_fn stream_run(void *opaque)
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
+    BlockJobAllocMap map;
     int64_t sector_num, end;
-    int error = 0;
+    bool finished;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -91,7 +157,10 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+
+    block_job_alloc_map_init(&map, bs, bs->backing_hd);
+    block_job_copy_pool_init(&s->pool, &s->common, s->workers,
+                             STREAM_BUFFER_SIZE, stream_copy);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -109,22 +178,43 @@ static void coroutine_fn stream_run(void *opaque)
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
+         * Copy requests are left running, except when the job is paused:
+         * then they finish first so that no more progress is made.
          */
+        if (block_job_is_paused(&s->common)) {
+            block_job_copy_pool_drain(&s->pool);
+        }
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->pool.failed) {
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
+        block_job_copy_pool_resubmit(&s->pool);
+
+        /* Charge the data that was actually copied to the rate limit */
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                 s->pool.bytes_unaccounted);
+            s->pool.bytes_unaccounted = 0;
+            if (delay_ns > 0) {
+                goto wait;
+            }
+        }
+
+        ret = block_job_is_allocated(&map, sector_num, end, &n);
+        if (ret < 0) {
+            /* Skip this chunk if the error is ignored */
+            n = MIN(STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, end - sector_num);
+            copy = false;
+        } else if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
             copy = false;
         } else {
             /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
+             * known-unallocated area [sector_num, sector_num+n), a buffer
+             * at a time.  */
+            n = MIN(STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, n);
+            ret = stream_is_allocated_below(bs, base, sector_num, n, &n);
 
             /* Finish early if end of backing file has been reached */
             if (ret == 0 && n == 0) {
@@ -135,13 +225,13 @@ wait:
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
         if (ret >= 0 && copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
+            if (!block_job_copy_pool_start(&s->pool, sector_num, n)) {
+                /* All requests wait to be retried or the job failed, go
+                 * back to sleep and look at this area again afterwards.
+                 */
+                n = 0;
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            continue;
         }
         if (ret < 0) {
             BlockErrorAction action =
@@ -151,8 +241,8 @@ wait:
                 n = 0;
                 continue;
             }
-            if (error == 0) {
-                error = ret;
+            if (s->error == 0) {
+                s->error = ret;
             }
             if (action == BDRV_ACTION_REPORT) {
                 break;
@@ -164,14 +254,20 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
+    /* Wait for the copy requests, retrying those that failed if the job
+     * was stopped because of them.
+     */
+    finished = block_job_copy_pool_finish(&s->pool);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
 
     /* Do not remove the backing file if an error was there but ignored.  */
-    ret = error;
+    ret = s->error;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0 &&
+        finished) {
         const char *base_id = NULL, *base_fmt = NULL;
         if (base) {
             base_id = s->backing_file_id;
@@ -183,7 +279,7 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
+    block_job_copy_pool_cleanup(&s->pool);
     block_job_completed(&s->common, ret);
 }
 
@@ -195,7 +291,7 @@ static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
         error_set(errp, QERR_INVALID_PARAMETER, "speed");
         return;
     }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+    ratelimit_set_speed(&s->limit, speed, SLICE_TIME);
 }
 
 static BlockJobType stream_job_type = {
@@ -205,13 +301,18 @@ static BlockJobType stream_job_type = {
 };
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed,
+                  const char *base_id, int64_t speed, int workers,
                   BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     StreamBlockJob *s;
 
+    if (workers < 1 || workers > STREAM_MAX_WORKERS) {
+        error_set(errp, QERR_INVALID_PARAMETER, "workers");
+        return;
+    }
+
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -230,6 +331,7 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     s->on_error = on_error;
+    s->workers = workers;
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
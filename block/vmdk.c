@@ -26,6 +26,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
+#include "block/thread-pool.h"
 #include "migration/migration.h"
 #include <zlib.h>
 
@@ -66,7 +67,8 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Default number of grain tables cached per extent */
+#define L2_CACHE_SIZE 64
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -84,9 +86,10 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
 
     unsigned int cluster_sectors;
 } VmdkExtent;
@@ -100,6 +103,10 @@ typedef struct BDRVVmdkState {
     /* Extent array with num_extents entries, ascend ordered by address */
     VmdkExtent *extents;
     Error *migration_blocker;
+
+    /* Grain table cache statistics */
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -196,6 +203,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_counts);
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
@@ -435,8 +444,21 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
+    /* There is no point in caching more grain tables than there are */
+    extent->l2_cache_size = L2_CACHE_SIZE;
+    if (bs->metadata_cache_size) {
+        extent->l2_cache_size = MAX(bs->metadata_cache_size /
+                                    (extent->l2_size * sizeof(uint32_t)), 1);
+    }
+    extent->l2_cache_size = MIN(extent->l2_cache_size,
+                                MAX(extent->l1_size, 1));
+
     extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+        g_malloc(extent->l2_size * extent->l2_cache_size * sizeof(uint32_t));
+    extent->l2_cache_offsets =
+        g_malloc0(extent->l2_cache_size * sizeof(uint32_t));
+    extent->l2_cache_counts =
+        g_malloc0(extent->l2_cache_size * sizeof(uint32_t));
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -828,6 +850,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     int allocate,
                                     uint64_t *cluster_offset)
 {
+    BDRVVmdkState *s = bs->opaque;
     unsigned int l1_index, l2_offset, l2_index;
     int min_index, i, j;
     uint32_t min_count, *l2_table, tmp = 0;
@@ -849,22 +872,24 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (l2_offset == extent->l2_cache_offsets[i]) {
             /* increment the hit count */
             if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
+                for (j = 0; j < extent->l2_cache_size; j++) {
                     extent->l2_cache_counts[j] >>= 1;
                 }
             }
             l2_table = extent->l2_cache + (i * extent->l2_size);
+            s->l2_cache_hits++;
             goto found;
         }
     }
     /* not found: load a new entry in the least used one */
+    s->l2_cache_misses++;
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
@@ -971,36 +996,43 @@ static int coroutine_fn vmdk_co_is_allocated(BlockDriverState *bs,
     return ret;
 }
 
-static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
-                            int nb_sectors, int64_t sector_num)
+static int coroutine_fn vmdk_write_extent(VmdkExtent *extent,
+                                          int64_t cluster_offset,
+                                          int64_t offset_in_cluster,
+                                          QEMUIOVector *qiov,
+                                          int nb_sectors, int64_t sector_num)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
+    uint8_t *buf = NULL;
     uLongf buf_len;
-    const uint8_t *write_buf = buf;
-    int write_len = nb_sectors * 512;
+    int write_len;
 
-    if (extent->compressed) {
-        if (!extent->has_marker) {
-            ret = -EINVAL;
-            goto out;
-        }
-        buf_len = (extent->cluster_sectors << 9) * 2;
-        data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
-                buf_len == 0) {
-            ret = -EINVAL;
-            goto out;
-        }
-        data->lba = sector_num;
-        data->size = buf_len;
-        write_buf = (uint8_t *)data;
-        write_len = buf_len + sizeof(VmdkGrainMarker);
+    if (!extent->compressed) {
+        return bdrv_co_writev(extent->file,
+                              (cluster_offset + offset_in_cluster) >> 9,
+                              nb_sectors, qiov);
+    }
+
+    if (!extent->has_marker) {
+        ret = -EINVAL;
+        goto out;
+    }
+    buf = g_malloc(nb_sectors << 9);
+    qemu_iovec_to_buf(qiov, 0, buf, nb_sectors << 9);
+    buf_len = (extent->cluster_sectors << 9) * 2;
+    data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
+    if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
+            buf_len == 0) {
+        ret = -EINVAL;
+        goto out;
     }
+    data->lba = sector_num;
+    data->size = buf_len;
+    write_len = buf_len + sizeof(VmdkGrainMarker);
     ret = bdrv_pwrite(extent->file,
                         cluster_offset + offset_in_cluster,
-                        write_buf,
+                        data,
                         write_len);
     if (ret != write_len) {
         ret = ret < 0 ? ret : -EIO;
@@ -1009,12 +1041,33 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     ret = 0;
  out:
     g_free(data);
+    g_free(buf);
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+typedef struct VmdkUncompress {
+    uint8_t *dest;
+    uLongf dest_len;
+    const uint8_t *src;
+    uLong src_len;
+} VmdkUncompress;
+
+static int vmdk_uncompress_worker(void *opaque)
+{
+    VmdkUncompress *u = opaque;
+
+    if (uncompress(u->dest, &u->dest_len, u->src, u->src_len) != Z_OK) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Read from a compressed grain, inflating it in the thread pool */
+static int coroutine_fn vmdk_read_compressed(VmdkExtent *extent,
+                                             int64_t cluster_offset,
+                                             int64_t offset_in_cluster,
+                                             QEMUIOVector *qiov,
+                                             int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1022,19 +1075,9 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
-
+    VmdkUncompress u;
+    ThreadPool *pool;
 
-    if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
-    }
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
     buf_bytes = cluster_bytes * 2;
@@ -1047,7 +1090,6 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         goto out;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
@@ -1058,18 +1100,25 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
 
+    u = (VmdkUncompress) {
+        .dest       = uncomp_buf,
+        .dest_len   = cluster_bytes,
+        .src        = compressed_data,
+        .src_len    = data_len,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(extent->file));
+    ret = thread_pool_submit_co(pool, vmdk_uncompress_worker, &u);
+    if (ret < 0) {
+        goto out;
     }
     if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
+            offset_in_cluster + nb_sectors * 512 > u.dest_len) {
         ret = -EINVAL;
         goto out;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
+    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster,
+                        nb_sectors * 512);
     ret = 0;
 
  out:
@@ -1078,24 +1127,75 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+typedef struct VmdkReadRequest {
+    Coroutine *co;
+    bool waiting;
+    int pending;    /* compressed grains still being read */
+    int ret;
+} VmdkReadRequest;
+
+typedef struct VmdkGrainRead {
+    VmdkReadRequest *req;
+    VmdkExtent *extent;
+    int64_t cluster_offset;
+    int64_t offset_in_cluster;
+    int nb_sectors;
+    QEMUIOVector qiov;
+} VmdkGrainRead;
+
+static void coroutine_fn vmdk_co_read_grain(void *opaque)
 {
-    BDRVVmdkState *s = bs->opaque;
+    VmdkGrainRead *g = opaque;
+    VmdkReadRequest *req = g->req;
     int ret;
+
+    ret = vmdk_read_compressed(g->extent, g->cluster_offset,
+                               g->offset_in_cluster, &g->qiov, g->nb_sectors);
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+
+    qemu_iovec_destroy(&g->qiov);
+    g_free(g);
+
+    if (--req->pending == 0 && req->waiting) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+/*
+ * s->lock is only held for grain table lookups and updates.  Data is read
+ * without it, and each compressed grain of a request is read and inflated
+ * in its own coroutine so that the grains are decompressed in parallel.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int ret = 0;
     uint64_t n, index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    VmdkReadRequest req = {
+        .co = qemu_coroutine_self(),
+    };
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            break;
         }
+        qemu_co_mutex_lock(&s->lock);
         ret = get_cluster_offset(
                             bs, extent, NULL,
                             sector_num << 9, 0, &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
         extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
         index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
@@ -1107,51 +1207,78 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    break;
                 }
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_iovec_reset(&hd_qiov);
+                qemu_iovec_concat(&hd_qiov, qiov, bytes_done, n * 512);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &hd_qiov);
                 if (ret < 0) {
-                    return ret;
+                    break;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(qiov, bytes_done, 0, n * 512);
             }
+            ret = 0;
+        } else if (extent->compressed) {
+            VmdkGrainRead *g = g_malloc(sizeof(*g));
+
+            *g = (VmdkGrainRead) {
+                .req                = &req,
+                .extent             = extent,
+                .cluster_offset     = cluster_offset,
+                .offset_in_cluster  = index_in_cluster * 512,
+                .nb_sectors         = n,
+            };
+            qemu_iovec_init(&g->qiov, qiov->niov);
+            qemu_iovec_concat(&g->qiov, qiov, bytes_done, n * 512);
+
+            req.pending++;
+            qemu_coroutine_enter(qemu_coroutine_create(vmdk_co_read_grain), g);
         } else {
-            ret = vmdk_read_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n);
-            if (ret) {
-                return ret;
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done, n * 512);
+            ret = bdrv_co_readv(extent->file,
+                                (cluster_offset >> 9) + index_in_cluster,
+                                n, &hd_qiov);
+            if (ret < 0) {
+                break;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    qemu_iovec_destroy(&hd_qiov);
+
+    /* Wait for the compressed grains */
+    while (req.pending > 0) {
+        req.waiting = true;
+        qemu_coroutine_yield();
+        req.waiting = false;
+    }
+
+    return ret < 0 ? ret : req.ret;
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+/*
+ * Grains that are already allocated are overwritten in place without holding
+ * s->lock.  Allocating a grain, writing compressed grains and updating the
+ * CID happen under the lock.
+ */
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                       int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
-    int n, ret;
+    int n, ret = 0;
     int64_t index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
     VmdkMetaData m_data;
+    QEMUIOVector hd_qiov;
 
     if (sector_num > bs->total_sectors) {
         fprintf(stderr,
@@ -1161,83 +1288,121 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            break;
+        }
+        extent_begin_sector = extent->end_sector - extent->sectors;
+        extent_relative_sector_num = sector_num - extent_begin_sector;
+        index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
+        n = extent->cluster_sectors - index_in_cluster;
+        if (n > nb_sectors) {
+            n = nb_sectors;
         }
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, n * 512);
+
+        qemu_co_mutex_lock(&s->lock);
         ret = get_cluster_offset(
                                 bs,
                                 extent,
                                 &m_data,
-                                sector_num << 9, !extent->compressed,
+                                sector_num << 9, 0,
                                 &cluster_offset);
-        if (extent->compressed) {
-            if (ret == 0) {
-                /* Refuse write to allocated cluster for streamOptimized */
-                fprintf(stderr,
-                        "VMDK: can't write to allocated cluster"
-                        " for streamOptimized\n");
-                return -EIO;
-            } else {
-                /* allocate */
-                ret = get_cluster_offset(
-                                        bs,
-                                        extent,
-                                        &m_data,
-                                        sector_num << 9, 1,
-                                        &cluster_offset);
+        if (ret == 0 && !extent->compressed && s->cid_updated) {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = vmdk_write_extent(extent,
+                            cluster_offset, index_in_cluster * 512,
+                            &hd_qiov, n, sector_num);
+            if (ret) {
+                break;
             }
+            goto next;
         }
-        if (ret) {
-            return -EINVAL;
+
+        if (extent->compressed && ret == 0) {
+            /* Refuse write to allocated cluster for streamOptimized */
+            fprintf(stderr,
+                    "VMDK: can't write to allocated cluster"
+                    " for streamOptimized\n");
+            ret = -EIO;
+            goto fail_locked;
         }
-        extent_begin_sector = extent->end_sector - extent->sectors;
-        extent_relative_sector_num = sector_num - extent_begin_sector;
-        index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
-        n = extent->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors) {
-            n = nb_sectors;
+
+        /* allocate */
+        ret = get_cluster_offset(
+                                bs,
+                                extent,
+                                &m_data,
+                                sector_num << 9, 1,
+                                &cluster_offset);
+        if (ret) {
+            ret = -EINVAL;
+            goto fail_locked;
         }
 
         ret = vmdk_write_extent(extent,
                         cluster_offset, index_in_cluster * 512,
-                        buf, n, sector_num);
+                        &hd_qiov, n, sector_num);
         if (ret) {
-            return ret;
+            goto fail_locked;
         }
         if (m_data.valid) {
             /* update L2 tables */
             if (vmdk_L2update(extent, &m_data) == -1) {
-                return -EIO;
+                ret = -EIO;
+                goto fail_locked;
             }
         }
-        nb_sectors -= n;
-        sector_num += n;
-        buf += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, time(NULL));
             if (ret < 0) {
-                return ret;
+                goto fail_locked;
             }
             s->cid_updated = true;
         }
+        qemu_co_mutex_unlock(&s->lock);
+
+next:
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * 512;
     }
-    return 0;
+
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
+
+fail_locked:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
+static void vmdk_get_cache_stats(const BlockDriverState *bs,
+                                 BlockMetadataCacheStats *stats)
 {
-    int ret;
     BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    VmdkExtent *e;
+    int i, j;
+
+    stats->hits = s->l2_cache_hits;
+    stats->misses = s->l2_cache_misses;
+    for (i = 0; i < s->num_extents; i++) {
+        e = &s->extents[i];
+        for (j = 0; j < e->l2_cache_size; j++) {
+            if (e->l2_cache_offsets[j]) {
+                stats->entries++;
+            }
+        }
+        stats->max_entries += e->l2_cache_size;
+    }
 }
 
 
@@ -1703,13 +1868,14 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_probe     = vmdk_probe,
     .bdrv_open      = vmdk_open,
     .bdrv_reopen_prepare = vmdk_reopen_prepare,
-    .bdrv_read      = vmdk_co_read,
-    .bdrv_write     = vmdk_co_write,
+    .bdrv_co_readv  = vmdk_co_readv,
+    .bdrv_co_writev = vmdk_co_writev,
     .bdrv_close     = vmdk_close,
     .bdrv_create    = vmdk_create,
     .bdrv_co_flush_to_disk  = vmdk_co_flush,
     .bdrv_co_is_allocated   = vmdk_co_is_allocated,
     .bdrv_get_allocated_file_size  = vmdk_get_allocated_file_size,
+    .bdrv_get_cache_stats   = vmdk_get_cache_stats,
 
     .create_options = vmdk_create_options,
 };
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
+#include "qemu/bitmap.h"
 #include "migration/migration.h"
 #if defined(CONFIG_UUID)
 #include <uuid/uuid.h>
@@ -120,7 +121,9 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+
+    /* Blocks whose bitmap is known to have all bits set */
+    unsigned long *bitmap_valid;
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -259,7 +262,7 @@ static int vpc_open(BlockDriverState *bs, int flags)
             }
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        s->bitmap_valid = bitmap_new(s->max_table_entries);
 
 #ifdef CACHE
         s->pageentry_u8 = g_malloc(512);
@@ -281,6 +284,7 @@ static int vpc_open(BlockDriverState *bs, int flags)
 
 fail:
     g_free(s->pagetable);
+    g_free(s->bitmap_valid);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -296,12 +300,9 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
 /*
  * Returns the absolute byte offset of the given sector in the image file.
  * If the sector is not allocated, -1 is returned instead.
- *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -317,19 +318,6 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
-
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
-    }
-
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
 //	sector_num, pagetable_index, pageentry_index,
 //	bitmap_offset, block_offset);
@@ -366,175 +354,249 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
 }
 
 /*
- * Writes the footer to the end of the image file. This is needed when the
- * file grows as it overwrites the old footer
+ * We must ensure that we don't write to any sectors which are marked as
+ * unused in the bitmap. We get away with setting all bits in the block
+ * bitmap the first time we write to a block. This might cause Virtual PC to
+ * miss sparse read optimization, but it's not a problem in terms of
+ * correctness.
  *
  * Returns 0 on success and < 0 on error
  */
-static int rewrite_footer(BlockDriverState* bs)
+static coroutine_fn int vpc_co_fill_bitmap(BlockDriverState *bs,
+                                           uint32_t index)
 {
-    int ret;
     BDRVVPCState *s = bs->opaque;
-    int64_t offset = s->free_data_block_offset;
+    uint8_t *bitmap;
+    int ret = 0;
 
-    ret = bdrv_pwrite_sync(bs->file, offset, s->footer_buf, HEADER_SIZE);
-    if (ret < 0)
-        return ret;
+    if (test_bit(index, s->bitmap_valid)) {
+        return 0;
+    }
 
-    return 0;
+    qemu_co_mutex_lock(&s->lock);
+    if (!test_bit(index, s->bitmap_valid)) {
+        bitmap = qemu_blockalign(bs, s->bitmap_size);
+        memset(bitmap, 0xff, s->bitmap_size);
+        ret = bdrv_pwrite_sync(bs->file, 512 * (uint64_t) s->pagetable[index],
+                               bitmap, s->bitmap_size);
+        qemu_vfree(bitmap);
+        if (ret >= 0) {
+            set_bit(index, s->bitmap_valid);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
 }
 
 /*
- * Allocates a new block. This involves writing a new footer and updating
- * the Block Allocation Table to use the space at the old end of the image
- * file (overwriting the old footer)
+ * Allocates all blocks in the range [first, first + count) of the Block
+ * Allocation Table that are still unallocated. This involves writing the
+ * bitmaps of the new blocks at the old end of the image file (overwriting
+ * the old footer), a new footer behind them and the BAT entries.
  *
- * Returns the sectors' offset in the image file on success and < 0 on error
+ * The footer and the BAT are written only once for the whole range, and the
+ * new blocks are only made visible to other requests when their metadata is
+ * on disk.
+ *
+ * Returns 0 on success and < 0 on error
  */
-static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
+static coroutine_fn int vpc_co_alloc_blocks(BlockDriverState *bs,
+                                            uint32_t first, uint32_t count)
 {
     BDRVVPCState *s = bs->opaque;
-    int64_t bat_offset;
-    uint32_t index, bat_value;
-    int ret;
-    uint8_t bitmap[s->bitmap_size];
+    uint64_t offset;
+    uint32_t *entries;
+    uint8_t *bitmap;
+    uint32_t i;
+    int allocated = 0;
+    int ret = 0;
+
+    if (first + count > s->max_table_entries) {
+        return -EINVAL;
+    }
 
-    // Check if sector_num is valid
-    if ((sector_num < 0) || (sector_num > bs->total_sectors))
-        return -1;
+    entries = g_malloc(count * sizeof(*entries));
+    bitmap = qemu_blockalign(bs, s->bitmap_size);
+    memset(bitmap, 0xff, s->bitmap_size);
 
-    // Write entry into in-memory BAT
-    index = (sector_num * 512) / s->block_size;
-    if (s->pagetable[index] != 0xFFFFFFFF)
-        return -1;
+    qemu_co_mutex_lock(&s->lock);
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
+    // Another request may have allocated some of the blocks meanwhile
+    offset = s->free_data_block_offset;
+    for (i = 0; i < count; i++) {
+        if (s->pagetable[first + i] != 0xFFFFFFFF) {
+            entries[i] = cpu_to_be32(s->pagetable[first + i]);
+            continue;
+        }
 
-    // Initialize the block's bitmap
-    memset(bitmap, 0xff, s->bitmap_size);
-    ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
-        s->bitmap_size);
-    if (ret < 0) {
-        return ret;
+        entries[i] = cpu_to_be32(offset / 512);
+        ret = bdrv_pwrite(bs->file, offset, bitmap, s->bitmap_size);
+        if (ret < 0) {
+            goto out;
+        }
+        offset += s->block_size + s->bitmap_size;
+        allocated++;
     }
 
-    // Write new footer (the old one will be overwritten)
-    s->free_data_block_offset += s->block_size + s->bitmap_size;
-    ret = rewrite_footer(bs);
-    if (ret < 0)
-        goto fail;
+    if (allocated == 0) {
+        goto out;
+    }
 
-    // Write BAT entry to disk
-    bat_offset = s->bat_offset + (4 * index);
-    bat_value = be32_to_cpu(s->pagetable[index]);
-    ret = bdrv_pwrite_sync(bs->file, bat_offset, &bat_value, 4);
-    if (ret < 0)
-        goto fail;
+    // Write new footer (the old one has been overwritten)
+    ret = bdrv_pwrite(bs->file, offset, s->footer_buf, HEADER_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto out;
+    }
 
-    return get_sector_offset(bs, sector_num, 0);
+    // Write BAT entries to disk
+    ret = bdrv_pwrite_sync(bs->file, s->bat_offset + (4 * first), entries,
+                           count * sizeof(*entries));
+    if (ret < 0) {
+        goto out;
+    }
 
-fail:
-    s->free_data_block_offset -= (s->block_size + s->bitmap_size);
-    return -1;
+    // Only now the new blocks may be used
+    for (i = 0; i < count; i++) {
+        if (s->pagetable[first + i] == 0xFFFFFFFF) {
+            s->pagetable[first + i] = be32_to_cpu(entries[i]);
+            set_bit(first + i, s->bitmap_valid);
+        }
+    }
+    s->free_data_block_offset = offset;
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(bitmap);
+    g_free(entries);
+    return ret < 0 ? ret : 0;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Requests are not serialised against each other: data is read and written
+ * without holding s->lock, which only protects allocating new blocks and
+ * filling in bitmaps.
+ */
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
-    int ret;
+    int ret = 0;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
     struct vhd_footer *footer = (struct vhd_footer *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+        offset = get_sector_offset(bs, sector_num);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
         if (sectors > nb_sectors) {
             sectors = nb_sectors;
         }
 
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(qiov, bytes_done, 0,
+                              sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                              sectors * BDRV_SECTOR_SIZE);
+
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                sectors, &hd_qiov);
+            if (ret < 0) {
+                break;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
-    int ret;
+    uint32_t index, first, last;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    int ret = 0;
     struct vhd_footer *footer =  (struct vhd_footer *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    }
+
+    // Allocate all missing blocks of the request at once
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    first = sector_num / sectors_per_block;
+    last = (sector_num + nb_sectors - 1) / sectors_per_block;
+    for (index = first; index <= last; index++) {
+        if (index >= s->max_table_entries) {
+            return -EINVAL;
+        }
+        if (s->pagetable[index] == 0xFFFFFFFF) {
+            ret = vpc_co_alloc_blocks(bs, index, last - index + 1);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
     }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+        offset = get_sector_offset(bs, sector_num);
+        index = sector_num / sectors_per_block;
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
         if (sectors > nb_sectors) {
             sectors = nb_sectors;
         }
 
-        if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+        assert(offset != -1);
+        ret = vpc_co_fill_bitmap(bs, index);
+        if (ret < 0) {
+            break;
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             sectors, &hd_qiov);
+        if (ret < 0) {
+            break;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
 
-    return 0;
-}
-
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
@@ -790,6 +852,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     g_free(s->pagetable);
+    g_free(s->bitmap_valid);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -824,10 +887,11 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare = vpc_reopen_prepare,
     .bdrv_create    = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
 
     .create_options = vpc_create_options,
+    .supports_aio_context = true,
 };
 
 static void bdrv_vpc_init(void)
@@ -277,6 +277,21 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
     return true;
 }
 
+/* A burst size is only meaningful together with the rate it applies to */
+static bool do_check_io_burst(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
 {
     const char *buf;
@@ -299,6 +314,9 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     BlockIOLimit io_limits;
     int snapshot = 0;
     bool copy_on_read;
+    bool batch_alloc;
+    uint64_t metadata_cache_size;
+    uint64_t shared_cache_size;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -316,6 +334,9 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
+    batch_alloc = qemu_opt_get_bool(opts, "batch-alloc", false);
+    metadata_cache_size = qemu_opt_get_size(opts, "metadata-cache-size", 0);
+    shared_cache_size = qemu_opt_get_size(opts, "shared-cache-size", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -432,6 +453,18 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
 
     if (!do_check_io_limits(&io_limits)) {
         error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
@@ -439,6 +472,12 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         return NULL;
     }
 
+    if (!do_check_io_burst(&io_limits)) {
+        error_report("bps_max(iops_max) and the other burst options "
+                     "require the corresponding rate limit");
+        return NULL;
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -560,6 +599,9 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    bdrv_set_metadata_cache_size(dinfo->bdrv, metadata_cache_size);
+    bdrv_set_shared_cache_size(dinfo->bdrv, shared_cache_size);
+
     switch(type) {
     case IF_ATAPI_PT: /* XenClient: ATAPI Pass Through */
     case IF_IDE:
@@ -603,6 +645,10 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         bdrv_flags |= BDRV_O_COPY_ON_READ;
     }
 
+    if (batch_alloc) {
+        bdrv_flags |= BDRV_O_BATCH_ALLOC;
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         bdrv_flags |= BDRV_O_INCOMING;
     }
@@ -966,7 +1012,15 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -977,6 +1031,14 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    /* The throttling timers only run in the main loop, and users such as
+     * x-data-plane may move the device out of it at any time
+     */
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
     io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
     io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
     io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
@@ -984,22 +1046,42 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
 
-    if (!do_check_io_limits(&io_limits)) {
+    /* a zero burst size selects the default */
+    memset(io_limits.bps_max, 0, sizeof(io_limits.bps_max));
+    memset(io_limits.iops_max, 0, sizeof(io_limits.iops_max));
+    if (has_bps_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL] = bps_max;
+    }
+    if (has_bps_rd_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_READ] = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_WRITE] = bps_wr_max;
+    }
+    if (has_iops_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = iops_max;
+    }
+    if (has_iops_rd_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_READ] = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] = iops_wr_max;
+    }
+
+    if (!do_check_io_limits(&io_limits) || !do_check_io_burst(&io_limits)) {
         error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
-
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    if (has_group) {
+        if (!*group) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "group",
+                      "a non-empty group name");
+            return;
         }
+        bdrv_set_io_limits_group(bs, group, &io_limits);
+    } else {
+        bdrv_update_io_limits(bs, &io_limits);
     }
 }
 
@@ -1100,6 +1182,7 @@ static void block_job_cb(void *opaque, int ret)
 void qmp_block_stream(const char *device, bool has_base,
                       const char *base, bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_workers, int64_t workers,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1109,6 +1192,9 @@ void qmp_block_stream(const char *device, bool has_base,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_workers) {
+        workers = 1;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1124,7 +1210,7 @@ void qmp_block_stream(const char *device, bool has_base,
         }
     }
 
-    stream_start(bs, base_bs, base, has_speed ? speed : 0,
+    stream_start(bs, base_bs, base, has_speed ? speed : 0, workers,
                  on_error, block_job_cb, bs, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
@@ -1142,6 +1228,7 @@ void qmp_block_stream(const char *device, bool has_base,
 void qmp_block_commit(const char *device,
                       bool has_base, const char *base, const char *top,
                       bool has_speed, int64_t speed,
+                      bool has_workers, int64_t workers,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1152,6 +1239,10 @@ void qmp_block_commit(const char *device,
      */
     BlockdevOnError on_error = BLOCKDEV_ON_ERROR_REPORT;
 
+    if (!has_workers) {
+        workers = 1;
+    }
+
     /* drain all i/o before commits */
     bdrv_drain_all();
 
@@ -1186,8 +1277,8 @@ void qmp_block_commit(const char *device,
         return;
     }
 
-    commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
-                &local_err);
+    commit_start(bs, base_bs, top_bs, speed, workers, on_error, block_job_cb,
+                 bs, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         return;
@@ -1554,10 +1645,46 @@ QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations burst above the iops limit",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations burst above the iops_rd limit",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations burst above the iops_wr limit",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "bytes burst above the bps limit",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes burst above the bps_rd limit",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes burst above the bps_wr limit",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "batch-alloc",
+            .type = QEMU_OPT_BOOL,
+            .help = "allocate clusters in large runs when the image grows",
+        },{
+            .name = "metadata-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image format's metadata cache in bytes",
+        },{
+            .name = "shared-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the backing file cache shared between processes",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
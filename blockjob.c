@@ -31,6 +31,7 @@
 #include "block/blockjob.h"
 #include "block/block_int.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qint.h"
 #include "block/coroutine.h"
 #include "qmp-commands.h"
 #include "qemu/timer.h"
@@ -249,6 +250,16 @@ void block_job_ready(BlockJob *job)
     qobject_decref(data);
 }
 
+void block_job_progress(BlockJob *job, int64_t throughput)
+{
+    QObject *data = qobject_from_block_job(job);
+    QDict *dict = qobject_to_qdict(data);
+
+    qdict_put(dict, "throughput", qint_from_int(throughput));
+    monitor_protocol_event(QEVENT_BLOCK_JOB_PROGRESS, data);
+    qobject_decref(data);
+}
+
 BlockErrorAction block_job_error_action(BlockJob *job, BlockDriverState *bs,
                                         BlockdevOnError on_err,
                                         int is_read, int error)
@@ -281,3 +292,175 @@ BlockErrorAction block_job_error_action(BlockJob *job, BlockDriverState *bs,
     }
     return action;
 }
+
+void block_job_alloc_map_init(BlockJobAllocMap *map, BlockDriverState *top,
+                              BlockDriverState *base)
+{
+    map->top = top;
+    map->base = base;
+    map->nb_extents = 0;
+}
+
+int coroutine_fn block_job_is_allocated(BlockJobAllocMap *map,
+                                        int64_t sector_num, int64_t end,
+                                        int *pnum)
+{
+    BlockExtent *e;
+    int i, ret;
+
+    for (i = 0; i < map->nb_extents; i++) {
+        e = &map->extents[i];
+        if (sector_num >= e->sector_num &&
+            sector_num < e->sector_num + e->nb_sectors) {
+            goto found;
+        }
+    }
+
+    ret = bdrv_co_get_extents_above(map->top, map->base, sector_num,
+                                    end - sector_num, map->extents,
+                                    BLOCK_JOB_EXTENTS);
+    if (ret <= 0) {
+        map->nb_extents = 0;
+        return ret < 0 ? ret : -EIO;
+    }
+    map->nb_extents = ret;
+    e = &map->extents[0];
+
+found:
+    *pnum = MIN(e->sector_num + e->nb_sectors, end) - sector_num;
+    return e->allocated;
+}
+
+static void coroutine_fn block_job_co_copy(void *opaque)
+{
+    BlockJobCopyRequest *req = opaque;
+    BlockJobCopyPool *pool = req->pool;
+    uint64_t bytes = (uint64_t)req->nb_sectors * BDRV_SECTOR_SIZE;
+
+    switch (pool->copy(pool->job, req)) {
+    case BLOCK_JOB_COPY_DONE:
+        pool->bytes_unaccounted += bytes;
+        /* fall through */
+    case BLOCK_JOB_COPY_SKIPPED:
+        /* Publish progress */
+        if (!pool->failed) {
+            pool->job->offset += bytes;
+        }
+        QSIMPLEQ_INSERT_TAIL(&pool->free_reqs, req, next);
+        break;
+    case BLOCK_JOB_COPY_RETRY:
+        QSIMPLEQ_INSERT_TAIL(&pool->retry_reqs, req, next);
+        break;
+    case BLOCK_JOB_COPY_FAILED:
+        pool->failed = true;
+        QSIMPLEQ_INSERT_TAIL(&pool->free_reqs, req, next);
+        break;
+    }
+
+    pool->in_flight--;
+    if (pool->waiting) {
+        qemu_coroutine_enter(pool->job->co, NULL);
+    }
+}
+
+static void block_job_copy_submit(BlockJobCopyPool *pool,
+                                  BlockJobCopyRequest *req)
+{
+    Coroutine *co;
+
+    pool->in_flight++;
+    co = qemu_coroutine_create(block_job_co_copy);
+    qemu_coroutine_enter(co, req);
+}
+
+static void coroutine_fn block_job_copy_wait(BlockJobCopyPool *pool)
+{
+    pool->waiting = true;
+    qemu_coroutine_yield();
+    pool->waiting = false;
+}
+
+void block_job_copy_pool_init(BlockJobCopyPool *pool, BlockJob *job,
+                              int workers, size_t buf_size,
+                              BlockJobCopyFunc *copy)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->job = job;
+    pool->copy = copy;
+    pool->workers = workers;
+    pool->reqs = g_new0(BlockJobCopyRequest, workers);
+    QSIMPLEQ_INIT(&pool->free_reqs);
+    QSIMPLEQ_INIT(&pool->retry_reqs);
+    for (i = 0; i < workers; i++) {
+        pool->reqs[i].pool = pool;
+        pool->reqs[i].buf = qemu_blockalign(job->bs, buf_size);
+        QSIMPLEQ_INSERT_TAIL(&pool->free_reqs, &pool->reqs[i], next);
+    }
+}
+
+void block_job_copy_pool_cleanup(BlockJobCopyPool *pool)
+{
+    int i;
+
+    assert(pool->in_flight == 0);
+    for (i = 0; i < pool->workers; i++) {
+        qemu_vfree(pool->reqs[i].buf);
+    }
+    g_free(pool->reqs);
+    pool->reqs = NULL;
+}
+
+bool coroutine_fn block_job_copy_pool_start(BlockJobCopyPool *pool,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BlockJobCopyRequest *req;
+
+    while (QSIMPLEQ_EMPTY(&pool->free_reqs) && pool->in_flight > 0) {
+        block_job_copy_wait(pool);
+    }
+
+    req = QSIMPLEQ_FIRST(&pool->free_reqs);
+    if (!req || pool->failed) {
+        return false;
+    }
+    QSIMPLEQ_REMOVE_HEAD(&pool->free_reqs, next);
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    block_job_copy_submit(pool, req);
+    return true;
+}
+
+void coroutine_fn block_job_copy_pool_drain(BlockJobCopyPool *pool)
+{
+    while (pool->in_flight > 0) {
+        block_job_copy_wait(pool);
+    }
+}
+
+void block_job_copy_pool_resubmit(BlockJobCopyPool *pool)
+{
+    BlockJobCopyRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&pool->retry_reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->retry_reqs, next);
+        block_job_copy_submit(pool, req);
+    }
+}
+
+bool coroutine_fn block_job_copy_pool_finish(BlockJobCopyPool *pool)
+{
+    block_job_copy_pool_drain(pool);
+    while (!QSIMPLEQ_EMPTY(&pool->retry_reqs) && !pool->failed &&
+           !block_job_is_cancelled(pool->job)) {
+        block_job_sleep_ns(pool->job, rt_clock, 0);
+        if (block_job_is_cancelled(pool->job)) {
+            break;
+        }
+        block_job_copy_pool_resubmit(pool);
+        block_job_copy_pool_drain(pool);
+    }
+    return QSIMPLEQ_EMPTY(&pool->retry_reqs);
+}
@@ -39,9 +39,10 @@ enum {
     POOL_MAX_SIZE = 64,
 };
 
-/** Free list to speed up creation */
+/** Free list to speed up creation, shared by all threads */
 static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
     Coroutine base;
@@ -189,11 +190,15 @@ Coroutine *qemu_coroutine_new(void)
 {
     Coroutine *co;
 
+    pthread_mutex_lock(&pool_lock);
     co = QSLIST_FIRST(&pool);
     if (co) {
         QSLIST_REMOVE_HEAD(&pool, pool_next);
         pool_size--;
-    } else {
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!co) {
         co = coroutine_new();
     }
     return co;
@@ -217,12 +222,15 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
+    pthread_mutex_lock(&pool_lock);
     if (pool_size < POOL_MAX_SIZE) {
         QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
         co->base.caller = NULL;
         pool_size++;
+        pthread_mutex_unlock(&pool_lock);
         return;
     }
+    pthread_mutex_unlock(&pool_lock);
 
 #ifdef CONFIG_VALGRIND_H
     valgrind_stack_deregister(co);
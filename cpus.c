@@ -661,6 +661,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     cpu->queued_work_last = &wi;
     wi.next = NULL;
     wi.done = false;
+    wi.free = false;
 
     qemu_cpu_kick(cpu);
     while (!wi.done) {
@@ -671,6 +672,31 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -683,11 +709,99 @@ static void flush_queued_work(CPUState *cpu)
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/* vCPU throttling: every time slice, each vCPU thread is made to sleep
+ * outside the global mutex for pct / (1 - pct) of the slice, so that it
+ * only runs for (1 - pct) of the wall clock time.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    CPUArchState *self_env = cpu_single_env;
+    double pct;
+    int64_t sleeptime_ns;
+
+    cpu->throttle_thread_scheduled = false;
+    if (!throttle_percentage) {
+        return;
+    }
+
+    pct = (double)throttle_percentage / 100;
+    sleeptime_ns = (int64_t)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu_single_env = self_env;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        /* All TCG vCPUs share one thread, sleep on it only once */
+        if (tcg_enabled() && env != first_cpu) {
+            break;
+        }
+        if (!cpu->throttle_thread_scheduled) {
+            cpu->throttle_thread_scheduled = true;
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+    }
+
+    pct = (double)throttle_percentage / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   (int64_t)(CPU_THROTTLE_TIMESLICE_NS / (1 - pct)));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -11,6 +11,7 @@
  *
  */
 
+#include <zlib.h>
 #include "qemu-common.h"
 #include "elf.h"
 #include "cpu.h"
@@ -24,6 +25,15 @@
 #include "qapi/error.h"
 #include "qmp-commands.h"
 #include "exec/gdbstub.h"
+#include "exec/address-spaces.h"
+#include "migration/migration.h"
+#include "qemu/thread.h"
+
+/* Pages handed to a compression thread at once, and the largest write of
+ * guest memory */
+#define DUMP_BATCH_PAGES 256
+#define DUMP_IO_SIZE (DUMP_BATCH_PAGES * TARGET_PAGE_SIZE)
+#define DUMP_MAX_THREADS 8
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,6 +68,42 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+/* Multithreaded page compression for the kdump-compressed format
+ *
+ * Batches of pages are handed to a ring of slots, each of which is served
+ * by its own thread.  Batches are written in the order in which they were
+ * queued, so only the oldest slot is ever waited for.
+ */
+typedef struct DumpCompressSlot {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* Protected by lock */
+    bool pending;       /* batch queued, waiting to be compressed */
+    bool done;          /* page data ready to be written */
+    bool quit;
+
+    /* Owned by the compression thread while pending is set */
+    z_stream stream;
+    uint8_t *host;      /* first page of the batch */
+    int nr_pages;
+    uint8_t *buf;       /* data of the non-zero pages, back to back */
+    uint32_t size[DUMP_BATCH_PAGES];    /* 0 for a zero page */
+    bool compressed[DUMP_BATCH_PAGES];
+
+    uint64_t desc_index;                /* descriptor of the first page */
+} DumpCompressSlot;
+
+/* A run of guest RAM, at a page aligned guest physical address */
+typedef struct DumpRange {
+    hwaddr phys_addr;
+    uint64_t length;
+    MemoryRegion *mr;
+    ram_addr_t offset;      /* of phys_addr within mr */
+    uint8_t *host;          /* of phys_addr */
+    uint64_t desc_base;     /* index of the first page descriptor */
+} DumpRange;
+
 typedef struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -74,14 +120,173 @@ typedef struct DumpState {
     bool has_filter;
     int64_t begin;
     int64_t length;
+    int64_t total_size;
     Error **errp;
+
+    DumpGuestMemoryFormat format;
+    bool live;
+    bool sparse;            /* zero pages may be left as holes in the file */
+    int nr_cpus;
+    uint32_t ram_version;   /* ram_list.version the layout was computed for */
+
+    /* kdump-compressed format */
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    MemoryListener listener;
+    DumpRange *ranges;      /* by ascending guest physical address */
+    int nb_ranges;
+    uint64_t max_mapnr;
+    size_t len_dump_bitmap;
+    uint32_t sub_hdr_size;  /* in blocks */
+    off_t offset_note;
+    off_t offset_bitmap;
+    off_t offset_page;      /* page descriptors */
+    off_t offset_zero;      /* the page shared by all zero pages */
+    off_t offset_data;      /* next free byte of the page data area */
+
+    DumpCompressSlot *slots;
+    int nb_slots;
+    int head;               /* oldest filled slot */
+    int filled;
+
+    /* live dump */
+    QemuThread thread;
+    Error *blocker;
 } DumpState;
 
+/* Progress of the last dump, for query-dump */
+static DumpStatus dump_status;
+static int64_t dump_completed;
+static int64_t dump_total;
+
+static void dump_compress_batch(DumpCompressSlot *slot)
+{
+    z_stream *zs = &slot->stream;
+    uint8_t *out = slot->buf;
+    int i;
+
+    for (i = 0; i < slot->nr_pages; i++) {
+        uint8_t *page = slot->host + i * TARGET_PAGE_SIZE;
+
+        if (buffer_is_zero(page, TARGET_PAGE_SIZE)) {
+            slot->size[i] = 0;
+            continue;
+        }
+
+        deflateReset(zs);
+        zs->next_in = page;
+        zs->avail_in = TARGET_PAGE_SIZE;
+        zs->next_out = out;
+        zs->avail_out = TARGET_PAGE_SIZE;
+
+        /* The output buffer is one page, so anything that does not shrink
+         * ends with Z_OK or Z_BUF_ERROR and is stored uncompressed.
+         */
+        if (deflate(zs, Z_FINISH) == Z_STREAM_END &&
+            zs->total_out < TARGET_PAGE_SIZE) {
+            slot->size[i] = zs->total_out;
+            slot->compressed[i] = true;
+        } else {
+            memcpy(out, page, TARGET_PAGE_SIZE);
+            slot->size[i] = TARGET_PAGE_SIZE;
+            slot->compressed[i] = false;
+        }
+        out += slot->size[i];
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressSlot *slot = opaque;
+
+    qemu_mutex_lock(&slot->lock);
+    while (!slot->quit) {
+        if (!slot->pending) {
+            qemu_cond_wait(&slot->cond, &slot->lock);
+            continue;
+        }
+        qemu_mutex_unlock(&slot->lock);
+
+        dump_compress_batch(slot);
+
+        qemu_mutex_lock(&slot->lock);
+        slot->pending = false;
+        slot->done = true;
+        qemu_cond_signal(&slot->cond);
+    }
+    qemu_mutex_unlock(&slot->lock);
+    return NULL;
+}
+
+static int dump_nb_compress_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 0) {
+        return MIN(n, DUMP_MAX_THREADS);
+    }
+#endif
+    return 1;
+}
+
+static int dump_compress_threads_setup(DumpState *s)
+{
+    int i;
+
+    s->nb_slots = dump_nb_compress_threads();
+    s->slots = g_new0(DumpCompressSlot, s->nb_slots);
+    s->head = 0;
+    s->filled = 0;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        DumpCompressSlot *slot = &s->slots[i];
+
+        if (deflateInit(&slot->stream, Z_BEST_SPEED) != Z_OK) {
+            s->nb_slots = i;
+            return -1;
+        }
+        slot->buf = g_malloc(DUMP_IO_SIZE);
+        qemu_mutex_init(&slot->lock);
+        qemu_cond_init(&slot->cond);
+        qemu_thread_create(&slot->thread, dump_compress_thread, slot,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+static void dump_compress_threads_cleanup(DumpState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        DumpCompressSlot *slot = &s->slots[i];
+
+        qemu_mutex_lock(&slot->lock);
+        slot->quit = true;
+        qemu_cond_signal(&slot->cond);
+        qemu_mutex_unlock(&slot->lock);
+        qemu_thread_join(&slot->thread);
+
+        qemu_cond_destroy(&slot->cond);
+        qemu_mutex_destroy(&slot->lock);
+        deflateEnd(&slot->stream);
+        g_free(slot->buf);
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    s->nb_slots = 0;
+    s->filled = 0;
+}
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
+    dump_compress_threads_cleanup(s);
     memory_mapping_list_free(&s->list);
+    g_free(s->note_buf);
+    g_free(s->ranges);
     if (s->fd != -1) {
         close(s->fd);
     }
@@ -92,9 +297,12 @@ static int dump_cleanup(DumpState *s)
     return ret;
 }
 
+/* Only the first error is reported, the dump is cleaned up by its caller */
 static void dump_error(DumpState *s, const char *reason)
 {
-    dump_cleanup(s);
+    if (!error_is_set(s->errp)) {
+        error_setg(s->errp, "%s", reason);
+    }
 }
 
 static int fd_write_vmcore(void *buf, size_t size, void *opaque)
@@ -141,7 +349,7 @@ static int write_elf64_header(DumpState *s)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header.\n");
+        dump_error(s, "dump: failed to write elf header");
         return -1;
     }
 
@@ -179,7 +387,7 @@ static int write_elf32_header(DumpState *s)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header.\n");
+        dump_error(s, "dump: failed to write elf header");
         return -1;
     }
 
@@ -208,7 +416,7 @@ static int write_elf64_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
@@ -237,7 +445,7 @@ static int write_elf32_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
@@ -261,14 +469,14 @@ static int write_elf64_note(DumpState *s)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -276,17 +484,17 @@ static int write_elf64_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes.\n");
+            dump_error(s, "dump: failed to write elf notes");
             return -1;
         }
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status.\n");
+            dump_error(s, "dump: failed to write CPU status");
             return -1;
         }
     }
@@ -311,14 +519,14 @@ static int write_elf32_note(DumpState *s)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table.\n");
+        dump_error(s, "dump: failed to write program header table");
         return -1;
     }
 
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -326,17 +534,17 @@ static int write_elf32_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf32_note(f, env, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes.\n");
+            dump_error(s, "dump: failed to write elf notes");
             return -1;
         }
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf32_qemunote(f, env, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status.\n");
+            dump_error(s, "dump: failed to write CPU status");
             return -1;
         }
     }
@@ -367,7 +575,7 @@ static int write_elf_section(DumpState *s, int type)
 
     ret = fd_write_vmcore(&shdr, shdr_size, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write section header table.\n");
+        dump_error(s, "dump: failed to write section header table");
         return -1;
     }
 
@@ -380,34 +588,100 @@ static int write_data(DumpState *s, void *buf, int length)
 
     ret = fd_write_vmcore(buf, length, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to save memory.\n");
+        dump_error(s, "dump: failed to save memory");
         return -1;
     }
 
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
-static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
-                        int64_t size)
+/*
+ * Length of the run of zero pages, or of non-zero pages, at @p, at most @len
+ * bytes.  Zero pages are only looked for if they can be left as holes.
+ */
+static int64_t get_memory_run(DumpState *s, uint8_t *p, int64_t len,
+                              bool *zero)
 {
-    int64_t i;
-    int ret;
+    int64_t n;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
+    *zero = s->sparse && len >= TARGET_PAGE_SIZE &&
+            buffer_is_zero(p, TARGET_PAGE_SIZE);
+    if (!s->sparse) {
+        return len;
+    }
+
+    for (n = TARGET_PAGE_SIZE; n + TARGET_PAGE_SIZE <= len;
+         n += TARGET_PAGE_SIZE) {
+        if (buffer_is_zero(p + n, TARGET_PAGE_SIZE) != *zero) {
+            return n;
         }
     }
 
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
+    /* a partial page at the end is always written */
+    return *zero ? n : len;
+}
+
+/*
+ * The first pass of a live dump reads guest RAM without the iothread lock.
+ * The ramlist lock keeps the RAM it reads from going away, but is only held
+ * for one block or range at a time: adding or removing RAM takes it with
+ * the iothread lock held, and would stall the guest for the whole pass.  If
+ * RAM changed in between, the layout of the dump is stale, so it fails.
+ */
+static int dump_lock_ramlist(DumpState *s)
+{
+    if (!s->live) {
+        return 0;
+    }
+
+    qemu_mutex_lock_ramlist();
+    if (ram_list.version != s->ram_version) {
+        qemu_mutex_unlock_ramlist();
+        dump_error(s, "dump: guest RAM changed during the dump");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dump_unlock_ramlist(DumpState *s)
+{
+    if (s->live) {
+        qemu_mutex_unlock_ramlist();
+    }
+}
+
+/* write the memory to vmcore, up to DUMP_IO_SIZE bytes per I/O. */
+static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
+                        int64_t size)
+{
+    uint8_t *p = block->host + start;
+    int64_t i, len;
+    bool zero;
+
+    for (i = 0; i < size; i += len) {
+        len = get_memory_run(s, p + i, MIN(size - i, DUMP_IO_SIZE), &zero);
+        if (zero) {
+            if (lseek(s->fd, len, SEEK_CUR) < 0) {
+                dump_error(s, "dump: failed to save memory");
+                return -1;
+            }
+        } else if (write_data(s, p + i, len) < 0) {
+            return -1;
         }
+        dump_completed += len;
+    }
+
+    return 0;
+}
+
+/* Give the file its full size if it ends with a hole */
+static int dump_truncate(DumpState *s)
+{
+    if (s->sparse &&
+        ftruncate(s->fd, s->memory_offset + s->total_size) < 0) {
+        dump_error(s, "dump: failed to save memory");
+        return -1;
     }
 
     return 0;
@@ -553,7 +827,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -576,7 +850,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -584,13 +858,6 @@ static int dump_begin(DumpState *s)
     return 0;
 }
 
-/* write PT_LOAD to vmcore */
-static int dump_completed(DumpState *s)
-{
-    dump_cleanup(s);
-    return 0;
-}
-
 static int get_next_block(DumpState *s, RAMBlock *block)
 {
     while (1) {
@@ -626,6 +893,9 @@ static int dump_iterate(DumpState *s)
     int ret;
 
     while (1) {
+        if (dump_lock_ramlist(s) < 0) {
+            return -1;
+        }
         block = s->block;
 
         size = block->length;
@@ -636,22 +906,560 @@ static int dump_iterate(DumpState *s)
             }
         }
         ret = write_memory(s, block, s->start, size);
+        if (ret == 0) {
+            ret = get_next_block(s, block);
+        }
+        dump_unlock_ramlist(s);
         if (ret == -1) {
             return ret;
         }
 
-        ret = get_next_block(s, block);
         if (ret == 1) {
-            dump_completed(s);
             return 0;
         }
     }
 }
 
+/* get the part of @block that is dumped, false if there is none */
+static bool get_block_range(DumpState *s, RAMBlock *block, ram_addr_t *start,
+                            ram_addr_t *end)
+{
+    *start = 0;
+    *end = block->length;
+    if (s->has_filter) {
+        if (block->offset >= s->begin + s->length ||
+            block->offset + block->length <= s->begin) {
+            /* This block is out of the range */
+            return false;
+        }
+
+        if (s->begin > block->offset) {
+            *start = s->begin - block->offset;
+        }
+        if (s->begin + s->length < block->offset + block->length) {
+            *end = s->begin + s->length - block->offset;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Find the next run of pages of @mr, at or after *@addr and below @end,
+ * that the guest dirtied, and clear them in the dirty log.  Returns the
+ * length of the run, at most @max bytes, or 0 if there is none.
+ */
+static ram_addr_t get_dirty_run(MemoryRegion *mr, ram_addr_t *addr,
+                                ram_addr_t end, ram_addr_t max)
+{
+    ram_addr_t len;
+
+    while (*addr < end &&
+           !memory_region_test_and_clear_dirty(mr, *addr, TARGET_PAGE_SIZE,
+                                               DIRTY_MEMORY_MIGRATION)) {
+        *addr += TARGET_PAGE_SIZE;
+    }
+    if (*addr >= end) {
+        return 0;
+    }
+
+    len = TARGET_PAGE_SIZE;
+    while (len < max && *addr + len < end &&
+           memory_region_test_and_clear_dirty(mr, *addr + len,
+                                              TARGET_PAGE_SIZE,
+                                              DIRTY_MEMORY_MIGRATION)) {
+        len += TARGET_PAGE_SIZE;
+    }
+
+    return MIN(len, end - *addr);
+}
+
+/* rewrite the memory that the guest dirtied during the first pass */
+static int write_elf_dirty_pages(DumpState *s)
+{
+    RAMBlock *block;
+    ram_addr_t addr, end, len;
+
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!get_block_range(s, block, &addr, &end)) {
+            continue;
+        }
+
+        while ((len = get_dirty_run(block->mr, &addr, end, DUMP_IO_SIZE))) {
+            if (lseek(s->fd, get_offset(block->offset + addr, s),
+                      SEEK_SET) < 0) {
+                dump_error(s, "dump: failed to save memory");
+                return -1;
+            }
+            if (write_data(s, block->host + addr, len) < 0) {
+                return -1;
+            }
+            addr += len;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The kdump-compressed format is:
+ *   --------------
+ *   | disk dump   |
+ *   | header      |
+ *   --------------
+ *   | sub header  |
+ *   | elf note    |
+ *   --------------
+ *   | 1st bitmap  |
+ *   --------------
+ *   | 2nd bitmap  |
+ *   --------------
+ *   | page desc   |
+ *   --------------
+ *   | zero page   |
+ *   --------------
+ *   | page data   |
+ *   --------------
+ *
+ * Every page of guest RAM is present in both bitmaps and has a page
+ * descriptor, in the order of guest physical addresses.  All zero pages
+ * share the single zero page, the other pages are compressed with zlib
+ * unless that does not make them smaller.  Since the file is written in
+ * the flattened format, the page data can be written first and the
+ * headers, which need the CPU state, last.
+ */
+static int write_buffer(DumpState *s, off_t offset, void *buf, size_t size)
+{
+    MakedumpfileDataHeader mdh;
+
+    mdh.offset = cpu_to_be64(offset);
+    mdh.buf_size = cpu_to_be64(size);
+
+    if (fd_write_vmcore(&mdh, sizeof(mdh), s) < 0 ||
+        fd_write_vmcore(buf, size, s) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_start_flat_header(DumpState *s)
+{
+    MakedumpfileHeader *mh;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_malloc0(MAX_SIZE_MDF_HEADER);
+    mh = (MakedumpfileHeader *)buf;
+    memcpy(mh->signature, MAKEDUMPFILE_SIGNATURE,
+           strlen(MAKEDUMPFILE_SIGNATURE));
+    mh->type = cpu_to_be64(TYPE_FLAT_HEADER);
+    mh->version = cpu_to_be64(VERSION_FLAT_HEADER);
+
+    ret = fd_write_vmcore(buf, MAX_SIZE_MDF_HEADER, s);
+    g_free(buf);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write start flat header");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_end_flat_header(DumpState *s)
+{
+    MakedumpfileDataHeader mdh;
+
+    mdh.offset = END_FLAG_FLAT_HEADER;
+    mdh.buf_size = END_FLAG_FLAT_HEADER;
+
+    if (fd_write_vmcore(&mdh, sizeof(mdh), s) < 0) {
+        dump_error(s, "dump: failed to write end flat header");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+static const char *get_machine_name(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i686";
+    default:
+        return "";
+    }
+}
+
+static int write_kdump_header64(DumpState *s)
+{
+    DiskDumpHeader64 dh;
+    KdumpSubHeader64 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t bitmap_blocks = 2 * s->len_dump_bitmap / TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(DiskDumpHeader64));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(DISKDUMP_HEADER_VERSION,
+                                                endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            get_machine_name(s));
+    dh.status = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    if (write_buffer(s, 0, &dh, sizeof(DiskDumpHeader64)) < 0) {
+        dump_error(s, "dump: failed to write disk dump header");
+        return -1;
+    }
+
+    memset(&kh, 0, sizeof(KdumpSubHeader64));
+    kh.phys_base = cpu_convert_to_target64(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(s->offset_note, endian);
+    kh.note_size = cpu_convert_to_target64(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    if (write_buffer(s, DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE, &kh,
+                     sizeof(KdumpSubHeader64)) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_kdump_header32(DumpState *s)
+{
+    DiskDumpHeader32 dh;
+    KdumpSubHeader32 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t bitmap_blocks = 2 * s->len_dump_bitmap / TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(DiskDumpHeader32));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(DISKDUMP_HEADER_VERSION,
+                                                endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            get_machine_name(s));
+    dh.status = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    if (write_buffer(s, 0, &dh, sizeof(DiskDumpHeader32)) < 0) {
+        dump_error(s, "dump: failed to write disk dump header");
+        return -1;
+    }
+
+    memset(&kh, 0, sizeof(KdumpSubHeader32));
+    kh.phys_base = cpu_convert_to_target32(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(s->offset_note, endian);
+    kh.note_size = cpu_convert_to_target32(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    if (write_buffer(s, DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE, &kh,
+                     sizeof(KdumpSubHeader32)) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_kdump_notes(DumpState *s)
+{
+    int ret;
+
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_elf64_notes(buf_write_note, s);
+    } else {
+        ret = write_elf32_notes(buf_write_note, s);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (write_buffer(s, s->offset_note, s->note_buf, s->note_size) < 0) {
+        dump_error(s, "dump: failed to write notes");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* both bitmaps are the same: every page of s->list is dumped */
+static int write_dump_bitmap(DumpState *s)
+{
+    MemoryMapping *mapping;
+    uint8_t *bitmap;
+    uint64_t pfn, end;
+    int ret = 0;
+
+    bitmap = g_malloc0(s->len_dump_bitmap);
+    QTAILQ_FOREACH(mapping, &s->list.head, next) {
+        pfn = mapping->phys_addr >> TARGET_PAGE_BITS;
+        end = pfn + (mapping->length >> TARGET_PAGE_BITS);
+        for (; pfn < end; pfn++) {
+            bitmap[pfn / CHAR_BIT] |= 1 << (pfn % CHAR_BIT);
+        }
+    }
+
+    if (write_buffer(s, s->offset_bitmap, bitmap, s->len_dump_bitmap) < 0 ||
+        write_buffer(s, s->offset_bitmap + s->len_dump_bitmap, bitmap,
+                     s->len_dump_bitmap) < 0) {
+        dump_error(s, "dump: failed to write dump bitmap");
+        ret = -1;
+    }
+
+    g_free(bitmap);
+    return ret;
+}
+
+static int write_kdump_zero_page(DumpState *s)
+{
+    uint8_t *buf;
+    int ret;
+
+    buf = g_malloc0(TARGET_PAGE_SIZE);
+    ret = write_buffer(s, s->offset_zero, buf, TARGET_PAGE_SIZE);
+    g_free(buf);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write page data");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Wait for the oldest batch and write its page data and descriptors */
+static int kdump_flush_slot(DumpState *s)
+{
+    DumpCompressSlot *slot = &s->slots[s->head];
+    PageDescriptor pd[DUMP_BATCH_PAGES];
+    int endian = s->dump_info.d_endian;
+    off_t offset = s->offset_data;
+    size_t len = 0;
+    int i;
+
+    qemu_mutex_lock(&slot->lock);
+    while (!slot->done) {
+        qemu_cond_wait(&slot->cond, &slot->lock);
+    }
+    slot->done = false;
+    qemu_mutex_unlock(&slot->lock);
+
+    s->head = (s->head + 1) % s->nb_slots;
+    s->filled--;
+
+    memset(pd, 0, sizeof(PageDescriptor) * slot->nr_pages);
+    for (i = 0; i < slot->nr_pages; i++) {
+        if (!slot->size[i]) {
+            pd[i].offset = cpu_convert_to_target64(s->offset_zero, endian);
+            pd[i].size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+            continue;
+        }
+
+        pd[i].offset = cpu_convert_to_target64(offset + len, endian);
+        pd[i].size = cpu_convert_to_target32(slot->size[i], endian);
+        if (slot->compressed[i]) {
+            pd[i].flags = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB,
+                                                  endian);
+        }
+        len += slot->size[i];
+    }
+
+    if ((len && write_buffer(s, offset, slot->buf, len) < 0) ||
+        write_buffer(s, s->offset_page +
+                        slot->desc_index * sizeof(PageDescriptor),
+                     pd, sizeof(PageDescriptor) * slot->nr_pages) < 0) {
+        dump_error(s, "dump: failed to write page data");
+        return -1;
+    }
+    s->offset_data += len;
+
+    return 0;
+}
+
+static int kdump_flush(DumpState *s)
+{
+    while (s->filled) {
+        if (kdump_flush_slot(s) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Queue @nr_pages pages at @host, whose first descriptor is @desc_index */
+static int kdump_queue_batch(DumpState *s, uint8_t *host, int nr_pages,
+                             uint64_t desc_index)
+{
+    DumpCompressSlot *slot;
+
+    if (s->filled == s->nb_slots && kdump_flush_slot(s) < 0) {
+        return -1;
+    }
+
+    slot = &s->slots[(s->head + s->filled) % s->nb_slots];
+    qemu_mutex_lock(&slot->lock);
+    slot->host = host;
+    slot->nr_pages = nr_pages;
+    slot->desc_index = desc_index;
+    slot->pending = true;
+    qemu_cond_signal(&slot->cond);
+    qemu_mutex_unlock(&slot->lock);
+    s->filled++;
+
+    return 0;
+}
+
+/* write all memory to the kdump-compressed vmcore */
+static int write_kdump_pages(DumpState *s)
+{
+    DumpRange *range;
+    uint64_t nr_pages, page, n;
+    int i, ret;
+
+    for (i = 0; i < s->nb_ranges; i++) {
+        range = &s->ranges[i];
+        nr_pages = range->length >> TARGET_PAGE_BITS;
+        if (dump_lock_ramlist(s) < 0) {
+            return -1;
+        }
+
+        ret = 0;
+        for (page = 0; page < nr_pages; page += n) {
+            n = MIN(nr_pages - page, DUMP_BATCH_PAGES);
+            ret = kdump_queue_batch(s, range->host +
+                                       (page << TARGET_PAGE_BITS),
+                                    n, range->desc_base + page);
+            if (ret < 0) {
+                break;
+            }
+            dump_completed += n << TARGET_PAGE_BITS;
+        }
+
+        /* the compression threads are done with the range once flushed */
+        if (ret == 0) {
+            ret = kdump_flush(s);
+        }
+        if (ret < 0) {
+            dump_compress_threads_cleanup(s);
+        }
+        dump_unlock_ramlist(s);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* rewrite the pages that the guest dirtied during the first pass */
+static int write_kdump_dirty_pages(DumpState *s)
+{
+    DumpRange *range;
+    ram_addr_t addr, end, len;
+    int i;
+
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    for (i = 0; i < s->nb_ranges; i++) {
+        range = &s->ranges[i];
+        addr = range->offset;
+        end = range->offset + range->length;
+
+        while ((len = get_dirty_run(range->mr, &addr, end, DUMP_IO_SIZE))) {
+            if (kdump_queue_batch(s, range->host + (addr - range->offset),
+                                  len >> TARGET_PAGE_BITS,
+                                  range->desc_base +
+                                  ((addr - range->offset) >>
+                                   TARGET_PAGE_BITS)) < 0) {
+                return -1;
+            }
+            addr += len;
+        }
+    }
+
+    return kdump_flush(s);
+}
+
+/* write everything but the page data, and end the flattened stream */
+static int write_kdump_end(DumpState *s)
+{
+    int ret;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_kdump_header64(s);
+    } else {
+        ret = write_kdump_header32(s);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (write_kdump_notes(s) < 0) {
+        return -1;
+    }
+
+    if (write_dump_bitmap(s) < 0) {
+        return -1;
+    }
+
+    if (write_kdump_zero_page(s) < 0) {
+        return -1;
+    }
+
+    return write_end_flat_header(s);
+}
+
 static int create_vmcore(DumpState *s)
 {
     int ret;
 
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = write_start_flat_header(s);
+        if (ret < 0) {
+            return -1;
+        }
+
+        ret = write_kdump_pages(s);
+        if (ret < 0) {
+            return -1;
+        }
+
+        return write_kdump_end(s);
+    }
+
     ret = dump_begin(s);
     if (ret < 0) {
         return -1;
@@ -662,7 +1470,213 @@ static int create_vmcore(DumpState *s)
         return -1;
     }
 
-    return 0;
+    return dump_truncate(s);
+}
+
+/*
+ * A live dump writes guest memory from a thread while the guest keeps
+ * running, then stops the VM and writes again whatever the guest dirtied
+ * in the meantime, according to the dirty log.  The headers and notes are
+ * only written then, since they need the final CPU state; for the ELF
+ * format this means the file has to be seekable.
+ */
+static void dump_dirty_log_start(void)
+{
+    RAMBlock *block;
+    ram_addr_t addr;
+
+    memory_global_dirty_log_start();
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
+            memory_region_test_and_clear_dirty(block->mr, addr,
+                                               TARGET_PAGE_SIZE,
+                                               DIRTY_MEMORY_MIGRATION);
+        }
+    }
+}
+
+static int dump_live_first_pass(DumpState *s)
+{
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (write_start_flat_header(s) < 0) {
+            return -1;
+        }
+        return write_kdump_pages(s);
+    }
+
+    if (lseek(s->fd, s->memory_offset, SEEK_SET) < 0) {
+        dump_error(s, "dump: failed to save memory");
+        return -1;
+    }
+    return dump_iterate(s);
+}
+
+/* called with the iothread lock held */
+static int dump_live_complete(DumpState *s)
+{
+    CPUArchState *env;
+    ArchDumpInfo info;
+    int nr_cpus = 0;
+
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        s->resume = true;
+    }
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_synchronize_state(env);
+        nr_cpus++;
+    }
+
+    /* The layout of the dump was computed when it started */
+    if (ram_list.version != s->ram_version || nr_cpus != s->nr_cpus ||
+        cpu_get_dump_info(&info) < 0 ||
+        info.d_machine != s->dump_info.d_machine ||
+        info.d_class != s->dump_info.d_class) {
+        return -1;
+    }
+
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (write_kdump_dirty_pages(s) < 0) {
+            return -1;
+        }
+        return write_kdump_end(s);
+    }
+
+    if (write_elf_dirty_pages(s) < 0) {
+        return -1;
+    }
+
+    if (lseek(s->fd, 0, SEEK_SET) < 0) {
+        dump_error(s, "dump: failed to write elf header");
+        return -1;
+    }
+
+    if (dump_begin(s) < 0) {
+        return -1;
+    }
+
+    return dump_truncate(s);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    int ret;
+
+    ret = dump_live_first_pass(s);
+
+    qemu_mutex_lock_iothread();
+    if (ret == 0) {
+        ret = dump_live_complete(s);
+    }
+
+    memory_global_dirty_log_stop();
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    dump_cleanup(s);
+    dump_status = ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED;
+    qemu_mutex_unlock_iothread();
+
+    g_free(s);
+    return NULL;
+}
+
+static void dump_start_live(DumpState *s)
+{
+    /* Errors from the thread only show in query-dump, the command is over */
+    s->errp = NULL;
+    error_setg(&s->blocker, "A live guest memory dump is in progress");
+    migrate_add_blocker(s->blocker);
+    dump_dirty_log_start();
+
+    dump_status = DUMP_STATUS_ACTIVE;
+    qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_DETACHED);
+}
+
+/* collect the guest RAM that is mapped in the physical address space */
+static void kdump_add_range(MemoryListener *listener,
+                            MemoryRegionSection *section)
+{
+    DumpState *s = container_of(listener, DumpState, listener);
+    hwaddr start, end;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+
+    /* only whole pages have a bit in the bitmaps */
+    start = TARGET_PAGE_ALIGN(section->offset_within_address_space);
+    end = (section->offset_within_address_space + section->size) &
+          TARGET_PAGE_MASK;
+    if (start >= end) {
+        return;
+    }
+
+    s->ranges = g_renew(DumpRange, s->ranges, s->nb_ranges + 1);
+    s->ranges[s->nb_ranges++] = (DumpRange) {
+        .phys_addr = start,
+        .length = end - start,
+        .mr = section->mr,
+        .offset = section->offset_within_region +
+                  (start - section->offset_within_address_space),
+        .host = memory_region_get_ram_ptr(section->mr) +
+                section->offset_within_region +
+                (start - section->offset_within_address_space),
+    };
+    memory_mapping_list_add_merge_sorted(&s->list, start, 0, end - start);
+}
+
+/*
+ * compute the layout of the kdump-compressed vmcore
+ *
+ * The bitmaps are indexed by guest page frame number, so s->list holds the
+ * guest physical address of each run of RAM, not its ram_addr_t.  The flat
+ * view of the address space is sorted, and so are the page descriptors.
+ */
+static void kdump_init(DumpState *s)
+{
+    MemoryMapping *mapping;
+    size_t size_sub_header;
+    uint64_t nr_pages = 0;
+    int i;
+
+    s->listener = (MemoryListener) {
+        .region_add = kdump_add_range,
+    };
+    memory_listener_register(&s->listener, &address_space_memory);
+    memory_listener_unregister(&s->listener);
+
+    for (i = 0; i < s->nb_ranges; i++) {
+        s->ranges[i].desc_base = nr_pages;
+        nr_pages += s->ranges[i].length >> TARGET_PAGE_BITS;
+    }
+
+    s->max_mapnr = 0;
+    QTAILQ_FOREACH(mapping, &s->list.head, next) {
+        s->max_mapnr = MAX(s->max_mapnr, (mapping->phys_addr +
+                                          mapping->length) >> TARGET_PAGE_BITS);
+    }
+    s->total_size = nr_pages << TARGET_PAGE_BITS;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        size_sub_header = sizeof(KdumpSubHeader64);
+    } else {
+        size_sub_header = sizeof(KdumpSubHeader32);
+    }
+    s->sub_hdr_size = divideup(size_sub_header + s->note_size,
+                               TARGET_PAGE_SIZE);
+    s->offset_note = DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE +
+                     size_sub_header;
+
+    s->len_dump_bitmap = divideup(divideup(s->max_mapnr, CHAR_BIT),
+                                  TARGET_PAGE_SIZE) * TARGET_PAGE_SIZE;
+    s->offset_bitmap = (DISKDUMP_HEADER_BLOCKS + s->sub_hdr_size) *
+                       TARGET_PAGE_SIZE;
+    s->offset_page = s->offset_bitmap + 2 * s->len_dump_bitmap;
+    s->offset_zero = s->offset_page + nr_pages * sizeof(PageDescriptor);
+    s->offset_data = s->offset_zero + TARGET_PAGE_SIZE;
 }
 
 static ram_addr_t get_start_block(DumpState *s)
@@ -694,13 +1708,18 @@ static ram_addr_t get_start_block(DumpState *s)
 }
 
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, bool live, Error **errp)
 {
     CPUArchState *env;
+    RAMBlock *block;
+    ram_addr_t start, end;
+    struct stat st;
     int nr_cpus;
     int ret;
 
-    if (runstate_is_running()) {
+    /* A live dump stops the VM only once all memory has been written */
+    if (!live && runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -709,6 +1728,8 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
 
     s->errp = errp;
     s->fd = fd;
+    s->format = format;
+    s->live = live;
     s->has_filter = has_filter;
     s->begin = begin;
     s->length = length;
@@ -744,12 +1765,14 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         error_set(errp, QERR_UNSUPPORTED);
         goto cleanup;
     }
+    s->nr_cpus = nr_cpus;
+    s->ram_version = ram_list.version;
 
     /* get memory mapping */
     memory_mapping_list_init(&s->list);
     if (paging) {
         qemu_get_guest_memory_mapping(&s->list);
-    } else {
+    } else if (format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
         qemu_get_guest_simple_memory_mapping(&s->list);
     }
 
@@ -799,19 +1822,40 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         }
     }
 
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        kdump_init(s);
+        if (dump_compress_threads_setup(s) < 0) {
+            error_setg(errp, "dump: failed to start compression threads");
+            goto cleanup;
+        }
+    } else {
+        s->total_size = 0;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (get_block_range(s, block, &start, &end)) {
+                s->total_size += end - start;
+            }
+        }
+
+        /* Zero pages can be skipped if the file reads back as zeroes there */
+        s->sparse = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                    st.st_size == 0 && lseek(fd, 0, SEEK_CUR) == 0;
+    }
+
+    dump_completed = 0;
+    dump_total = s->total_size;
+
     return 0;
 
 cleanup:
-    if (s->resume) {
-        vm_start();
-    }
+    dump_cleanup(s);
 
     return -1;
 }
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -827,6 +1871,32 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (!has_live) {
+        live = false;
+    }
+
+    /* kdump-compressed format doesn't support paging or filter */
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (live && paging) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+
+    if (dump_status == DUMP_STATUS_ACTIVE) {
+        error_setg(errp, "A guest memory dump is already in progress");
+        return;
+    }
+    if (live && migration_is_active(migrate_get_current())) {
+        error_setg(errp, "A live dump cannot run during migration");
+        return;
+    }
+
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
         fd = monitor_get_fd(cur_mon, p, errp);
@@ -849,17 +1919,45 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    /* the headers of a live ELF dump are written last, at the start */
+    if (live && format == DUMP_GUEST_MEMORY_FORMAT_ELF &&
+        lseek(fd, 0, SEEK_CUR) < 0) {
+        error_setg(errp, "A live dump in ELF format needs a seekable file");
+        close(fd);
+        return;
+    }
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    s = g_malloc0(sizeof(DumpState));
+
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, live,
+                    errp);
     if (ret < 0) {
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    if (live) {
+        dump_start_live(s);
+        return;
+    }
+
+    ret = create_vmcore(s);
+    dump_cleanup(s);
+    dump_status = ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED;
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
 
     g_free(s);
 }
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_malloc0(sizeof(*result));
+
+    result->status = dump_status;
+    result->completed = dump_completed;
+    result->total = dump_total;
+
+    return result;
+}
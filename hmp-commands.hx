@@ -911,6 +911,23 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "switch the current VM migration to post-copy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current VM migration to post-copy: the destination starts running
+and fetches the RAM pages that it is still missing.  Needs the postcopy
+capability.  From then on the source can no longer be resumed with @code{cont}.
+
 ETEXI
 
     {
@@ -930,6 +947,39 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:i?,threads:i?,decompress-threads:i?",
+        .params     = "[level [threads [decompress-threads]]]",
+        .help       = "set the zlib level (1-9) and the number of threads "
+                      "used to compress and decompress RAM pages when the "
+                      "compress capability is enabled",
+        .mhandler.cmd = hmp_migrate_set_compress_params,
+    },
+
+STEXI
+@item migrate_set_compress_params [@var{level} [@var{threads} [@var{decompress-threads}]]]
+@findex migrate_set_compress_params
+Set the compression @var{level} and the number of compression and
+decompression threads for migrations with the compress capability.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of connections that carry RAM pages "
+                      "when the channels capability is enabled",
+        .mhandler.cmd = hmp_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Set the number of extra connections used for RAM in migrations with the
+channels capability.
 ETEXI
 
     {
@@ -996,9 +1046,11 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,zlib:-z,live:-l,filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-z] [-l] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -z: kdump-compressed format, with zlib"
+                      "\n\t\t\t -l: dump while the guest keeps running"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1006,12 +1058,16 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-z] [-l] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+      zlib: write the kdump-compressed format, in makedumpfile's flattened
+            form, instead of ELF. Can't be used with paging, begin or length.
+      live: dump in background while the guest keeps running, see
+            "info dump". Can't be used with paging.
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1634,6 +1690,8 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info dump
+show the status of the last guest memory dump
 @item info balloon
 show balloon information
 @item info qtree
@@ -181,6 +181,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                           info->ram->dirty_sync_count);
+        }
     }
 
     if (info->has_disk) {
@@ -203,6 +207,56 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->evictions);
+        if (info->xbzrle_cache->way_hits) {
+            XBZRLECacheWayStatsList *w;
+
+            monitor_printf(mon, "xbzrle cache hits by way:");
+            for (w = info->xbzrle_cache->way_hits; w; w = w->next) {
+                monitor_printf(mon, " %" PRIu64, w->value->hits);
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    if (info->has_compress) {
+        CompressThreadStatsList *t;
+
+        monitor_printf(mon, "compress level: %" PRId64 "\n",
+                       info->compress->level);
+        monitor_printf(mon, "compress transferred: %" PRIu64 " kbytes\n",
+                       info->compress->bytes >> 10);
+        monitor_printf(mon, "compress pages: %" PRIu64 " pages\n",
+                       info->compress->pages);
+        monitor_printf(mon, "compress incompressible: %" PRIu64 " pages\n",
+                       info->compress->incompressible);
+        for (t = info->compress->threads; t; t = t->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": %" PRIu64
+                           " pages, %" PRIu64 " kbytes, %" PRIu64 " ms busy\n",
+                           t->value->thread, t->value->pages,
+                           t->value->bytes >> 10, t->value->busy_time);
+        }
+    }
+
+    if (info->has_channels) {
+        MigrationChannelStatsList *c;
+
+        for (c = info->channels; c; c = c->next) {
+            monitor_printf(mon, "channel %" PRId64 ": %" PRIu64 " pages, %"
+                           PRIu64 " kbytes\n", c->value->channel,
+                           c->value->pages, c->value->bytes >> 10);
+        }
+    }
+
+    if (info->has_postcopy_requests) {
+        monitor_printf(mon, "postcopy requests: %" PRIu64 " pages\n",
+                       info->postcopy_requests);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
     }
 
     qapi_free_MigrationInfo(info);
@@ -228,6 +282,22 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result = qmp_query_dump(NULL);
+
+    if (result) {
+        monitor_printf(mon, "Status: %s\n",
+                       DumpStatus_lookup[result->status]);
+        if (result->total) {
+            monitor_printf(mon, "Completed: %" PRId64 " of %" PRId64
+                           " kbytes\n", result->completed >> 10,
+                           result->total >> 10);
+        }
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -316,6 +386,11 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -355,6 +430,19 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_metadata_cache) {
+            BlockMetadataCacheStats *cache =
+                stats->value->stats->metadata_cache;
+
+            monitor_printf(mon, "    metadata cache: hits=%" PRId64
+                           " misses=%" PRId64
+                           " shared_misses=%" PRId64
+                           " readahead=%" PRId64
+                           " entries=%" PRId64 "/%" PRId64 "\n",
+                           cache->hits, cache->misses, cache->shared_misses,
+                           cache->readahead, cache->entries,
+                           cache->max_entries);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -849,6 +937,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -868,6 +964,41 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_compress_params(Monitor *mon, const QDict *qdict)
+{
+    bool has_level = qdict_haskey(qdict, "level");
+    bool has_threads = qdict_haskey(qdict, "threads");
+    bool has_dthreads = qdict_haskey(qdict, "decompress-threads");
+    Error *err = NULL;
+
+    qmp_migrate_set_compress_params(has_level,
+                                    qdict_get_try_int(qdict, "level", 0),
+                                    has_threads,
+                                    qdict_get_try_int(qdict, "threads", 0),
+                                    has_dthreads,
+                                    qdict_get_try_int(qdict,
+                                                      "decompress-threads", 0),
+                                    &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_channels(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_channels(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -980,7 +1111,10 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -993,7 +1127,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(device, base != NULL, base,
                      qdict_haskey(qdict, "speed"), speed,
-                     BLOCKDEV_ON_ERROR_REPORT, true, &error);
+                     BLOCKDEV_ON_ERROR_REPORT, true, false, 0, &error);
 
     hmp_handle_error(mon, &error);
 }
@@ -1136,6 +1270,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int live = qdict_get_try_bool(qdict, "live", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1153,7 +1289,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          zlib, DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB,
+                          live, live, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
@@ -12,6 +12,7 @@
  */
 
 #include "exec/address-spaces.h"
+#include "sysemu/xen-mapcache.h"
 #include "hostmem.h"
 
 static int hostmem_lookup_cmp(const void *phys_, const void *region_)
@@ -49,7 +50,16 @@ void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write)
         goto out;
     }
     offset_within_region = phys - region->guest_addr;
-    if (len <= region->size - offset_within_region) {
+    if (len > region->size - offset_within_region) {
+        goto out;
+    }
+    if (hostmem_needs_unmap(hostmem)) {
+        /* The mapcache is thread-safe, locked entries stay valid until they
+         * are released by hostmem_unmap().
+         */
+        host_addr = xen_map_cache(region->ram_addr + offset_within_region,
+                                  len, 1);
+    } else {
         host_addr = region->host_addr + offset_within_region;
     }
 out:
@@ -58,6 +68,13 @@ out:
     return host_addr;
 }
 
+void hostmem_unmap(HostMem *hostmem, void *host_addr)
+{
+    if (hostmem_needs_unmap(hostmem)) {
+        xen_invalidate_map_cache_entry(host_addr);
+    }
+}
+
 /**
  * Install new regions list
  */
@@ -82,13 +99,29 @@ static void hostmem_listener_commit(MemoryListener *listener)
 static void hostmem_append_new_region(HostMem *hostmem,
                                       MemoryRegionSection *section)
 {
-    void *ram_ptr = memory_region_get_ram_ptr(section->mr);
+    void *host_addr = NULL;
+    ram_addr_t ram_addr = 0;
     size_t num = hostmem->num_new_regions;
     size_t new_size = (num + 1) * sizeof(hostmem->new_regions[0]);
 
+    /* On Xen only guest RAM can be mapped through the mapcache on lookup.
+     * Other RAM regions have no host mapping that is safe to use from
+     * another thread, leave them out so that lookups fail.
+     */
+    if (hostmem_needs_unmap(hostmem)) {
+        if (memory_region_get_ram_addr(section->mr) != 0) {
+            return;
+        }
+        ram_addr = section->offset_within_region;
+    } else {
+        host_addr = memory_region_get_ram_ptr(section->mr) +
+                    section->offset_within_region;
+    }
+
     hostmem->new_regions = g_realloc(hostmem->new_regions, new_size);
     hostmem->new_regions[num] = (HostMemRegion){
-        .host_addr = ram_ptr + section->offset_within_region,
+        .host_addr = host_addr,
+        .ram_addr = ram_addr,
         .guest_addr = section->offset_within_address_space,
         .size = section->size,
         .readonly = section->readonly,
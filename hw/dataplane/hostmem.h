@@ -16,9 +16,11 @@
 
 #include "exec/memory.h"
 #include "qemu/thread.h"
+#include "hw/xen.h"
 
 typedef struct {
-    void *host_addr;
+    void *host_addr;                /* NULL if mapped on demand */
+    ram_addr_t ram_addr;            /* mapcache address if mapped on demand */
     hwaddr guest_addr;
     uint64_t size;
     bool readonly;
@@ -51,7 +53,22 @@ void hostmem_finalize(HostMem *hostmem);
  * mapped memory is no longer used across events like hot memory unplug.  This
  * can be done with other mechanisms like bdrv_drain_all() that quiesce
  * in-flight I/O.
+ *
+ * On Xen guest memory is not mapped into QEMU as a whole, the pointer comes
+ * from the mapcache and must be released with hostmem_unmap().
  */
 void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write);
 
+/**
+ * Release a pointer returned by hostmem_lookup()
+ *
+ * This is a nop unless guest memory is mapped on demand.
+ */
+void hostmem_unmap(HostMem *hostmem, void *host_addr);
+
+static inline bool hostmem_needs_unmap(HostMem *hostmem)
+{
+    return xen_enabled();
+}
+
 #endif /* HOSTMEM_H */
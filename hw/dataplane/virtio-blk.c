@@ -14,11 +14,12 @@
 
 #include "trace.h"
 #include "qemu/iov.h"
-#include "event-poll.h"
 #include "qemu/thread.h"
+#include "qemu/error-report.h"
 #include "vring.h"
 #include "ioq.h"
 #include "migration/migration.h"
+#include "sysemu/sysemu.h"
 #include "hw/virtio-blk.h"
 #include "hw/dataplane/virtio-blk.h"
 
@@ -36,24 +37,34 @@ typedef struct {
     unsigned int head;              /* vring descriptor index */
     struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+
+    /* Only used by requests that go through the block layer */
+    VirtIOBlockDataPlane *s;
+    QEMUIOVector qiov;              /* guest buffers */
+    BlockAcctCookie acct;
 } VirtIOBlockRequest;
 
 struct VirtIOBlockDataPlane {
     bool started;
     bool stopping;
+    bool restart_on_resume;         /* stopped because the VM was stopped */
     QEMUBH *start_bh;
     QemuThread thread;
 
     VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+    int fd;                         /* image file descriptor, or -1 if
+                                       requests go through the block layer */
 
     VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
 
-    EventPoll event_poll;           /* event poller */
-    EventHandler io_handler;        /* Linux AIO completion handler */
-    EventHandler notify_handler;    /* virtqueue notify handler */
+    /* Event loop of the dataplane thread.  When requests go through the
+     * block layer, the image is moved to this context while the thread
+     * runs, so that its completions run in the thread as well.
+     */
+    AioContext *ctx;
+    EventNotifier host_notifier;    /* doorbell */
 
     IOQueue ioqueue;                /* Linux AIO queue (should really be per
                                        dataplane thread) */
@@ -62,6 +73,8 @@ struct VirtIOBlockDataPlane {
 
     unsigned int num_reqs;
 
+    VMChangeStateEntry *vm_state_entry;
+    Notifier close_notifier;
     Error *migration_blocker;
 };
 
@@ -117,6 +130,43 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
     s->num_reqs--;
 }
 
+static void complete_bdrv_request(void *opaque, int ret)
+{
+    VirtIOBlockRequest *req = opaque;
+    VirtIOBlockDataPlane *s = req->s;
+    struct virtio_blk_inhdr hdr;
+    int len;
+
+    if (likely(ret == 0)) {
+        hdr.status = VIRTIO_BLK_S_OK;
+        len = req->qiov.size;
+    } else {
+        hdr.status = VIRTIO_BLK_S_IOERR;
+        len = 0;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+    bdrv_acct_done(s->blk->conf.bs, &req->acct);
+
+    qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+    qemu_iovec_destroy(req->inhdr);
+    g_slice_free(QEMUIOVector, req->inhdr);
+
+    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    notify_guest(s);
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockRequest, req);
+    s->num_reqs--;
+
+    /* Requests that did not fit into the iovecs array are still in the
+     * vring, process them from the event loop rather than from here
+     */
+    if (unlikely(vring_more_avail(&s->vring))) {
+        event_notifier_set(&s->host_notifier);
+    }
+}
+
 static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
@@ -145,6 +195,61 @@ static void do_get_id_cmd(VirtIOBlockDataPlane *s,
     complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
+/* Submit a read, write or flush through the block layer, which completes it
+ * in the dataplane thread
+ */
+static void do_bdrv_cmd(VirtIOBlockDataPlane *s, uint32_t type,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        int64_t sector_num, unsigned int head,
+                        QEMUIOVector *inhdr)
+{
+    BlockDriverState *bs = s->blk->conf.bs;
+    unsigned int block_size = s->blk->conf.logical_block_size;
+    int64_t sector_mask = block_size / BDRV_SECTOR_SIZE - 1;
+    size_t size = iov_size(iov, iov_cnt);
+    VirtIOBlockRequest *req;
+    BlockDriverAIOCB *acb;
+
+    if (type != VIRTIO_BLK_T_FLUSH &&
+        ((sector_num & sector_mask) || (size % block_size))) {
+        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    req = g_slice_new0(VirtIOBlockRequest);
+    req->s = s;
+    req->head = head;
+    req->inhdr = inhdr;
+
+    /* The iovecs array only lives as long as handle_notify() */
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0, size);
+
+    s->num_reqs++;
+    switch (type) {
+    case VIRTIO_BLK_T_IN:
+        bdrv_acct_start(bs, &req->acct, size, BDRV_ACCT_READ);
+        acb = bdrv_aio_readv(bs, sector_num, &req->qiov,
+                             size / BDRV_SECTOR_SIZE,
+                             complete_bdrv_request, req);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        bdrv_acct_start(bs, &req->acct, size, BDRV_ACCT_WRITE);
+        acb = bdrv_aio_writev(bs, sector_num, &req->qiov,
+                              size / BDRV_SECTOR_SIZE,
+                              complete_bdrv_request, req);
+        break;
+    default:
+        bdrv_acct_start(bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+        acb = bdrv_aio_flush(bs, complete_bdrv_request, req);
+        break;
+    }
+
+    if (!acb) {
+        complete_bdrv_request(req, -EIO);
+    }
+}
+
 static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
@@ -223,10 +328,20 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
+        if (s->fd < 0) {
+            do_bdrv_cmd(s, outhdr.type, in_iov, in_num, outhdr.sector,
+                        head, inhdr);
+            return 0;
+        }
         do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
+        if (s->fd < 0) {
+            do_bdrv_cmd(s, outhdr.type, iov, out_num, outhdr.sector,
+                        head, inhdr);
+            return 0;
+        }
         do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
@@ -236,6 +351,11 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
+        if (s->fd < 0) {
+            do_bdrv_cmd(s, outhdr.type, NULL, 0, 0, head, inhdr);
+            return 0;
+        }
+
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
         if (qemu_fdatasync(s->fd) < 0) {
             complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
@@ -256,10 +376,10 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
     }
 }
 
-static void handle_notify(EventHandler *handler)
+static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           notify_handler);
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           host_notifier);
 
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
@@ -286,6 +406,7 @@ static void handle_notify(EventHandler *handler)
     unsigned int out_num = 0, in_num = 0;
     unsigned int num_queued;
 
+    event_notifier_test_and_clear(&s->host_notifier);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
         vring_disable_notification(s->vdev, &s->vring);
@@ -334,11 +455,12 @@ static void handle_notify(EventHandler *handler)
     }
 }
 
-static void handle_io(EventHandler *handler)
+static void handle_io(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           io_handler);
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           ioqueue.io_notifier);
 
+    event_notifier_test_and_clear(e);
     if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
         notify_guest(s);
     }
@@ -348,16 +470,24 @@ static void handle_io(EventHandler *handler)
      * requests.
      */
     if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->notify_handler);
+        handle_notify(&s->host_notifier);
     }
 }
 
+/* Keep aio_poll() blocking while the thread runs, even with no requests in
+ * flight
+ */
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
 static void *data_plane_thread(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
 
     do {
-        event_poll(&s->event_poll);
+        aio_poll(s->ctx, true);
     } while (!s->stopping || s->num_reqs > 0);
     return NULL;
 }
@@ -372,6 +502,33 @@ static void start_data_plane_bh(void *opaque)
                        s, QEMU_THREAD_JOINABLE);
 }
 
+/* Requests in flight must complete before the VM state is saved, and the
+ * main loop's bdrv_drain_all() does not see the dataplane's requests
+ */
+static void data_plane_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    if (running) {
+        if (s->restart_on_resume) {
+            virtio_blk_data_plane_start(s);
+        }
+    } else if (s->started) {
+        virtio_blk_data_plane_stop(s);
+        s->restart_on_resume = true;
+    }
+}
+
+/* bdrv_close() expects the image back in the main loop */
+static void data_plane_close_notifier(Notifier *n, void *data)
+{
+    VirtIOBlockDataPlane *s = container_of(n, VirtIOBlockDataPlane,
+                                           close_notifier);
+
+    virtio_blk_data_plane_stop(s);
+}
+
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   VirtIOBlockDataPlane **dataplane)
 {
@@ -395,21 +552,30 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
+    /* Raw images opened with cache=none,aio=native are served with Linux AIO
+     * directly, others through the block layer
+     */
     fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
-        error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
+    if (fd < 0 && !bdrv_supports_aio_context(blk->conf.bs)) {
+        error_report("drive is incompatible with x-data-plane, use a raw, "
+                     "qcow2 or vpc image without I/O limits");
         return false;
     }
 
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
-    s->fd = fd;
+    s->fd = fd < 0 ? -1 : fd;
     s->blk = blk;
+    s->ctx = aio_context_new();
 
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
 
+    s->vm_state_entry =
+        qemu_add_vm_change_state_handler(data_plane_vm_state_change, s);
+    s->close_notifier.notify = data_plane_close_notifier;
+    bdrv_add_close_notifier(blk->conf.bs, &s->close_notifier);
+
     error_setg(&s->migration_blocker,
             "x-data-plane does not support migration");
     migrate_add_blocker(s->migration_blocker);
@@ -427,7 +593,10 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
+    notifier_remove(&s->close_notifier);
+    qemu_del_vm_change_state_handler(s->vm_state_entry);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    aio_context_unref(s->ctx);
     g_free(s);
 }
 
@@ -440,13 +609,16 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         return;
     }
 
+    /* No image, e.g. after bdrv_close() on exit while vcpus still run */
+    if (!bdrv_is_inserted(s->blk->conf.bs)) {
+        return;
+    }
+
     vq = virtio_get_queue(s->vdev, 0);
     if (!vring_setup(&s->vring, s->vdev, 0)) {
         return;
     }
 
-    event_poll_init(&s->event_poll);
-
     /* Set up guest notifier (irq) */
     if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1,
                                               true) != 0) {
@@ -462,23 +634,28 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         fprintf(stderr, "virtio-blk failed to set host notifier\n");
         exit(1);
     }
-    event_poll_add(&s->event_poll, &s->notify_handler,
-                   virtio_queue_get_host_notifier(vq),
-                   handle_notify);
-
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    s->host_notifier = *virtio_queue_get_host_notifier(vq);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify,
+                           flush_true);
+
+    if (s->fd >= 0) {
+        /* Set up ioqueue */
+        ioq_init(&s->ioqueue, s->fd, REQ_MAX);
+        for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+            ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+        }
+        aio_set_event_notifier(s->ctx, ioq_get_notifier(&s->ioqueue),
+                               handle_io, NULL);
+    } else {
+        bdrv_drain_all();
+        bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
     }
-    event_poll_add(&s->event_poll, &s->io_handler,
-                   ioq_get_notifier(&s->ioqueue), handle_io);
 
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    event_notifier_set(&s->host_notifier);
 
     /* Spawn thread in BH so it inherits iothread cpusets */
     s->start_bh = qemu_bh_new(start_data_plane_bh, s);
@@ -487,6 +664,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
+    s->restart_on_resume = false;
     if (!s->started || s->stopping) {
         return;
     }
@@ -498,20 +676,36 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
         qemu_bh_delete(s->start_bh);
         s->start_bh = NULL;
     } else {
-        event_poll_notify(&s->event_poll);
+        aio_notify(s->ctx);
         qemu_thread_join(&s->thread);
     }
 
-    ioq_cleanup(&s->ioqueue);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL, NULL);
+    if (s->fd >= 0) {
+        aio_set_event_notifier(s->ctx, ioq_get_notifier(&s->ioqueue),
+                               NULL, NULL);
+        ioq_cleanup(&s->ioqueue);
+    } else {
+        bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
+    }
 
     s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
 
-    event_poll_cleanup(&s->event_poll);
-
     /* Clean up guest notifier (irq) */
     s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1, false);
 
-    vring_teardown(&s->vring);
+    vring_teardown(&s->vring, s->vdev, 0);
     s->started = false;
     s->stopping = false;
 }
+
+/* Forward a virtqueue kick that was not delivered through ioeventfd, which
+ * is not available on Xen
+ */
+void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s)
+{
+    if (!s->started || s->stopping) {
+        return;
+    }
+    event_notifier_set(&s->host_notifier);
+}
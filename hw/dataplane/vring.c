@@ -37,9 +37,14 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     }
 
     vring_init(&vring->vr, virtio_queue_get_num(vdev, n), vring_ptr, 4096);
+    vring->vring_ptr = vring_ptr;
+    if (hostmem_needs_unmap(&vring->hostmem)) {
+        vring->mappings = g_new0(VringMapping, vring->vr.num);
+    }
 
-    vring->last_avail_idx = 0;
-    vring->last_used_idx = 0;
+    /* Pick up where the last run stopped, e.g. before the VM was stopped */
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = vring->vr.used->idx;
     vring->signalled_used = 0;
     vring->signalled_used_valid = false;
 
@@ -48,8 +53,31 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     return true;
 }
 
-void vring_teardown(Vring *vring)
+static void vring_unmap_iov(Vring *vring, struct iovec *iov, unsigned int num)
 {
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        hostmem_unmap(&vring->hostmem, iov[i].iov_base);
+    }
+}
+
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    unsigned int i;
+
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+
+    if (vring->mappings) {
+        for (i = 0; i < vring->vr.num; i++) {
+            vring_unmap_iov(vring, vring->mappings[i].iov,
+                            vring->mappings[i].num);
+            g_free(vring->mappings[i].iov);
+        }
+        g_free(vring->mappings);
+        vring->mappings = NULL;
+    }
+    hostmem_unmap(&vring->hostmem, vring->vring_ptr);
     hostmem_finalize(&vring->hostmem);
 }
 
@@ -149,6 +177,7 @@ static int get_indirect(Vring *vring,
             return -EFAULT;
         }
         desc = *desc_ptr;
+        hostmem_unmap(&vring->hostmem, desc_ptr);
 
         /* Ensure descriptor has been loaded before accessing fields */
         barrier(); /* read_barrier_depends(); */
@@ -213,9 +242,9 @@ static int get_indirect(Vring *vring,
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              struct iovec iov[], struct iovec *iov_end,
-              unsigned int *out_num, unsigned int *in_num)
+static int vring_pop_iov(VirtIODevice *vdev, Vring *vring,
+                         struct iovec iov[], struct iovec *iov_end,
+                         unsigned int *out_num, unsigned int *in_num)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
@@ -332,6 +361,32 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
     return head;
 }
 
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], struct iovec *iov_end,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    VringMapping *mapping;
+    int head;
+
+    *out_num = *in_num = 0;
+    head = vring_pop_iov(vdev, vring, iov, iov_end, out_num, in_num);
+    if (!vring->mappings) {
+        return head;
+    }
+
+    /* Keep the guest buffers mapped until the request is pushed back, or
+     * release them right away if the descriptors are left on the ring.
+     */
+    if (head < 0) {
+        vring_unmap_iov(vring, iov, *out_num + *in_num);
+        return head;
+    }
+    mapping = &vring->mappings[head];
+    mapping->num = *out_num + *in_num;
+    mapping->iov = g_memdup(iov, mapping->num * sizeof(iov[0]));
+    return head;
+}
+
 /* After we've used one of their buffers, we tell them about it.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
@@ -341,6 +396,15 @@ void vring_push(Vring *vring, unsigned int head, int len)
     struct vring_used_elem *used;
     uint16_t new;
 
+    if (vring->mappings) {
+        VringMapping *mapping = &vring->mappings[head];
+
+        vring_unmap_iov(vring, mapping->iov, mapping->num);
+        g_free(mapping->iov);
+        mapping->iov = NULL;
+        mapping->num = 0;
+    }
+
     /* Don't touch vring if a fatal error occurred */
     if (vring->broken) {
         return;
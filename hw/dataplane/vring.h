@@ -22,8 +22,16 @@
 #include "hw/dataplane/hostmem.h"
 #include "hw/virtio.h"
 
+/* Guest buffers of a request that have to be unmapped on completion */
+typedef struct {
+    struct iovec *iov;
+    unsigned int num;
+} VringMapping;
+
 typedef struct {
     HostMem hostmem;                /* guest memory mapper */
+    void *vring_ptr;                /* mapped vring, for hostmem_unmap() */
+    VringMapping *mappings;         /* per head, if hostmem_needs_unmap() */
     struct vring vr;                /* virtqueue vring mapped to host memory */
     uint16_t last_avail_idx;        /* last processed avail ring index */
     uint16_t last_used_idx;         /* last processed used ring index */
@@ -50,7 +58,7 @@ static inline void vring_set_broken(Vring *vring)
 }
 
 bool vring_setup(Vring *vring, VirtIODevice *vdev, int n);
-void vring_teardown(Vring *vring);
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
@@ -423,6 +423,7 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
      */
     if (s->dataplane) {
         virtio_blk_data_plane_start(s->dataplane);
+        virtio_blk_data_plane_notify(s->dataplane);
         return;
     }
 #endif
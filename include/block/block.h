@@ -83,6 +83,7 @@ typedef struct BlockDevOps {
 #define BDRV_O_INCOMING    0x0800  /* consistency hint for incoming migration */
 #define BDRV_O_CHECK       0x1000  /* open solely for consistency check */
 #define BDRV_O_ALLOW_RDWR  0x2000  /* allow reopen to change from r/o to r/w */
+#define BDRV_O_BATCH_ALLOC 0x4000  /* allocate in large runs when growing */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -188,12 +189,31 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
                                             BlockDriverState *base,
                                             int64_t sector_num,
                                             int nb_sectors, int *pnum);
+
+/* A run of sectors in the same allocation state, see bdrv_co_get_extents() */
+typedef struct BlockExtent {
+    int64_t sector_num;
+    int nb_sectors;
+    bool allocated;
+} BlockExtent;
+
+int coroutine_fn bdrv_co_get_extents(BlockDriverState *bs, int64_t sector_num,
+                                     int64_t nb_sectors, BlockExtent *extents,
+                                     int max_extents);
+int coroutine_fn bdrv_co_get_extents_above(BlockDriverState *top,
+                                           BlockDriverState *base,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors,
+                                           BlockExtent *extents,
+                                           int max_extents);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
 int bdrv_truncate(BlockDriverState *bs, int64_t offset);
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t length);
 int64_t bdrv_getlength(BlockDriverState *bs);
 int64_t bdrv_get_allocated_file_size(BlockDriverState *bs);
+int bdrv_get_fd(BlockDriverState *bs);
 void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr);
 int bdrv_commit(BlockDriverState *bs);
 int bdrv_commit_all(void);
@@ -278,6 +298,11 @@ int bdrv_co_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_has_zero_init(BlockDriverState *bs);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       int *pnum);
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BlockExtent *extents, int max_extents);
+int bdrv_get_extents_above(BlockDriverState *top, BlockDriverState *base,
+                           int64_t sector_num, int64_t nb_sectors,
+                           BlockExtent *extents, int max_extents);
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
                        BlockdevOnError on_write_error);
@@ -369,6 +394,10 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+bool bdrv_supports_aio_context(BlockDriverState *bs);
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
 #ifdef CONFIG_LINUX_AIO
 int raw_get_aio_fd(BlockDriverState *bs);
 #else
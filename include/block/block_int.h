@@ -33,6 +33,7 @@
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
 #include "qemu/hbitmap.h"
+#include "qemu/throttle.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
@@ -42,9 +43,10 @@
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
 
+#define BDRV_EXTENT_CACHE_SIZE  64
+
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
 #define BLOCK_OPT_COMPAT6           "compat6"
@@ -63,12 +65,12 @@ typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    /* burst sizes in bytes and operations, 0 for the default */
+    int64_t bps_max[3];
+    int64_t iops_max[3];
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct BlockThrottleGroup BlockThrottleGroup;
 
 struct BlockDriver {
     const char *format_name;
@@ -122,6 +124,13 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Bulk version of bdrv_co_is_allocated(), see bdrv_co_get_extents().
+     * The range has already been clamped to the end of the image.
+     */
+    int coroutine_fn (*bdrv_co_get_extents)(BlockDriverState *bs,
+        int64_t sector_num, int64_t nb_sectors, BlockExtent *extents,
+        int max_extents);
 
     /*
      * Invalidate any cached meta-data.
@@ -143,8 +152,16 @@ struct BlockDriver {
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
+    int (*bdrv_preallocate)(BlockDriverState *bs, int64_t offset,
+                            int64_t length);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
+    /*
+     * Returns a host file descriptor whose contents are the guest-visible
+     * image data at the same offsets, or a negative errno.  Used to serve
+     * reads with zero-copy system calls.
+     */
+    int (*bdrv_get_fd)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
 
@@ -158,6 +175,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    void (*bdrv_get_cache_stats)(const BlockDriverState *bs,
+                                 BlockMetadataCacheStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -204,6 +223,17 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Set if the driver only reaches its image through the block layer, so
+     * that it works in any AioContext.  Fd handlers and bottom halves of the
+     * driver's own are moved by the two callbacks below, which are called
+     * with no requests in flight.  See bdrv_set_aio_context().
+     */
+    bool supports_aio_context;
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
     /* XenClient: ATAPI Pass Through
      * Allow the driver to receive command from the device emulation module */
     int (*bdrv_receive_request_from_device)(BlockDriverState *bs,
@@ -233,6 +263,9 @@ struct BlockDriverState {
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
 
+    AioContext *aio_context; /* event loop used for fd handlers, bottom
+                                halves and thread pool completions */
+
     void *dev;                  /* attached device model, if any */
     /* TODO change to DeviceState when all users are qdevified */
     const BlockDevOps *dev_ops;
@@ -252,16 +285,26 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
+    ThrottleState throttle_state;
+    BlockThrottleGroup *throttle_group;
     CoQueue      throttled_reqs;
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* size of the format driver's metadata cache in bytes, 0 for default */
+    uint64_t metadata_cache_size;
+
+    /* allocation map of the most recently queried part of the image */
+    BlockExtent extent_cache[BDRV_EXTENT_CACHE_SIZE];
+    int extent_cache_count;
+    uint64_t extent_cache_generation; /* bumped by every modification */
+
+    /* size of the shared cache for backing files in bytes, 0 to disable */
+    uint64_t shared_cache_size;
+    struct BlockSharedCache *shared_cache;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
@@ -298,6 +341,14 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_update_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+void bdrv_set_io_limits_group(BlockDriverState *bs, const char *group,
+                              BlockIOLimit *io_limits);
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, uint64_t size);
+void bdrv_set_shared_cache_size(BlockDriverState *bs, uint64_t size);
+
+bool bdrv_extent_add(BlockExtent *extents, int *nb_extents, int max_extents,
+                     int64_t sector_num, int64_t nb_sectors, bool allocated);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -314,6 +365,7 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @workers: The number of copy requests to keep in flight.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -326,7 +378,8 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id in the written image and to @base in the live BlockDriverState.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
+                  const char *base_id, int64_t speed, int workers,
+                  BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -335,14 +388,17 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs: Top Block device
  * @base: Block device that will be written into, and become the new top
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @workers: The number of copy requests to keep in flight.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
  *
+ * Copy the data allocated in any image between @base (exclusive) and @top
+ * (inclusive) into @base, then drop all of these images from the chain.
  */
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                 BlockDriverState *top, int64_t speed,
+                 BlockDriverState *top, int64_t speed, int workers,
                  BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
                  void *opaque, Error **errp);
 
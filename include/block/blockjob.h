@@ -229,6 +229,15 @@ QObject *qobject_from_block_job(BlockJob *job);
  */
 void block_job_ready(BlockJob *job);
 
+/**
+ * block_job_progress:
+ * @job: The job which is reporting progress.
+ * @throughput: Bytes per second copied since the last report.
+ *
+ * Send a BLOCK_JOB_PROGRESS event for the specified job.
+ */
+void block_job_progress(BlockJob *job, int64_t throughput);
+
 /**
  * block_job_is_paused:
  * @job: The job being queried.
@@ -275,4 +284,152 @@ void block_job_iostatus_reset(BlockJob *job);
 BlockErrorAction block_job_error_action(BlockJob *job, BlockDriverState *bs,
                                         BlockdevOnError on_err,
                                         int is_read, int error);
+
+/* Number of allocation map extents a job looks up at once */
+#define BLOCK_JOB_EXTENTS 64
+
+/**
+ * BlockJobAllocMap:
+ *
+ * Cached allocation map of the images between a top image and a base
+ * image, for jobs that walk an image from start to end.
+ */
+typedef struct BlockJobAllocMap {
+    BlockDriverState *top;
+    BlockDriverState *base;
+    BlockExtent extents[BLOCK_JOB_EXTENTS];
+    int nb_extents;
+} BlockJobAllocMap;
+
+/**
+ * block_job_alloc_map_init:
+ * @map: The allocation map to initialize.
+ * @top: The top image.
+ * @base: The base image, exclusive, or %NULL for the whole chain.
+ */
+void block_job_alloc_map_init(BlockJobAllocMap *map, BlockDriverState *top,
+                              BlockDriverState *base);
+
+/**
+ * block_job_is_allocated:
+ * @map: The allocation map of the job.
+ * @sector_num: The first sector to look at.
+ * @end: The end of the area the job walks.
+ * @pnum: Set to the number of sectors from @sector_num in the same state.
+ *
+ * Like bdrv_co_is_allocated_above(), but the extents are fetched in bulk
+ * and only looked up again once the walk moves past them.  Returns 1 if
+ * the sectors are allocated above the base, 0 if not, or -errno; @pnum is
+ * only valid if no error is returned.
+ */
+int coroutine_fn block_job_is_allocated(BlockJobAllocMap *map,
+                                        int64_t sector_num, int64_t end,
+                                        int *pnum);
+
+/**
+ * BlockJobCopyResult:
+ *
+ * The outcome of a request of a #BlockJobCopyPool, as decided by the job.
+ */
+typedef enum {
+    BLOCK_JOB_COPY_DONE,        /* copied, counts towards progress */
+    BLOCK_JOB_COPY_SKIPPED,     /* error was ignored, counts towards progress */
+    BLOCK_JOB_COPY_RETRY,       /* copy again when the job runs next */
+    BLOCK_JOB_COPY_FAILED,      /* error is reported, the job stops copying */
+} BlockJobCopyResult;
+
+typedef struct BlockJobCopyPool BlockJobCopyPool;
+
+typedef struct BlockJobCopyRequest {
+    BlockJobCopyPool *pool;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    QSIMPLEQ_ENTRY(BlockJobCopyRequest) next;
+} BlockJobCopyRequest;
+
+typedef BlockJobCopyResult coroutine_fn BlockJobCopyFunc(BlockJob *job,
+                                                 BlockJobCopyRequest *req);
+
+/**
+ * BlockJobCopyPool:
+ *
+ * A fixed number of copy requests that a job keeps in flight, each in its
+ * own coroutine.  The job coroutine waits for a free request before it
+ * starts the next one.
+ */
+struct BlockJobCopyPool {
+    BlockJob *job;
+    BlockJobCopyFunc *copy;
+    int workers;
+    BlockJobCopyRequest *reqs;
+    QSIMPLEQ_HEAD(, BlockJobCopyRequest) free_reqs;
+    QSIMPLEQ_HEAD(, BlockJobCopyRequest) retry_reqs;
+    int in_flight;
+    bool waiting;
+
+    /* a request failed and the error is reported, stop copying */
+    bool failed;
+
+    /* bytes copied that have not been charged to the rate limit yet */
+    uint64_t bytes_unaccounted;
+};
+
+/**
+ * block_job_copy_pool_init:
+ * @pool: The pool to initialize.
+ * @job: The job that owns the pool.
+ * @workers: The number of requests in flight at most.
+ * @buf_size: The size of the buffer of each request in bytes.
+ * @copy: Copies one request and decides what to do about errors.
+ */
+void block_job_copy_pool_init(BlockJobCopyPool *pool, BlockJob *job,
+                              int workers, size_t buf_size,
+                              BlockJobCopyFunc *copy);
+
+/**
+ * block_job_copy_pool_cleanup:
+ * @pool: The pool to free, it must not have requests in flight.
+ */
+void block_job_copy_pool_cleanup(BlockJobCopyPool *pool);
+
+/**
+ * block_job_copy_pool_start:
+ * @pool: The pool of the job.
+ * @sector_num: The first sector to copy.
+ * @nb_sectors: The number of sectors, at most the buffer size.
+ *
+ * Start copying an area in the background, first waiting for a request to
+ * finish if all of them are in flight.  Returns false if no request could
+ * be started because the pool failed or all requests wait to be retried.
+ */
+bool coroutine_fn block_job_copy_pool_start(BlockJobCopyPool *pool,
+                                            int64_t sector_num,
+                                            int nb_sectors);
+
+/**
+ * block_job_copy_pool_drain:
+ * @pool: The pool of the job.
+ *
+ * Wait until no request is in flight.
+ */
+void coroutine_fn block_job_copy_pool_drain(BlockJobCopyPool *pool);
+
+/**
+ * block_job_copy_pool_resubmit:
+ * @pool: The pool of the job.
+ *
+ * Start the requests that wait to be retried again.
+ */
+void block_job_copy_pool_resubmit(BlockJobCopyPool *pool);
+
+/**
+ * block_job_copy_pool_finish:
+ * @pool: The pool of the job.
+ *
+ * Wait for all requests, retrying those that have to be retried whenever
+ * the job runs again, until the job is cancelled or the pool failed.
+ * Returns true if every request has been dealt with.
+ */
+bool coroutine_fn block_job_copy_pool_finish(BlockJobCopyPool *pool);
 #endif
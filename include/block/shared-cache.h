@@ -0,0 +1,55 @@
+/*
+ * Shared backing file cache
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef BLOCK_SHARED_CACHE_H
+#define BLOCK_SHARED_CACHE_H
+
+#include "block/block_int.h"
+
+typedef struct BlockSharedCache BlockSharedCache;
+
+#ifdef CONFIG_POSIX
+BlockSharedCache *shared_cache_open(BlockDriverState *bs, uint64_t size);
+void shared_cache_close(BlockSharedCache *c);
+int coroutine_fn shared_cache_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov);
+void shared_cache_invalidate(BlockSharedCache *c, int64_t sector_num,
+                             int nb_sectors);
+void shared_cache_get_stats(BlockSharedCache *c, BlockSharedCacheStats *stats);
+#else
+static inline BlockSharedCache *shared_cache_open(BlockDriverState *bs,
+                                                  uint64_t size)
+{
+    return NULL;
+}
+
+static inline void shared_cache_close(BlockSharedCache *c)
+{
+}
+
+static inline int coroutine_fn shared_cache_co_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    return bs->drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+}
+
+static inline void shared_cache_invalidate(BlockSharedCache *c,
+                                           int64_t sector_num, int nb_sectors)
+{
+}
+
+static inline void shared_cache_get_stats(BlockSharedCache *c,
+                                          BlockSharedCacheStats *stats)
+{
+}
+#endif
+
+#endif
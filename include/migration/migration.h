@@ -45,14 +45,28 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, must not block: the vector may point into guest RAM */
+    ssize_t (*writev)(MigrationState *s, const struct iovec *iov, int iovcnt);
+    /* optional, opens one more blocking connection to the destination */
+    int (*connect_channel)(MigrationState *s, Error **errp);
+    char *channel_uri;
+    int *channel_fds;
+    int nb_channel_fds;
     void *opaque;
     MigrationParams params;
     int64_t total_time;
     int64_t downtime;
     int64_t expected_downtime;
     int64_t dirty_pages_rate;
+    int64_t dirty_sync_count;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    int channels;
+    bool start_postcopy;    /* requested with migrate-start-postcopy */
+    bool postcopy;          /* the source is stopped, pages are pushed */
     bool complete;
 };
 
@@ -84,6 +98,16 @@ void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **
 
 void migrate_fd_error(MigrationState *s);
 
+#define MAX_MIGRATE_CHANNELS 16
+
+void migrate_incoming_set_listen_fd(int fd);
+
+int migrate_incoming_accept_channel(void);
+
+int migrate_take_channel_fds(int **fds);
+
+void migrate_account_channel_bytes(size_t bytes);
+
 void migrate_fd_connect(MigrationState *s);
 
 int migrate_fd_close(MigrationState *s);
@@ -109,6 +133,20 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_evictions(void);
+XBZRLECacheWayStatsList *xbzrle_mig_cache_way_stats(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_pages_incompressible(void);
+CompressThreadStatsList *compress_mig_thread_stats(void);
+void ram_decompress_threads_join(void);
+MigrationChannelStatsList *ram_channel_stats(void);
+void ram_channels_wait(void);
+void ram_channels_join(void);
+int ram_postcopy_send(QEMUFile *f);
+uint64_t ram_postcopy_requests(void);
+int ram_postcopy_incoming_start(QEMUFile *f);
+bool ram_postcopy_incoming_started(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -126,10 +164,27 @@ void migrate_del_blocker(Error *reason);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+/* Encoder without vector acceleration, gives the same output as
+ * xbzrle_encode_buffer() */
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+bool migrate_zero_blocks(void);
+bool migrate_compress_blocks(void);
+bool migrate_dedup_blocks(void);
+bool migrate_use_compress(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+bool migrate_use_channels(void);
+int migrate_channels(void);
+bool migrate_use_postcopy(void);
+bool migrate_postcopy_started(void);
+bool migrate_postcopy_active(void);
+bool migrate_auto_converge(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 #endif
@@ -18,6 +18,19 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Associativity of the cache; caches with fewer pages are fully associative */
+#define PAGE_CACHE_WAYS 8
+
+typedef struct PageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    unsigned int ways;
+    /* way_hits[i] counts the hits on the i-th most recently used page of
+     * a set, so the hits of a smaller cache can be estimated */
+    uint64_t way_hits[PAGE_CACHE_WAYS];
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -37,14 +50,15 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached, and marks it as
+ * the most recently used page of its set if so
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -57,7 +71,8 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr);
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert the page into the cache. The previous value, or the
+ * least recently used page of the set if it is full, will be freed
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -66,8 +81,16 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_get_stats: get the hit, miss and eviction counters of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled with the statistics
+ */
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
+
+/**
+ * cache_resize: resize the page cache. In case of size reduction the least
+ * recently used pages of each set will be freed
  *
  * Returns -1 on error new cache size on success
  *
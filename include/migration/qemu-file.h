@@ -31,6 +31,14 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Write the vector of buffers @iov to a file at the given position.  The
+ * vector may point straight into caller memory (see qemu_put_buffer_async),
+ * so the handler has to be done with it, by sending or copying, before it
+ * returns.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -71,18 +79,27 @@ typedef struct QEMUFileOps {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
 } QEMUFileOps;
 
+/* Maximum number of buffers a QEMUFile gathers before flushing them */
+#define QEMU_FILE_MAX_IOV 64
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
-QEMUFile *qemu_fopen_socket(int fd);
+QEMUFile *qemu_fopen_socket(int fd, const char *mode);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
+int qemu_fflush(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+/* Like qemu_put_buffer, but @buf is only referenced, not copied, when the
+ * file supports writev_buffer: it must stay valid until the next flush.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
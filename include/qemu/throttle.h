@@ -0,0 +1,52 @@
+/*
+ * Token bucket I/O throttling
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_THROTTLE_H
+#define QEMU_THROTTLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    THROTTLE_BPS_TOTAL,
+    THROTTLE_BPS_READ,
+    THROTTLE_BPS_WRITE,
+    THROTTLE_OPS_TOTAL,
+    THROTTLE_OPS_READ,
+    THROTTLE_OPS_WRITE,
+    THROTTLE_BUCKETS,
+} ThrottleBucketType;
+
+/* A leaky bucket: @level drains at @rate units per second and requests
+ * have to wait while it is above @burst.  A zero @rate disables the bucket.
+ */
+typedef struct ThrottleBucket {
+    double rate;
+    double burst;
+    double level;
+} ThrottleBucket;
+
+/* A zero-initialized ThrottleState is valid and does not throttle. */
+typedef struct ThrottleState {
+    ThrottleBucket buckets[THROTTLE_BUCKETS];
+    int64_t last_leak;
+} ThrottleState;
+
+void throttle_set_limit(ThrottleState *ts, ThrottleBucketType type,
+                        double rate, double burst);
+bool throttle_enabled(ThrottleState *ts);
+
+/* Returns the number of nanoseconds a request has to wait before it may
+ * be submitted, or 0 if it may be submitted at time @now.
+ */
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now);
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t bytes);
+
+#endif
@@ -68,6 +68,7 @@ struct kvm_run;
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_thread_scheduled: Indicates a throttle sleep is queued.
  * @kvm_fd: vCPU file descriptor for KVM.
  *
  * State of one CPU core or thread.
@@ -92,6 +93,7 @@ struct CPUState {
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_thread_scheduled;
 
     int kvm_fd;
     bool kvm_vcpu_dirty;
@@ -169,6 +171,39 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
+/**
+ * cpu_throttle_set:
+ * @new_throttle_pct: Percent of sleep time, between 1 and 99.
+ *
+ * Throttles all vCPUs by forcing them to sleep for the given percentage of
+ * time.  The percentage is clamped to the valid range.
+ */
+void cpu_throttle_set(int new_throttle_pct);
+
+/**
+ * cpu_throttle_stop:
+ *
+ * Stops the vCPU throttling started by cpu_throttle_set().
+ */
+void cpu_throttle_stop(void);
+
+/**
+ * cpu_throttle_get_percentage:
+ *
+ * Returns: The current throttle percentage, or 0 if vCPUs are not throttled.
+ */
+int cpu_throttle_get_percentage(void);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -426,6 +426,11 @@ int main_loop_wait(int nonblocking)
 
 /* Functions to operate on the main QEMU AioContext.  */
 
+AioContext *qemu_get_aio_context(void)
+{
+    return qemu_aio_context;
+}
+
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 {
     return aio_bh_new(qemu_aio_context, cb, opaque);
@@ -39,6 +39,26 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+#ifndef _WIN32
+static ssize_t socket_writev(MigrationState *s, const struct iovec *iov,
+                             int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* called with the iothread lock held: never wait for the peer */
+    return sendmsg(s->fd, &msg, MSG_DONTWAIT);
+}
+#endif
+
+static int tcp_connect_channel(MigrationState *s, Error **errp)
+{
+    return inet_connect(s->channel_uri, errp);
+}
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -69,7 +89,12 @@ void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Erro
 {
     s->get_error = socket_errno;
     s->write = socket_write;
+#ifndef _WIN32
+    s->writev = socket_writev;
+#endif
     s->close = tcp_close;
+    s->connect_channel = tcp_connect_channel;
+    s->channel_uri = g_strdup(host_port);
 
     s->fd = inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
@@ -86,7 +111,6 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
@@ -95,16 +119,19 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    f = qemu_fopen_socket(c);
+    f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
         goto out;
     }
 
+    /* keep listening for the extra channels of a multi-channel migration */
+    migrate_incoming_set_listen_fd(s);
     process_incoming_migration(f);
     return;
 
 out:
+    closesocket(s);
     closesocket(c);
 }
 
@@ -39,6 +39,24 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* called with the iothread lock held: never wait for the peer */
+    return sendmsg(s->fd, &msg, MSG_DONTWAIT);
+}
+
+static int unix_connect_channel(MigrationState *s, Error **errp)
+{
+    return unix_connect(s->channel_uri, errp);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -69,7 +87,10 @@ void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **
 {
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
+    s->connect_channel = unix_connect_channel;
+    s->channel_uri = g_strdup(path);
 
     s->fd = unix_nonblocking_connect(path, unix_wait_for_connect, s, errp);
 }
@@ -86,7 +107,6 @@ static void unix_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && errno == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
 
     DPRINTF("accepted migration\n");
 
@@ -95,16 +115,19 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    f = qemu_fopen_socket(c);
+    f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
         goto out;
     }
 
+    /* keep listening for the extra channels of a multi-channel migration */
+    migrate_incoming_set_listen_fd(s);
     process_incoming_migration(f);
     return;
 
 out:
+    close(s);
     close(c);
 }
 
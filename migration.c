@@ -22,7 +22,9 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qemu/iov.h"
 #include "qmp-commands.h"
+#include "qom/cpu.h"
 
 //#define DEBUG_MIGRATION
 
@@ -52,6 +54,15 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration RAM page compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Multi-channel RAM transfer default */
+#define DEFAULT_MIGRATE_CHANNELS 4
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -65,6 +76,10 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .channels = DEFAULT_MIGRATE_CHANNELS,
     };
 
     return &current_migration;
@@ -89,13 +104,109 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     }
 }
 
+/* Listening socket of an incoming migration, kept open until the state is
+ * loaded so that the extra channels of a multi-channel migration can be
+ * accepted; -1 when the transport has none.
+ *
+ * The source opens all channels before it sends the setup section that
+ * announces them, and the listen backlog is short, so connections are
+ * accepted from the main loop as they come and queued until the RAM code
+ * asks for them.
+ */
+static int incoming_listen_fd = -1;
+static int *incoming_channel_fds;
+static int nb_incoming_channel_fds;
+
+static int migrate_incoming_accept(void)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+
+    do {
+        addrlen = sizeof(addr);
+        fd = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                         &addrlen);
+    } while (fd == -1 && socket_error() == EINTR);
+
+    if (fd != -1) {
+        socket_set_block(fd);
+    }
+    return fd;
+}
+
+static void migrate_incoming_accept_handler(void *opaque)
+{
+    int fd = migrate_incoming_accept();
+
+    if (fd == -1) {
+        return;
+    }
+    if (nb_incoming_channel_fds >= MAX_MIGRATE_CHANNELS) {
+        closesocket(fd);
+        return;
+    }
+    incoming_channel_fds = g_renew(int, incoming_channel_fds,
+                                   nb_incoming_channel_fds + 1);
+    incoming_channel_fds[nb_incoming_channel_fds++] = fd;
+}
+
+void migrate_incoming_set_listen_fd(int fd)
+{
+    incoming_listen_fd = fd;
+    qemu_set_fd_handler2(fd, NULL, migrate_incoming_accept_handler, NULL,
+                         NULL);
+}
+
+/* Return the next connection from the source, in the order they were
+ * accepted.  Connections still in the backlog are accepted directly,
+ * blocking, since the source has opened them all by now.
+ */
+int migrate_incoming_accept_channel(void)
+{
+    int fd;
+
+    if (nb_incoming_channel_fds) {
+        fd = incoming_channel_fds[0];
+        memmove(incoming_channel_fds, incoming_channel_fds + 1,
+                --nb_incoming_channel_fds * sizeof(int));
+        return fd;
+    }
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    socket_set_block(incoming_listen_fd);
+    fd = migrate_incoming_accept();
+    socket_set_nonblock(incoming_listen_fd);
+    return fd;
+}
+
+static void migrate_incoming_close_listen_fd(void)
+{
+    if (incoming_listen_fd != -1) {
+        qemu_set_fd_handler2(incoming_listen_fd, NULL, NULL, NULL, NULL);
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+    while (nb_incoming_channel_fds) {
+        closesocket(incoming_channel_fds[--nb_incoming_channel_fds]);
+    }
+    g_free(incoming_channel_fds);
+    incoming_channel_fds = NULL;
+}
+
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    /* after a switch to post-copy, the rest of the stream is still coming */
+    if (!ram_postcopy_incoming_started()) {
+        qemu_fclose(f);
+    }
+    migrate_incoming_close_listen_fd();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -169,6 +280,37 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->evictions = xbzrle_mig_pages_cache_evictions();
+        info->xbzrle_cache->way_hits = xbzrle_mig_cache_way_stats();
+    }
+}
+
+static void get_compress_stats(MigrationInfo *info)
+{
+    if (migrate_use_compress()) {
+        info->has_compress = true;
+        info->compress = g_malloc0(sizeof(*info->compress));
+        info->compress->level = migrate_compress_level();
+        info->compress->bytes = compress_mig_bytes_transferred();
+        info->compress->pages = compress_mig_pages_transferred();
+        info->compress->incompressible = compress_mig_pages_incompressible();
+        info->compress->threads = compress_mig_thread_stats();
+    }
+}
+
+static void get_channel_stats(MigrationInfo *info)
+{
+    info->channels = ram_channel_stats();
+    info->has_channels = info->channels != NULL;
+}
+
+static void get_postcopy_stats(MigrationInfo *info)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->postcopy) {
+        info->has_postcopy_requests = true;
+        info->postcopy_requests = ram_postcopy_requests();
     }
 }
 
@@ -183,7 +325,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -199,7 +341,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
-
+        info->ram->dirty_sync_count = s->dirty_sync_count;
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -210,9 +352,20 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compress_stats(info);
+        get_channel_stats(info);
+        get_postcopy_stats(info);
+
+        if (cpu_throttle_get_percentage()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compress_stats(info);
+        get_channel_stats(info);
+        get_postcopy_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -228,6 +381,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->dirty_sync_count = s->dirty_sync_count;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -253,6 +407,17 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
         return;
     }
 
+#if !GLIB_CHECK_VERSION(2, 16, 0)
+    /* Block deduplication needs GChecksum */
+    for (cap = params; cap; cap = cap->next) {
+        if (cap->value->capability == MIGRATION_CAPABILITY_DEDUP_BLOCKS &&
+            cap->value->state) {
+            error_setg(errp, "dedup-blocks is not supported by this build");
+            return;
+        }
+    }
+#endif
+
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
     }
@@ -313,6 +478,26 @@ static ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
     return ret;
 }
 
+static ssize_t migrate_fd_writev(MigrationState *s, const struct iovec *iov,
+                                 int iovcnt)
+{
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1) {
+        ret = -(s->get_error(s));
+    }
+
+    return ret;
+}
+
 static void migrate_fd_cancel(MigrationState *s)
 {
     if (s->state != MIG_STATE_ACTIVE)
@@ -369,9 +554,14 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
+    int decompress_threads = s->decompress_threads;
+    int channels = s->channels;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    g_free(s->channel_uri);
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
@@ -379,6 +569,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
+    s->channels = channels;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -416,6 +610,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_postcopy_started()) {
+        error_setg(errp, "The guest was moved by a post-copy migration");
+        return;
+    }
+
     if (qemu_savevm_state_blocked(errp)) {
         return;
     }
@@ -473,6 +672,78 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_compress_params(bool has_level, int64_t level,
+                                     bool has_threads, int64_t threads,
+                                     bool has_decompress_threads,
+                                     int64_t decompress_threads,
+                                     Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_level && (level < 1 || level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "level",
+                  "an integer in the range of 1 to 9");
+        return;
+    }
+    if (has_threads &&
+        (threads < 1 || threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+
+    if (has_level) {
+        s->compress_level = level;
+    }
+    if (has_threads) {
+        s->compress_threads = threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+}
+
+void qmp_migrate_set_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (value < 1 || value > MAX_MIGRATE_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "an integer in the range of 1 to 16");
+        return;
+    }
+
+    s->channels = value;
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_use_postcopy()) {
+        error_setg(errp, "Enable the postcopy migration capability first");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "No migration in progress");
+        return;
+    }
+    /* page requests come back over the connection, which only the socket
+     * transports can do; they are also those that open extra channels */
+    if (!s->connect_channel) {
+        error_setg(errp, "Post-copy needs a tcp or unix migration");
+        return;
+    }
+    s->start_postcopy = true;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -502,6 +773,124 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_compress_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS_BLOCKS];
+}
+
+bool migrate_dedup_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DEDUP_BLOCKS];
+}
+
+bool migrate_use_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_threads;
+}
+
+bool migrate_use_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_CHANNELS];
+}
+
+int migrate_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->channels;
+}
+
+bool migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+/* Once the switch to post-copy began, the destination may be running the
+ * guest, so the state left here must never run again.
+ */
+static bool postcopy_started;
+
+bool migrate_postcopy_started(void)
+{
+    return postcopy_started;
+}
+
+bool migrate_postcopy_active(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->postcopy;
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -513,6 +902,62 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+/* Open the extra connections for a multi-channel migration.  This runs in
+ * the migration thread before any state is sent, without the iothread lock,
+ * so the destination sees them right after the main connection.  If one of
+ * them cannot be opened, migration goes on over the main connection alone.
+ */
+static void migrate_connect_channels(MigrationState *s)
+{
+    Error *local_err = NULL;
+    int i, n = migrate_channels();
+
+    if (!migrate_use_channels() || !s->connect_channel) {
+        return;
+    }
+
+    s->channel_fds = g_new(int, n);
+    for (i = 0; i < n; i++) {
+        s->channel_fds[i] = s->connect_channel(s, &local_err);
+        if (s->channel_fds[i] < 0) {
+            fprintf(stderr, "migration: could not open channel %d: %s, "
+                    "using a single connection\n", i,
+                    error_get_pretty(local_err));
+            error_free(local_err);
+            while (i--) {
+                closesocket(s->channel_fds[i]);
+            }
+            g_free(s->channel_fds);
+            s->channel_fds = NULL;
+            return;
+        }
+    }
+    s->nb_channel_fds = n;
+    DPRINTF("opened %d channels\n", n);
+}
+
+/* Hand the extra connections over to the RAM code, which closes them */
+int migrate_take_channel_fds(int **fds)
+{
+    MigrationState *s = migrate_get_current();
+    int n = s->nb_channel_fds;
+
+    *fds = s->channel_fds;
+    s->channel_fds = NULL;
+    s->nb_channel_fds = 0;
+    return n;
+}
+
+/* Pages sent over the extra connections count against the same rate
+ * limit as the main stream.  Called from the migration thread.
+ */
+void migrate_account_channel_bytes(size_t bytes)
+{
+    MigrationState *s = migrate_get_current();
+
+    s->bytes_xfer += bytes;
+}
+
 
 static ssize_t buffered_flush(MigrationState *s)
 {
@@ -544,6 +989,18 @@ static ssize_t buffered_flush(MigrationState *s)
     return offset;
 }
 
+static void buffered_reserve(MigrationState *s, size_t size)
+{
+    if (size > (s->buffer_capacity - s->buffer_size)) {
+        DPRINTF("increasing buffer capacity from %zu by %zu\n",
+                s->buffer_capacity, size + 1024);
+
+        s->buffer_capacity += size + 1024;
+
+        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+    }
+}
+
 static int buffered_put_buffer(void *opaque, const uint8_t *buf,
                                int64_t pos, int size)
 {
@@ -562,17 +1019,66 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf,
         return size;
     }
 
-    if (size > (s->buffer_capacity - s->buffer_size)) {
-        DPRINTF("increasing buffer capacity from %zu by %zu\n",
-                s->buffer_capacity, size + 1024);
+    buffered_reserve(s, size);
+    memcpy(s->buffer + s->buffer_size, buf, size);
+    s->buffer_size += size;
 
-        s->buffer_capacity += size + 1024;
+    return size;
+}
 
-        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+/* Send the vector straight from the QEMUFile's buffer and guest RAM while
+ * the socket and the rate limit allow it; only what is left over is copied
+ * into s->buffer for buffered_flush() to send from the migration thread.
+ */
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    MigrationState *s = opaque;
+    struct iovec sg[QEMU_FILE_MAX_IOV];
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t ret;
+
+    DPRINTF("putting %zu bytes in %d vectors at %" PRId64 "\n",
+            size, iovcnt, pos);
+
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-ret));
+        return ret;
     }
 
-    memcpy(s->buffer + s->buffer_size, buf, size);
-    s->buffer_size += size;
+    /* whatever is already queued has to go out first */
+    if (s->buffer_size) {
+        ret = buffered_flush(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    while (s->writev && !s->buffer_size && offset < size &&
+           s->bytes_xfer < s->xfer_limit) {
+        size_t to_send = MIN(size - offset, s->xfer_limit - s->bytes_xfer);
+        int cnt = iov_copy(sg, ARRAY_SIZE(sg), iov, iovcnt, offset, to_send);
+
+        ret = migrate_fd_writev(s, sg, cnt);
+        if (ret == -EAGAIN || ret == 0) {
+            break;
+        } else if (ret < 0) {
+            DPRINTF("error writing data, %zd\n", ret);
+            return ret;
+        }
+        DPRINTF("sent %zd byte(s) without copying\n", ret);
+        offset += ret;
+        s->bytes_xfer += ret;
+    }
+
+    if (offset < size) {
+        buffered_reserve(s, size - offset);
+        iov_to_buf(iov, iovcnt, offset, s->buffer + s->buffer_size,
+                   size - offset);
+        s->buffer_size += size - offset;
+    }
 
     return size;
 }
@@ -654,6 +1160,35 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
+/* Stop the source and send what the destination needs to start: the end
+ * of the live sections, where RAM lists the pages that it has not sent, and
+ * the device state.  The pages follow, without a rate limit, as the
+ * destination may be waiting for them.
+ */
+static int migrate_postcopy_switch(MigrationState *s)
+{
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    DPRINTF("switching to post-copy\n");
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_FINISH_MIGRATE);
+    } else {
+        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+
+    s->postcopy = true;
+    postcopy_started = true;
+    ret = qemu_savevm_state_postcopy(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    s->xfer_limit = INT_MAX;
+    return 0;
+}
+
 static void *buffered_file_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -662,6 +1197,8 @@ static void *buffered_file_thread(void *opaque)
     bool last_round = false;
     int ret;
 
+    migrate_connect_channels(s);
+
     qemu_mutex_lock_iothread();
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->file, &s->params);
@@ -686,7 +1223,25 @@ static void *buffered_file_thread(void *opaque)
             qemu_mutex_unlock_iothread();
             break;
         }
-        if (s->bytes_xfer < s->xfer_limit) {
+        if (s->start_postcopy && !s->postcopy) {
+            ret = migrate_postcopy_switch(s);
+            if (ret < 0) {
+                qemu_mutex_unlock_iothread();
+                break;
+            }
+        }
+        if (s->postcopy) {
+            ret = ram_postcopy_send(s->file);
+            if (ret < 0) {
+                qemu_mutex_unlock_iothread();
+                break;
+            } else if (ret == 0) {
+                DPRINTF("post-copy done\n");
+                migrate_fd_completed(s);
+                s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+                last_round = true;
+            }
+        } else if (s->bytes_xfer < s->xfer_limit) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
@@ -727,12 +1282,19 @@ static void *buffered_file_thread(void *opaque)
             }
         }
         qemu_mutex_unlock_iothread();
+        /* a RAM channel queue may have cut the iteration short */
+        ram_channels_wait();
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = s->bytes_xfer;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
             max_size = bandwidth * migrate_max_downtime() / 1000000;
 
+            /* what would still have to be sent with the guest stopped */
+            if (bandwidth > 0 && !s->postcopy) {
+                s->expected_downtime = ram_bytes_remaining() / bandwidth;
+            }
+
             DPRINTF("transferred %" PRIu64 " time_spent %" PRIu64
                     " bandwidth %g max_size %" PRId64 "\n",
                     transferred_bytes, time_spent, bandwidth, max_size);
@@ -752,8 +1314,17 @@ static void *buffered_file_thread(void *opaque)
 
 out:
     if (ret < 0) {
+        /* stops the channel threads, if any */
+        qemu_mutex_lock_iothread();
+        qemu_savevm_state_cancel();
+        qemu_mutex_unlock_iothread();
         migrate_fd_error(s);
     }
+    while (s->nb_channel_fds) {
+        closesocket(s->channel_fds[--s->nb_channel_fds]);
+    }
+    g_free(s->channel_fds);
+    s->channel_fds = NULL;
     g_free(s->buffer);
     return NULL;
 }
@@ -765,6 +1336,7 @@ static const QEMUFileOps buffered_file_ops = {
     .rate_limit =     buffered_rate_limit,
     .get_rate_limit = buffered_get_rate_limit,
     .set_rate_limit = buffered_set_rate_limit,
+    .writev_buffer =  buffered_writev_buffer,
 };
 
 void migrate_fd_connect(MigrationState *s)
@@ -463,6 +463,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_BLOCK_JOB_PROGRESS] = "BLOCK_JOB_PROGRESS",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -2686,6 +2687,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the status of the last guest memory dump",
+        .mhandler.cmd = hmp_info_dump,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -20,6 +20,7 @@
 #include "block/block.h"
 
 #include "block/coroutine.h"
+#include "block/thread-pool.h"
 
 #include <errno.h>
 #include <string.h>
@@ -34,6 +35,7 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/sendfile.h>
 #endif
 
 #include "qemu/sockets.h"
@@ -86,6 +88,11 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    size_t data_size;
+
+    /* If fd is not -1, the reply payload is sent from the file */
+    int fd;
+    off_t fd_offset;
 };
 
 struct NBDExport {
@@ -804,7 +811,7 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+#define MAX_NBD_REQUESTS 64
 
 void nbd_client_get(NBDClient *client)
 {
@@ -859,16 +866,29 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
     }
     nbd_client_get(client);
     req->client = client;
+    req->fd = -1;
     return req;
 }
 
+/* Buffers are only as large as the requests that used them, so that many
+ * small requests in flight do not pin NBD_BUFFER_SIZE bytes each.
+ */
+static void nbd_request_alloc_data(NBDRequest *req, size_t len)
+{
+    if (req->data_size >= len) {
+        return;
+    }
+    qemu_vfree(req->data);
+    req->data = qemu_blockalign(req->client->exp->bs, len);
+    req->data_size = len;
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
@@ -989,6 +1009,82 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+#ifdef __linux__
+typedef struct NBDSendfileData {
+    int csock;
+    int fd;
+    off_t offset;
+    size_t len;
+} NBDSendfileData;
+
+/* sendfile can block on the disk, so it runs in the thread pool */
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(data->csock, data->fd, &data->offset, data->len);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+static ssize_t nbd_co_sendfile(NBDClient *client, int fd, off_t offset,
+                               size_t len)
+{
+    static const uint8_t zero_buf[4096];
+    NBDSendfileData data = {
+        .csock = client->sock,
+        .fd = fd,
+        .offset = offset,
+    };
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        /* The socket is not written to while the worker runs, so it must
+         * not wake us up.
+         */
+        qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read, NULL,
+                             client);
+        data.len = len - done;
+        ret = thread_pool_submit_co(pool, nbd_sendfile_worker, &data);
+        qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read,
+                             nbd_restart_write, client);
+        if (ret == -EAGAIN) {
+            qemu_coroutine_yield();
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        } else if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    /* If the file was truncated under our feet, the block layer would read
+     * zeroes past its end.  The header is already out, so do the same.
+     */
+    while (done < len) {
+        ret = qemu_co_send(client->sock, (void *)zero_buf,
+                           MIN(len - done, sizeof(zero_buf)));
+        if (ret <= 0) {
+            return -EIO;
+        }
+        done += ret;
+    }
+    return done;
+}
+#else
+static ssize_t nbd_co_sendfile(NBDClient *client, int fd, off_t offset,
+                               size_t len)
+{
+    return -ENOTSUP;
+}
+#endif
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1007,7 +1103,11 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 1);
         rc = nbd_send_reply(csock, reply);
         if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
+            if (req->fd != -1) {
+                ret = nbd_co_sendfile(client, req->fd, req->fd_offset, len);
+            } else {
+                ret = qemu_co_send(csock, req->data, len);
+            }
             if (ret != len) {
                 rc = -EIO;
             }
@@ -1055,6 +1155,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
+        nbd_request_alloc_data(req, request->len);
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
             LOG("reading from socket failed");
             rc = -EIO;
@@ -1075,6 +1176,8 @@ static void nbd_trip(void *opaque)
     NBDRequest *req;
     struct nbd_request request;
     struct nbd_reply reply;
+    struct iovec iov;
+    QEMUIOVector qiov;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -1121,8 +1224,33 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+#ifdef __linux__
+        /* Plain files can be sent to the socket without a copy through
+         * userspace.  Errors can't be reported once the header is out, so
+         * a failure there drops the connection.  sendfile bypasses the
+         * block layer and would not be ordered against writes that are in
+         * flight for an overlapping range, so it is only used when nothing
+         * can write to the export.
+         */
+        ret = (exp->nbdflags & NBD_FLAG_READ_ONLY) ? bdrv_get_fd(exp->bs)
+                                                   : -ENOTSUP;
+        if (ret >= 0) {
+            req->fd = ret;
+            req->fd_offset = request.from + exp->dev_offset;
+            TRACE("Sending %u byte(s) from fd %d", request.len, req->fd);
+            if (nbd_co_send_reply(req, &reply, request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+#endif
+
+        nbd_request_alloc_data(req, request.len);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1144,8 +1272,11 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -48,12 +48,36 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    /* the items of set i are page_cache[i * num_ways, (i + 1) * num_ways) */
+    int64_t num_sets;
+    unsigned int num_ways;
+    PageCacheStats stats;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static void cache_init_items(PageCache *cache, int64_t num_pages)
 {
     int64_t i;
 
+    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+    cache->num_items = 0;
+
+    DPRINTF("Setting cache to %" PRId64 " sets of %u ways\n",
+            cache->num_sets, cache->num_ways);
+
+    cache->page_cache = g_malloc((cache->max_num_items) *
+                                 sizeof(*cache->page_cache));
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_addr = -1;
+    }
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -61,7 +85,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
+    cache = g_malloc0(sizeof(*cache));
 
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
@@ -69,20 +93,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
     cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
-
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
-
-    cache->page_cache = g_malloc((cache->max_num_items) *
-                                 sizeof(*cache->page_cache));
-
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
+    cache_init_items(cache, num_pages);
 
     return cache;
 }
@@ -102,71 +114,134 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t page = address / cache->page_size;
+    size_t set;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+
+    /* Fold in the high bits, so that pages that are a multiple of the
+     * cache size apart do not always share a set */
+    set = (page ^ (page >> 16)) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Number of items in the set of @it that were used more recently */
+static unsigned int cache_get_rank(const PageCache *cache, CacheItem *it)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, it->it_addr);
+    unsigned int i, rank = 0;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_data && set[i].it_age > it->it_age) {
+            rank++;
+        }
+    }
+    return rank;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        cache->stats.misses++;
+        return false;
+    }
+
+    cache->stats.hits++;
+    cache->stats.way_hits[cache_get_rank(cache, it)]++;
+    it->it_age = ++cache->max_item_age;
+    return true;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+/* Find the item that @addr replaces in @cache: its own item, a free way,
+ * or the least recently used way of the set */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
+    CacheItem *set, *victim;
+    unsigned int i;
 
-    CacheItem *it = NULL;
+    victim = cache_get_by_addr(cache, addr);
+    if (victim) {
+        return victim;
+    }
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
+    return victim;
+}
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+static void cache_insert_item(PageCache *cache, uint64_t addr,
+                              uint8_t *pdata, uint64_t age)
+{
+    CacheItem *it = cache_get_victim(cache, addr);
 
     if (!it->it_data) {
         cache->num_items++;
+    } else if (it->it_data != pdata) {
+        if (it->it_addr != addr) {
+            cache->stats.evictions++;
+        }
+        g_free(it->it_data);
     }
 
     it->it_data = pdata;
-    it->it_age = ++cache->max_item_age;
+    it->it_age = age;
     it->it_addr = addr;
 }
 
-int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 {
-    PageCache *new_cache;
-    int64_t i;
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    cache_insert_item(cache, addr, pdata, ++cache->max_item_age);
+}
+
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
+{
+    *stats = cache->stats;
+    stats->ways = cache->num_ways;
+}
 
-    CacheItem *old_it, *new_it;
+int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    CacheItem *old_cache;
+    int64_t old_num_items, i;
 
     g_assert(cache);
 
@@ -175,44 +250,40 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
+    if (new_num_pages <= 0) {
+        DPRINTF("invalid number of pages\n");
+        return -1;
+    }
+
     /* same size */
     if (pow2floor(new_num_pages) == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
-        DPRINTF("Error creating new cache\n");
-        return -1;
-    }
+    old_cache = cache->page_cache;
+    old_num_items = cache->max_num_items;
+    cache_init_items(cache, pow2floor(new_num_pages));
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+    /* Move all pages to the new sets.  When a set overflows the least
+     * recently used page is dropped, whatever order the pages come in,
+     * because a page older than the whole set is freed right away. */
+    for (i = 0; i < old_num_items; i++) {
+        CacheItem *old_it = &old_cache[i];
+        CacheItem *victim;
+
+        if (!old_it->it_data) {
+            continue;
         }
+        victim = cache_get_victim(cache, old_it->it_addr);
+        if (victim->it_data && victim->it_age > old_it->it_age) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        cache_insert_item(cache, old_it->it_addr, old_it->it_data,
+                          old_it->it_age);
     }
 
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    g_free(old_cache);
 
     return cache->max_num_items;
 }
@@ -26,31 +26,11 @@
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 #include "qemu/queue.h"
-#include "block/aio.h"
 #include "trace.h"
 
-static QTAILQ_HEAD(, Coroutine) unlock_bh_queue =
-    QTAILQ_HEAD_INITIALIZER(unlock_bh_queue);
-static QEMUBH* unlock_bh;
-
-static void qemu_co_queue_next_bh(void *opaque)
-{
-    Coroutine *next;
-
-    trace_qemu_co_queue_next_bh();
-    while ((next = QTAILQ_FIRST(&unlock_bh_queue))) {
-        QTAILQ_REMOVE(&unlock_bh_queue, next, co_queue_next);
-        qemu_coroutine_enter(next, NULL);
-    }
-}
-
 void qemu_co_queue_init(CoQueue *queue)
 {
     QTAILQ_INIT(&queue->entries);
-
-    if (!unlock_bh) {
-        unlock_bh = qemu_bh_new(qemu_co_queue_next_bh, NULL);
-    }
 }
 
 void coroutine_fn qemu_co_queue_wait(CoQueue *queue)
@@ -69,26 +49,61 @@ void coroutine_fn qemu_co_queue_wait_insert_head(CoQueue *queue)
     assert(qemu_in_coroutine());
 }
 
-bool qemu_co_queue_next(CoQueue *queue)
+void qemu_co_queue_run_restart(Coroutine *co)
 {
     Coroutine *next;
 
-    next = QTAILQ_FIRST(&queue->entries);
-    if (next) {
+    trace_qemu_co_queue_run_restart(co);
+    while ((next = QTAILQ_FIRST(&co->co_queue_wakeup))) {
+        QTAILQ_REMOVE(&co->co_queue_wakeup, next, co_queue_next);
+        qemu_coroutine_enter(next, NULL);
+    }
+}
+
+/* Woken up coroutines run in the thread that wakes them up, rather than in
+ * a bottom half of the main loop.  A coroutine that wakes up others keeps
+ * running until it yields or terminates, see qemu_coroutine_enter().
+ * Outside coroutine context they are entered right away.
+ */
+static bool qemu_co_queue_do_restart(CoQueue *queue, bool single)
+{
+    Coroutine *self = qemu_coroutine_self();
+    CoQueue wakeup;
+    Coroutine *next;
+
+    if (QTAILQ_EMPTY(&queue->entries)) {
+        return false;
+    }
+
+    QTAILQ_INIT(&wakeup.entries);
+    while ((next = QTAILQ_FIRST(&queue->entries)) != NULL) {
         QTAILQ_REMOVE(&queue->entries, next, co_queue_next);
-        QTAILQ_INSERT_TAIL(&unlock_bh_queue, next, co_queue_next);
         trace_qemu_co_queue_next(next);
-        qemu_bh_schedule(unlock_bh);
+        if (qemu_in_coroutine()) {
+            QTAILQ_INSERT_TAIL(&self->co_queue_wakeup, next, co_queue_next);
+        } else {
+            QTAILQ_INSERT_TAIL(&wakeup.entries, next, co_queue_next);
+        }
+        if (single) {
+            break;
+        }
     }
 
-    return (next != NULL);
+    while ((next = QTAILQ_FIRST(&wakeup.entries)) != NULL) {
+        QTAILQ_REMOVE(&wakeup.entries, next, co_queue_next);
+        qemu_coroutine_enter(next, NULL);
+    }
+    return true;
+}
+
+bool qemu_co_queue_next(CoQueue *queue)
+{
+    return qemu_co_queue_do_restart(queue, true);
 }
 
 void qemu_co_queue_restart_all(CoQueue *queue)
 {
-    while (qemu_co_queue_next(queue)) {
-        /* Do nothing */
-    }
+    qemu_co_queue_do_restart(queue, false);
 }
 
 bool qemu_co_queue_empty(CoQueue *queue)
@@ -663,6 +663,54 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+typedef struct ExtentIter {
+    BlockDriverState *bs;
+    BlockExtent extents[64];
+    int count;
+    int index;
+} ExtentIter;
+
+/*
+ * Like bdrv_is_allocated(), but fetches the allocation map of 'bs' in batches
+ * so that walking an image front to back needs only a few calls into the
+ * block layer.  'end' is the number of sectors in the image.
+ */
+static int extent_iter_is_allocated(ExtentIter *it, BlockDriverState *bs,
+                                    int64_t end, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    BlockExtent *e;
+    int ret;
+
+    if (it->bs != bs) {
+        it->bs = bs;
+        it->count = it->index = 0;
+    }
+
+    while (it->index < it->count &&
+           sector_num >= it->extents[it->index].sector_num +
+                         it->extents[it->index].nb_sectors) {
+        it->index++;
+    }
+
+    if (it->index == it->count ||
+        sector_num < it->extents[it->index].sector_num) {
+        it->count = it->index = 0;
+        ret = bdrv_get_extents(bs, sector_num, end - sector_num,
+                               it->extents, ARRAY_SIZE(it->extents));
+        if (ret <= 0) {
+            /* Copying the data is always correct */
+            *pnum = nb_sectors;
+            return 1;
+        }
+        it->count = ret;
+    }
+
+    e = &it->extents[it->index];
+    *pnum = MIN(nb_sectors, e->sector_num + e->nb_sectors - sector_num);
+    return e->allocated;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
@@ -681,6 +729,7 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    ExtentIter extent_iter = { .bs = NULL };
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1029,8 +1078,10 @@ static int img_convert(int argc, char **argv)
                    are present in both the output's and input's base images (no
                    need to copy them). */
                 if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
+                    if (!extent_iter_is_allocated(&extent_iter, bs[bs_i],
+                                                  bs_sectors,
+                                                  sector_num - bs_offset,
+                                                  n, &n1)) {
                         sector_num += n1;
                         continue;
                     }
@@ -1736,6 +1787,7 @@ static int img_rebase(int argc, char **argv)
         uint8_t * buf_old;
         uint8_t * buf_new;
         float local_progress = 0;
+        ExtentIter extent_iter = { .bs = NULL };
 
         buf_old = qemu_blockalign(bs, IO_BUF_SIZE);
         buf_new = qemu_blockalign(bs, IO_BUF_SIZE);
@@ -1761,7 +1813,8 @@ static int img_rebase(int argc, char **argv)
             }
 
             /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
+            ret = extent_iter_is_allocated(&extent_iter, bs, num_sectors,
+                                           sector, n, &n);
             if (ret) {
                 continue;
             }
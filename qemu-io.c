@@ -1671,6 +1671,98 @@ static const cmdinfo_t map_cmd = {
        .oneline        = "prints the allocated areas of a file",
 };
 
+static void extents_help(void)
+{
+    printf(
+"\n"
+" prints the allocation state of the file as a list of extents\n"
+"\n"
+" Example:\n"
+" 'extents -b 1M 64k' - lists the extents of 64k from 1 megabyte into the\n"
+"                       file, including the backing files\n"
+"\n"
+" Without a range, the whole file is described.\n"
+" -b, -- count sectors allocated in a backing file as allocated\n"
+"\n");
+}
+
+static int extents_f(int argc, char **argv);
+
+static const cmdinfo_t extents_cmd = {
+    .name       = "extents",
+    .cfunc      = extents_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-b] [off len]",
+    .oneline    = "prints the allocated areas of a file as extents",
+    .help       = extents_help,
+};
+
+static int extents_f(int argc, char **argv)
+{
+    BlockExtent extents[64];
+    BlockDriverState *base;
+    int64_t offset, count, sector_num, end;
+    int bflag = 0;
+    int c, i, n;
+
+    while ((c = getopt(argc, argv, "b")) != EOF) {
+        switch (c) {
+        case 'b':
+            bflag = 1;
+            break;
+        default:
+            return command_usage(&extents_cmd);
+        }
+    }
+
+    if (optind == argc) {
+        offset = 0;
+        count = bs->total_sectors << BDRV_SECTOR_BITS;
+    } else if (optind == argc - 2) {
+        offset = cvtnum(argv[optind]);
+        count = cvtnum(argv[optind + 1]);
+        if (offset < 0 || count < 0) {
+            printf("non-numeric argument -- %s %s\n",
+                   argv[optind], argv[optind + 1]);
+            return 0;
+        }
+    } else {
+        return command_usage(&extents_cmd);
+    }
+
+    if ((offset | count) & 0x1ff) {
+        printf("offset %" PRId64 " or length %" PRId64
+               " is not sector aligned\n", offset, count);
+        return 0;
+    }
+
+    base = bflag ? NULL : bs->backing_hd;
+    sector_num = offset >> BDRV_SECTOR_BITS;
+    end = sector_num + (count >> BDRV_SECTOR_BITS);
+
+    while (sector_num < end) {
+        n = bdrv_get_extents_above(bs, base, sector_num, end - sector_num,
+                                   extents, ARRAY_SIZE(extents));
+        if (n < 0) {
+            printf("extents failed: %s\n", strerror(-n));
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            printf("[% 24" PRId64 "] % 10d sectors %s\n",
+                   extents[i].sector_num << BDRV_SECTOR_BITS,
+                   extents[i].nb_sectors,
+                   extents[i].allocated ? "    allocated" : "not allocated");
+        }
+        sector_num = extents[n - 1].sector_num + extents[n - 1].nb_sectors;
+    }
+
+    return 0;
+}
+
 static int break_f(int argc, char **argv)
 {
     int ret;
@@ -1876,7 +1968,7 @@ static int init_check_command(const cmdinfo_t *ct)
 static void usage(const char *name)
 {
     printf(
-"Usage: %s [-h] [-V] [-rsnm] [-c cmd] ... [file]\n"
+"Usage: %s [-h] [-V] [-rsnmb] [-c cmd] ... [file]\n"
 "QEMU Disk exerciser\n"
 "\n"
 "  -c, --cmd            command to execute\n"
@@ -1886,6 +1978,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -b, --batch-alloc    allocate clusters in large runs when the image grows\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
 "  -h, --help           display this help and exit\n"
@@ -1899,7 +1992,7 @@ int main(int argc, char **argv)
 {
     int readonly = 0;
     int growable = 0;
-    const char *sopt = "hVc:rsnmgkt:T:";
+    const char *sopt = "hVc:rsnmgkbt:T:";
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -1911,6 +2004,7 @@ int main(int argc, char **argv)
         { "misalign", 0, NULL, 'm' },
         { "growable", 0, NULL, 'g' },
         { "native-aio", 0, NULL, 'k' },
+        { "batch-alloc", 0, NULL, 'b' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
         { NULL, 0, NULL, 0 }
@@ -1944,6 +2038,9 @@ int main(int argc, char **argv)
         case 'k':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'b':
+            flags |= BDRV_O_BATCH_ALLOC;
+            break;
         case 't':
             if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
                 error_report("Invalid cache option: %s", optarg);
@@ -1995,6 +2092,7 @@ int main(int argc, char **argv)
     add_command(&discard_cmd);
     add_command(&alloc_cmd);
     add_command(&map_cmd);
+    add_command(&extents_cmd);
     add_command(&break_cmd);
     add_command(&resume_cmd);
     add_command(&wait_break_cmd);
@@ -149,8 +149,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,readonly=on|off][,copy-on-read=on|off][,metadata-cache-size=size]\n"
+    "       [,shared-cache-size=size][,batch-alloc=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -204,6 +207,33 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item metadata-cache-size=@var{size}
+Limit the image format's in-memory metadata cache (for example the QED L2 table
+cache, or the grain table cache of each VMDK extent) to @var{size} bytes.
+Formats without such a cache ignore this option.
+By default the format driver picks its own size.
+@item shared-cache-size=@var{size}
+Cache data read from the backing files of this drive in a file in
+@file{/dev/shm} that all QEMU processes of the same user using the same,
+unmodified backing chain in the same format share.  This helps when many
+guests booting from one golden image read the same blocks at the same time.
+The first process to use a backing file creates its cache with @var{size}
+bytes; later ones use the existing cache regardless of their own setting.
+The cache file is removed when the last process stops using it.  By default
+no shared cache is used.
+@item batch-alloc=@var{batch-alloc}
+@var{batch-alloc} is "on" or "off".  When it is on, a qcow2 image that grows
+reserves clusters in runs of 8 MB with a single refcount update, instead of
+updating refcounts for every allocation.  Clusters of the last run that are
+still unused are released when the image is closed; after a crash they show
+up as leaked clusters.  Other formats ignore this option.  The default is off.
+@item bps_max=@var{b},bps_rd_max=@var{r},bps_wr_max=@var{w}
+@itemx iops_max=@var{i},iops_rd_max=@var{r},iops_wr_max=@var{w}
+Allow bursts of up to the given number of bytes or operations above the
+corresponding @option{bps}, @option{iops} (or read and write) limit after the
+drive has been idle, for example to speed up guest boot.  Each option requires
+the limit it applies to.  By default the burst is one millisecond worth of
+the limit.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -534,7 +534,7 @@ EQMP
 
     {
         .name       = "xen-save-devices-state",
-        .args_type  = "filename:F",
+        .args_type  = "filename:F,incremental:b?",
     .mhandler.cmd_new = qmp_marshal_input_xen_save_devices_state,
     },
 
@@ -550,6 +550,8 @@ Arguments:
 - "filename": the file to save the state of the devices to as binary
 data. See xen-save-devices-state.txt for a description of the binary
 format.
+- "incremental": only save the devices whose state changed since the
+previous incremental save (json-bool, optional)
 
 Example:
 
@@ -557,6 +559,32 @@ Example:
      "arguments": { "filename": "/tmp/save" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "xen-load-devices-state",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_input_xen_load_devices_state,
+    },
+
+SQMP
+xen-load-devices-state
+----------------------
+
+Load the state of devices from a file written by xen-save-devices-state.
+The VM must not be running.  The files of a chain of incremental saves
+have to be loaded in order, without running the VM in between.
+
+Arguments:
+
+- "filename": the file to load the state of the devices from (json-string)
+
+Example:
+
+-> { "execute": "xen-load-devices-state",
+     "arguments": { "filename": "/tmp/save" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -658,6 +686,84 @@ Example:
 -> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
 <- { "return": {} }
 
+EQMP
+    {
+        .name       = "migrate-set-compress-params",
+        .args_type  = "level:i?,threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_compress_params,
+    },
+
+SQMP
+migrate-set-compress-params
+---------------------------
+
+Set the parameters of RAM page compression, used when the "compress"
+migration capability is enabled.  The values are read when migration starts.
+
+Arguments:
+
+- "level": zlib compression level, 1 to 9 (json-int, optional)
+- "threads": number of compression threads (json-int, optional)
+- "decompress-threads": number of decompression threads on the destination
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-compress-params",
+     "arguments": { "level": 1, "threads": 4 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "migrate-set-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_channels,
+    },
+
+SQMP
+migrate-set-channels
+--------------------
+
+Set the number of extra connections that carry RAM pages when the
+"channels" migration capability is enabled.  The value is read when
+migration starts.
+
+Arguments:
+
+- "value": number of channels, 1 to 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-channels", "arguments": { "value": 8 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the running migration to post-copy: the source stops and the
+destination starts running before all RAM pages were sent.  The missing
+pages follow, those that the destination touches first.  Needs the
+"postcopy" migration capability and the tcp or unix transport.
+
+Once the switch starts, "cont" and "migrate" fail on the source, even if
+the migration fails.  If it fails after the switch, the destination shuts
+down.
+
+Arguments: None
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
     {
         .name       = "query-migrate-cache-size",
@@ -765,8 +871,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,live:b?",
+        .params     = "-p protocol [begin] [length] [format] [live]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -787,6 +893,11 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": the format of the dump, "elf" or "kdump-zlib". It's optional,
+            the default is "elf". "kdump-zlib" can't be used with paging,
+            begin or length (json-string)
+- "live": keep the guest running while its memory is dumped in background,
+          see query-dump. It can't be used with paging (json-bool, optional)
 
 Example:
 
@@ -797,6 +908,34 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "query background dump status",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query the status and progress of the last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory written so far (json-int)
+- "total": bytes of guest memory to be dumped (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
+
 EQMP
 
     {
@@ -878,13 +1017,13 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,on-error:s?,workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
     {
         .name       = "block-commit",
-        .args_type  = "device:B,base:s?,top:s,speed:o?",
+        .args_type  = "device:B,base:s?,top:s,speed:o?,workers:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
@@ -1312,7 +1451,9 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1331,6 +1472,14 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst size in bytes (json-int, optional)
+- "bps_rd_max":  read burst size in bytes (json-int, optional)
+- "bps_wr_max":  write burst size in bytes (json-int, optional)
+- "iops_max":  total burst size in I/O operations (json-int, optional)
+- "iops_rd_max":  read burst size in I/O operations (json-int, optional)
+- "iops_wr_max":  write burst size in I/O operations (json-int, optional)
+- "group":  throttle group; the limits are shared by all devices in the
+            group (json-string, optional)
 
 Example:
 
@@ -1343,6 +1492,17 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio1",
+                                               "bps": "0",
+                                               "bps_rd": "0",
+                                               "bps_wr": "0",
+                                               "iops": "2000",
+                                               "iops_rd": "0",
+                                               "iops_wr": "0",
+                                               "iops_max": "20000",
+                                               "group": "vm1" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1765,10 +1925,29 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "metadata-cache": A json-object with statistics of the image format's
+                        metadata cache, omitted if the format driver does not
+                        keep one (json-object, optional), it contains:
+        - "hits": table lookups satisfied from the cache (json-int)
+        - "misses": table lookups that waited for a read (json-int)
+        - "shared-misses": misses that waited for a read already in flight
+                           (json-int)
+        - "readahead": tables read ahead of demand (json-int)
+        - "entries": tables currently cached (json-int)
+        - "max-entries": capacity of the cache, in tables (json-int)
+    - "shared-cache": A json-object with statistics of the cache shared
+                      between processes, present only for backing files using
+                      it (json-object, optional), it contains:
+        - "hits": reads satisfied from the shared cache (json-int)
+        - "misses": reads that went to the backing file (json-int)
+        - "evictions": cached chunks replaced by this process (json-int)
+        - "size": size of the shared cache in bytes (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "backing": Contains recursively the statistics of the backing image, if
+             there is one (json-object, optional)
 
 Example:
 
@@ -2445,6 +2624,10 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "dirty-pages-rate" : pages dirtied per second by the guest
+           (json-int)
+         - "dirty-sync-count" : number of dirty bitmap synchronizations
+           (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2457,6 +2640,24 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+         - "evictions": number of pages evicted from the cache
+         - "way-hits": json-array of "way" and "hits", the cache hits on
+           the n-th most recently used page of a set
+- "compress": only present if the compress capability is active.
+  It is a json-object with the following information:
+         - "level": zlib compression level
+         - "pages": number of pages sent compressed
+         - "bytes": total bytes sent for compressed pages
+         - "incompressible": number of pages sent uncompressed because they
+           did not shrink
+         - "threads": json-array with "thread", "pages", "bytes" and
+           "busy-time" (in milliseconds) for each compression thread
+- "channels": only present if RAM was sent over several channels.
+  It is a json-array with "channel", "pages" and "bytes" for each channel
+- "postcopy-requests": only present if the migration switched to post-copy,
+  number of pages the destination asked for (json-int)
+- "cpu-throttle-percentage": only present while auto-converge throttles the
+  vCPUs, percentage of time they are made to sleep (json-int)
 Examples:
 
 1. Before the first migration
@@ -2552,7 +2753,16 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
-            "overflow":34434
+            "overflow":34434,
+            "evictions":1943,
+            "way-hits":[ { "way":0, "hits":2010349 },
+                         { "way":1, "hits":283211 },
+                         { "way":2, "hits":100488 },
+                         { "way":3, "hits":30552 },
+                         { "way":4, "hits":11208 },
+                         { "way":5, "hits":5410 },
+                         { "way":6, "hits":2011 },
+                         { "way":7, "hits":1114 } ]
          }
       }
    }
@@ -2572,6 +2782,13 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "zero-blocks": do not send the contents of zero blocks in block migration
+- "compress-blocks": compress blocks in block migration
+- "dedup-blocks": send blocks already sent in block migration as references
+- "compress": compress RAM pages with multiple threads
+- "channels": send RAM pages over several connections
+- "postcopy": allow switching to post-copy with migrate-start-postcopy
+- "auto-converge": throttle the vCPUs if the migration does not converge
 
 Arguments:
 
@@ -2596,6 +2813,13 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "zero-blocks" : zero block elision state (json-bool)
+         - "compress-blocks" : block compression state (json-bool)
+         - "dedup-blocks" : block deduplication state (json-bool)
+         - "compress" : RAM page compression state (json-bool)
+         - "channels" : multi-channel RAM transfer state (json-bool)
+         - "postcopy" : post-copy state (json-bool)
+         - "auto-converge" : vCPU throttling state (json-bool)
 
 Arguments:
 
@@ -23,6 +23,7 @@
 #include "sysemu/arch_init.h"
 #include "hw/qdev.h"
 #include "sysemu/blockdev.h"
+#include "migration/migration.h"
 #include "qom/qom-qobject.h"
 
 NameInfo *qmp_query_name(Error **errp)
@@ -149,6 +150,11 @@ void qmp_cont(Error **errp)
 {
     Error *local_err = NULL;
 
+    if (migrate_postcopy_started()) {
+        error_setg(errp, "The guest was moved by a post-copy migration");
+        return;
+    }
+
     if (runstate_check(RUN_STATE_INTERNAL_ERROR) ||
                runstate_check(RUN_STATE_SHUTDOWN)) {
         error_set(errp, QERR_RESET_REQUIRED);
@@ -39,6 +39,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/bitops.h"
+#include "qemu/iov.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -125,6 +126,9 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    struct iovec iov[QEMU_FILE_MAX_IOV];
+    int iovcnt;
+
     int last_error;
 };
 
@@ -198,6 +202,27 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov,
+                                    int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t len;
+
+    while (offset < size) {
+        len = iov_send(s->fd, iov, iovcnt, offset, size - offset);
+        if (len == -1) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -socket_error();
+        }
+        offset += len;
+    }
+    return size;
+}
+
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -354,12 +379,30 @@ static const QEMUFileOps socket_read_ops = {
     .close =      socket_close
 };
 
-QEMUFile *qemu_fopen_socket(int fd)
+static const QEMUFileOps socket_write_ops = {
+    .get_fd =        socket_get_fd,
+    .writev_buffer = socket_writev_buffer,
+    .close =         socket_close
+};
+
+QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
-    QEMUFileSocket *s = g_malloc0(sizeof(QEMUFileSocket));
+    QEMUFileSocket *s;
 
+    if (mode == NULL ||
+        (mode[0] != 'r' && mode[0] != 'w') ||
+        mode[1] != 'b' || mode[2] != 0) {
+        fprintf(stderr, "qemu_fopen_socket: Argument validity check failed\n");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileSocket));
     s->fd = fd;
-    s->file = qemu_fopen_ops(s, &socket_read_ops);
+    if (mode[0] == 'w') {
+        s->file = qemu_fopen_ops(s, &socket_write_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &socket_read_ops);
+    }
     return s->file;
 }
 
@@ -391,40 +434,172 @@ fail:
     return NULL;
 }
 
-static int block_put_buffer(void *opaque, const uint8_t *buf,
-                           int64_t pos, int size)
+/* The vmstate area of a snapshot is written and read in chunks of
+ * VMSTATE_CHUNK_SIZE, aligned to their own size, rather than IO_BUF_SIZE at
+ * a time.  Each write that grows the vmstate area of a qcow2 image
+ * allocates clusters and updates metadata, so fewer and larger writes cost
+ * much less, and large reads keep the disk busy while RAM is restored.
+ */
+#define VMSTATE_CHUNK_SIZE (1 << 20)
+
+typedef struct QEMUFileBdrv {
+    BlockDriverState *bs;
+    uint8_t *buf;           /* VMSTATE_CHUNK_SIZE bytes */
+    int64_t buf_pos;        /* vmstate offset of buf[0] */
+    size_t buf_len;         /* bytes to write, or valid bytes read */
+} QEMUFileBdrv;
+
+static int bdrv_flush_chunk(QEMUFileBdrv *s)
+{
+    int ret;
+
+    if (!s->buf_len) {
+        return 0;
+    }
+    ret = bdrv_save_vmstate(s->bs, s->buf, s->buf_pos, s->buf_len);
+    if (ret < 0) {
+        return ret;
+    }
+    s->buf_pos += s->buf_len;
+    s->buf_len = 0;
+    return 0;
+}
+
+static ssize_t block_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                   int64_t pos)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
+    QEMUFileBdrv *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    int ret;
+
+    /* the stream is written sequentially */
+    assert(pos == s->buf_pos + s->buf_len);
+
+    while (done < size) {
+        size_t len = MIN(size - done, VMSTATE_CHUNK_SIZE - s->buf_len);
+
+        iov_to_buf(iov, iovcnt, done, s->buf + s->buf_len, len);
+        s->buf_len += len;
+        done += len;
+        if (s->buf_len == VMSTATE_CHUNK_SIZE) {
+            ret = bdrv_flush_chunk(s);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
     return size;
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    return bdrv_load_vmstate(opaque, buf, pos, size);
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    if (pos < s->buf_pos || pos >= s->buf_pos + s->buf_len) {
+        s->buf_pos = pos & ~(int64_t)(VMSTATE_CHUNK_SIZE - 1);
+        s->buf_len = 0;
+        ret = bdrv_load_vmstate(s->bs, s->buf, s->buf_pos, VMSTATE_CHUNK_SIZE);
+        if (ret < 0) {
+            /* some drivers cannot read past the end of the saved state */
+            return bdrv_load_vmstate(s->bs, buf, pos, size);
+        }
+        s->buf_len = ret;
+        if (pos >= s->buf_pos + s->buf_len) {
+            return 0;
+        }
+    }
+
+    size = MIN(size, s->buf_pos + s->buf_len - pos);
+    memcpy(buf, s->buf + (pos - s->buf_pos), size);
+    return size;
+}
+
+static int bdrv_fclose_read(void *opaque)
+{
+    QEMUFileBdrv *s = opaque;
+
+    /* the buffer holds state that was read, never write it back */
+    qemu_vfree(s->buf);
+    g_free(s);
+    return 0;
 }
 
-static int bdrv_fclose(void *opaque)
+static int bdrv_fclose_write(void *opaque)
 {
-    return bdrv_flush(opaque);
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    ret = bdrv_flush_chunk(s);
+    if (ret >= 0) {
+        ret = bdrv_flush(s->bs);
+    }
+    qemu_vfree(s->buf);
+    g_free(s);
+    return ret;
 }
 
 static const QEMUFileOps bdrv_read_ops = {
     .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .close =      bdrv_fclose_read
 };
 
 static const QEMUFileOps bdrv_write_ops = {
-    .put_buffer = block_put_buffer,
-    .close =      bdrv_fclose
+    .writev_buffer = block_writev_buffer,
+    .close =         bdrv_fclose_write
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
+    QEMUFileBdrv *s = g_malloc0(sizeof(*s));
+
+    s->bs = bs;
+    s->buf = qemu_blockalign(bs, VMSTATE_CHUNK_SIZE);
     if (is_writable)
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
-    return qemu_fopen_ops(bs, &bdrv_read_ops);
+        return qemu_fopen_ops(s, &bdrv_write_ops);
+    return qemu_fopen_ops(s, &bdrv_read_ops);
+}
+
+/* A QEMUFile in memory, for state that has to be sent or loaded in one
+ * piece.  The caller owns the data.
+ */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    b->data = g_realloc(b->data, b->size + size);
+    memcpy(b->data + b->size, buf, size);
+    b->size += size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (pos >= b->size) {
+        return 0;
+    }
+    size = MIN(size, b->size - pos);
+    memcpy(buf, b->data + pos, size);
+    return size;
 }
 
+static const QEMUFileOps buffer_read_ops = {
+    .get_buffer = buffer_get_buffer,
+};
+
+static const QEMUFileOps buffer_write_ops = {
+    .put_buffer = buffer_put_buffer,
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -453,14 +628,26 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 /** Flushes QEMUFile buffer
  *
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
-    if (!f->ops->put_buffer)
+    if (!f->ops->put_buffer && !f->ops->writev_buffer)
         return 0;
 
-    if (f->is_write && f->buf_index > 0) {
+    if (f->is_write && f->ops->writev_buffer) {
+        if (f->iovcnt > 0) {
+            size_t size = iov_size(f->iov, f->iovcnt);
+
+            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                        f->buf_offset);
+            if (ret >= 0) {
+                f->buf_offset += size;
+            }
+        }
+        f->buf_index = 0;
+        f->iovcnt = 0;
+    } else if (f->is_write && f->buf_index > 0) {
         ret = f->ops->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
         if (ret >= 0) {
             f->buf_offset += f->buf_index;
@@ -536,6 +723,56 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
+/* Queue @size bytes at @buf for the next writev_buffer call, merging them
+ * with the previous entry when the two are contiguous in memory.
+ */
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (f->iovcnt > 0 &&
+        (uint8_t *)f->iov[f->iovcnt - 1].iov_base +
+        f->iov[f->iovcnt - 1].iov_len == buf) {
+        f->iov[f->iovcnt - 1].iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+}
+
+static void qemu_put_flush_if_full(QEMUFile *f)
+{
+    if (f->buf_index >= IO_BUF_SIZE || f->iovcnt >= QEMU_FILE_MAX_IOV) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->ops->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (size > 0) {
+        f->is_write = 1;
+        add_to_iovec(f, buf, size);
+        qemu_put_flush_if_full(f);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -556,15 +793,15 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
+        if (f->ops->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index, l);
+        }
         f->buf_index += l;
         buf += l;
         size -= l;
-        if (f->buf_index >= IO_BUF_SIZE) {
-            int ret = qemu_fflush(f);
-            if (ret < 0) {
-                qemu_file_set_error(f, ret);
-                break;
-            }
+        qemu_put_flush_if_full(f);
+        if (f->last_error) {
+            break;
         }
     }
 }
@@ -581,14 +818,13 @@ void qemu_put_byte(QEMUFile *f, int v)
         abort();
     }
 
-    f->buf[f->buf_index++] = v;
+    f->buf[f->buf_index] = v;
     f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE) {
-        int ret = qemu_fflush(f);
-        if (ret < 0) {
-            qemu_file_set_error(f, ret);
-        }
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index, 1);
     }
+    f->buf_index++;
+    qemu_put_flush_if_full(f);
 }
 
 static void qemu_file_skip(QEMUFile *f, int size)
@@ -676,7 +912,10 @@ int qemu_get_byte(QEMUFile *f)
 int64_t qemu_ftell(QEMUFile *f)
 {
     /* buf_offset excludes buffer for writing but includes it for reading */
-    if (f->is_write) {
+    if (f->is_write && f->ops->writev_buffer) {
+        /* the pending vector covers buf as well as referenced memory */
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
+    } else if (f->is_write) {
         return f->buf_offset + f->buf_index;
     } else {
         return f->buf_offset - f->buf_size + f->buf_index;
@@ -1203,6 +1442,10 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* state written by the last incremental xen-save-devices-state */
+    uint8_t *xen_state;
+    size_t xen_state_len;
+    bool xen_state_saved;
 } SaveStateEntry;
 
 
@@ -1329,6 +1572,7 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
             if (se->compat) {
                 g_free(se->compat);
             }
+            g_free(se->xen_state);
             g_free(se->ops);
             g_free(se);
         }
@@ -1398,6 +1642,7 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
             if (se->compat) {
                 g_free(se->compat);
             }
+            g_free(se->xen_state);
             g_free(se);
         }
     }
@@ -1566,6 +1811,11 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
+#define QEMU_VM_STATE_ID             0x07
+
+/* Device state without RAM takes a few megabytes at most */
+#define QEMU_VM_POSTCOPY_PACKAGE_MAX (256 << 20)
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1683,13 +1933,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_live_complete(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1710,6 +1958,12 @@ int qemu_savevm_state_complete(QEMUFile *f)
             return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_device_sections(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1735,6 +1989,59 @@ int qemu_savevm_state_complete(QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_live_complete(f);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_savevm_device_sections(f);
+
+    return qemu_file_get_error(f);
+}
+
+/* Switch a migration to post-copy.  The live sections end as usual, except
+ * that RAM only lists the pages it has not sent.  The device state follows
+ * as a single package: the destination starts receiving the rest of the
+ * stream, which carries those pages, before it loads the package, because
+ * loading device state may touch any of them.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    QEMUFileBuffer b = { NULL, 0 };
+    QEMUFile *pkg;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_live_complete(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pkg = qemu_fopen_ops(&b, &buffer_write_ops);
+    qemu_savevm_device_sections(pkg);
+    ret = qemu_fclose(pkg);
+    if (ret == 0 && b.size > QEMU_VM_POSTCOPY_PACKAGE_MAX) {
+        fprintf(stderr, "Device state too large for post-copy: %zu bytes\n",
+                b.size);
+        ret = -EFBIG;
+    }
+    if (ret < 0) {
+        g_free(b.data);
+        return ret;
+    }
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, b.size);
+    qemu_put_buffer(f, b.data, b.size);
+    g_free(b.data);
 
     return qemu_file_get_error(f);
 }
@@ -1802,7 +2109,13 @@ out:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+/* With a non-zero @id, the state is part of a chain of incremental saves:
+ * the file is tagged with @id and, if @parent is not zero, only holds the
+ * devices whose state changed since the save tagged @parent.  Each device
+ * is serialized into memory and compared with what the previous save of
+ * the chain wrote for it.
+ */
+static int qemu_save_device_state(QEMUFile *f, uint64_t id, uint64_t parent)
 {
     SaveStateEntry *se;
 
@@ -1811,7 +2124,14 @@ static int qemu_save_device_state(QEMUFile *f)
 
     cpu_synchronize_all_states();
 
+    if (id) {
+        qemu_put_byte(f, QEMU_VM_STATE_ID);
+        qemu_put_be64(f, id);
+        qemu_put_be64(f, parent);
+    }
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        QEMUFileBuffer b = { NULL, 0 };
         int len;
 
         if (se->is_ram) {
@@ -1821,6 +2141,24 @@ static int qemu_save_device_state(QEMUFile *f)
             continue;
         }
 
+        if (id) {
+            QEMUFile *sf = qemu_fopen_ops(&b, &buffer_write_ops);
+            int ret;
+
+            vmstate_save(sf, se);
+            ret = qemu_fclose(sf);
+            if (ret < 0) {
+                g_free(b.data);
+                return ret;
+            }
+            if (parent && se->xen_state_saved &&
+                se->xen_state_len == b.size &&
+                !memcmp(se->xen_state, b.data, b.size)) {
+                g_free(b.data);
+                continue;
+            }
+        }
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -1833,7 +2171,15 @@ static int qemu_save_device_state(QEMUFile *f)
         qemu_put_be32(f, se->instance_id);
         qemu_put_be32(f, se->version_id);
 
-        vmstate_save(f, se);
+        if (id) {
+            qemu_put_buffer(f, b.data, b.size);
+            g_free(se->xen_state);
+            se->xen_state = b.data;
+            se->xen_state_len = b.size;
+            se->xen_state_saved = true;
+        } else {
+            vmstate_save(f, se);
+        }
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -1941,31 +2287,20 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_postcopy_package(QEMUFile *f,
+                                        LoadStateEntryList *handlers);
+
+/* Load sections until QEMU_VM_EOF.  Returns 1 if the migration switched to
+ * post-copy, in which case the rest of @f belongs to the RAM code.
+ */
+static int qemu_loadvm_sections(QEMUFile *f, LoadStateEntryList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
+    LoadStateEntry *le;
     uint8_t section_type;
-    unsigned int v;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
-    }
-
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
-
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -1987,16 +2322,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -2005,56 +2338,167 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            return qemu_loadvm_postcopy_package(f, handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
+    return 0;
+}
 
-    cpu_synchronize_all_post_init();
+/* See qemu_savevm_state_postcopy() */
+static int qemu_loadvm_postcopy_package(QEMUFile *f,
+                                        LoadStateEntryList *handlers)
+{
+    QEMUFileBuffer b;
+    QEMUFile *pkg;
+    int ret;
+
+    b.size = qemu_get_be32(f);
+    if (b.size > QEMU_VM_POSTCOPY_PACKAGE_MAX) {
+        fprintf(stderr, "Post-copy package too large: %zu bytes\n", b.size);
+        return -EINVAL;
+    }
+    b.data = g_malloc(b.size);
+    qemu_get_buffer(f, b.data, b.size);
+    ret = qemu_file_get_error(f);
+    if (ret == 0) {
+        ret = ram_postcopy_incoming_start(f);
+    }
+    if (ret < 0) {
+        g_free(b.data);
+        return ret;
+    }
+
+    pkg = qemu_fopen_ops(&b, &buffer_read_ops);
+    ret = qemu_loadvm_sections(pkg, handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(pkg);
+    } else if (ret > 0) {
+        fprintf(stderr, "Nested post-copy package\n");
+        ret = -EINVAL;
+    }
+    qemu_fclose(pkg);
+    g_free(b.data);
 
-    ret = 0;
+    return ret < 0 ? ret : 1;
+}
+
+/* Tag of the incremental device state loaded last, 0 if the state loaded
+ * last was not part of a chain or the VM ran since, see
+ * qemu_save_device_state()
+ */
+static uint64_t loadvm_state_id;
+static VMChangeStateEntry *loadvm_state_id_entry;
+
+/* Once the guest runs, the state it started from is gone */
+static void loadvm_state_id_vm_change(void *opaque, int running,
+                                      RunState state)
+{
+    if (running) {
+        loadvm_state_id = 0;
+    }
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    uint64_t id = 0;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    if (qemu_peek_byte(f, 0) == QEMU_VM_STATE_ID) {
+        uint64_t parent;
+
+        qemu_get_byte(f);
+        id = qemu_get_be64(f);
+        parent = qemu_get_be64(f);
+        if (parent && parent != loadvm_state_id) {
+            fprintf(stderr, "Device state %016" PRIx64 " only holds the "
+                    "changes since %016" PRIx64 ", which was not loaded "
+                    "last or the VM ran since\n", id, parent);
+            return -EINVAL;
+        }
+    }
+    loadvm_state_id = 0;
+
+    ret = qemu_loadvm_sections(f, &loadvm_handlers);
+    if (ret < 0) {
+        goto out;
+    }
+
+    cpu_synchronize_all_post_init();
 
 out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         g_free(le);
     }
+    ram_decompress_threads_join();
+    ram_channels_join();
 
+    /* after a switch to post-copy, another thread reads @f */
     if (ret == 0) {
         ret = qemu_file_get_error(f);
+    } else if (ret > 0) {
+        ret = 0;
+    }
+    if (ret == 0) {
+        loadvm_state_id = id;
+        if (id && !loadvm_state_id_entry) {
+            loadvm_state_id_entry = qemu_add_vm_change_state_handler(
+                loadvm_state_id_vm_change, NULL);
+        }
     }
 
     return ret;
@@ -2206,11 +2650,16 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         vm_start();
 }
 
-void qmp_xen_save_devices_state(const char *filename, Error **errp)
+/* Tag of the last successful incremental save, 0 if there is none */
+static uint64_t xen_state_id;
+
+void qmp_xen_save_devices_state(const char *filename, bool has_incremental,
+                                bool incremental, Error **errp)
 {
     QEMUFile *f;
     int saved_vm_running;
-    int ret;
+    uint64_t id = 0, parent = 0;
+    int ret, ret2;
 
     saved_vm_running = runstate_is_running();
     vm_stop(RUN_STATE_SAVE_VM);
@@ -2220,10 +2669,23 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
         error_set(errp, QERR_OPEN_FILE_FAILED, filename);
         goto the_end;
     }
-    ret = qemu_save_device_state(f);
-    qemu_fclose(f);
+    if (has_incremental && incremental) {
+        parent = xen_state_id;
+        do {
+            id = ((uint64_t)g_random_int() << 32) | g_random_int();
+        } while (!id || id == parent);
+        /* the chain is broken until this save succeeds */
+        xen_state_id = 0;
+    }
+    ret = qemu_save_device_state(f, id, parent);
+    ret2 = qemu_fclose(f);
+    if (ret >= 0) {
+        ret = ret2;
+    }
     if (ret < 0) {
         error_set(errp, QERR_IO_ERROR);
+    } else if (id) {
+        xen_state_id = id;
     }
 
  the_end:
@@ -2231,6 +2693,28 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
         vm_start();
 }
 
+void qmp_xen_load_devices_state(const char *filename, Error **errp)
+{
+    QEMUFile *f;
+    int ret;
+
+    if (runstate_is_running()) {
+        error_setg(errp, "Cannot load the device state while the VM runs");
+        return;
+    }
+
+    f = qemu_fopen(filename, "rb");
+    if (!f) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        return;
+    }
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -18,14 +18,16 @@
 
 import os
 import re
+import socket
 import subprocess
 import string
+import time
 import unittest
 import sys; sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'QMP'))
 import qmp
 
 __all__ = ['imgfmt', 'imgproto', 'test_dir' 'qemu_img', 'qemu_io',
-           'VM', 'QMPTestCase', 'notrun', 'main']
+           'VM', 'QMPTestCase', 'MigrationTestCase', 'notrun', 'main']
 
 # This will not work if arguments or path contain spaces but is necessary if we
 # want to support the override options that ./check supports.
@@ -54,9 +56,14 @@ def qemu_io(*args):
 class VM(object):
     '''A QEMU VM'''
 
-    def __init__(self):
-        self._monitor_path = os.path.join(test_dir, 'qemu-mon.%d' % os.getpid())
-        self._qemu_log_path = os.path.join(test_dir, 'qemu-log.%d' % os.getpid())
+    def __init__(self, path_suffix=''):
+        self._monitor_path = os.path.join(test_dir, 'qemu-mon%s.%d' %
+                                          (path_suffix, os.getpid()))
+        self._qemu_log_path = os.path.join(test_dir, 'qemu-log%s.%d' %
+                                           (path_suffix, os.getpid()))
+        self._qtest_path = os.path.join(test_dir, 'qemu-qtest%s.%d' %
+                                        (path_suffix, os.getpid()))
+        self._qtest_socket = False
         self._args = qemu_args + ['-chardev',
                      'socket,id=mon,path=' + self._monitor_path,
                      '-mon', 'chardev=mon,mode=control',
@@ -64,9 +71,9 @@ class VM(object):
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
 
-    def add_drive(self, path, opts=''):
-        '''Add a virtio-blk drive to the VM'''
-        options = ['if=virtio',
+    def add_drive(self, path, opts='', interface='virtio'):
+        '''Add a drive to the VM, a virtio-blk one by default'''
+        options = ['if=%s' % interface,
                    'format=%s' % imgfmt,
                    'cache=none',
                    'file=%s' % path,
@@ -79,6 +86,12 @@ class VM(object):
         self._num_drives += 1
         return self
 
+    def add_device(self, opts):
+        '''Add a device to the VM, e.g. for a drive with no interface'''
+        self._args.append('-device')
+        self._args.append(opts)
+        return self
+
     def add_fd(self, fd, fdset, opaque, opts=''):
         '''Pass a file descriptor to the VM'''
         options = ['fd=%d' % fd,
@@ -91,6 +104,19 @@ class VM(object):
         self._args.append(','.join(options))
         return self
 
+    def add_qtest_socket(self):
+        '''Take qtest commands on a Unix socket instead of stdin, see qtest()'''
+        i = self._args.index('-qtest')
+        self._args[i + 1] = 'unix:%s,server,nowait' % self._qtest_path
+        self._qtest_socket = True
+        return self
+
+    def add_incoming(self, addr):
+        '''Make the VM wait for an incoming migration on addr'''
+        self._args.append('-incoming')
+        self._args.append(addr)
+        return self
+
     def launch(self):
         '''Launch the VM and establish a QMP connection'''
         devnull = open('/dev/null', 'rb')
@@ -104,9 +130,19 @@ class VM(object):
             os.remove(self._monitor_path)
             raise
 
+        # QMP answers once the main loop runs, qtest listens by then
+        if self._qtest_socket:
+            self._qtest = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self._qtest.connect(self._qtest_path)
+            self._qtest_file = self._qtest.makefile('r')
+
     def shutdown(self):
         '''Terminate the VM and clean up'''
         if not self._popen is None:
+            if self._qtest_socket:
+                self._qtest_file.close()
+                self._qtest.close()
+                os.remove(self._qtest_path)
             self._qmp.cmd('quit')
             self._popen.wait()
             os.remove(self._monitor_path)
@@ -122,6 +158,21 @@ class VM(object):
 
         return self._qmp.cmd(cmd, args=qmp_args)
 
+    def qtest(self, cmd):
+        '''Send a qtest command and return its reply'''
+        return self.qtest_batch([cmd])[0]
+
+    def qtest_batch(self, cmds):
+        '''Send many qtest commands and return their replies'''
+        replies = []
+        # a few at a time, or QEMU would block writing the replies
+        for i in range(0, len(cmds), 1024):
+            chunk = cmds[i:i + 1024]
+            self._qtest.sendall(''.join(cmd + '\n' for cmd in chunk))
+            for cmd in chunk:
+                replies.append(self._qtest_file.readline().strip())
+        return replies
+
     def get_qmp_event(self, wait=False):
         '''Poll for one queued QMP events and return it'''
         return self._qmp.pull_event(wait=wait)
@@ -170,6 +221,90 @@ class QMPTestCase(unittest.TestCase):
         result = self.dictpath(d, path)
         self.assertEqual(result, value, 'values not equal "%s" and "%s"' % (str(result), str(value)))
 
+class MigrationTestCase(QMPTestCase):
+    '''Abstract base class for tests that migrate a VM, vm_src, to another
+    one on the same host, vm_dst.  Both VMs take qtest commands.'''
+
+    migration_sock = os.path.join(test_dir, 'migrate.sock')
+    migration_uri = 'unix:' + migration_sock
+
+    # URI that vm_dst is started with by setUp(), None to not start it
+    incoming = migration_uri
+
+    page_size = 4096
+
+    def create_vm(self, path_suffix):
+        '''Return the source or destination VM, override to add drives'''
+        return VM(path_suffix=path_suffix).add_qtest_socket()
+
+    def setUp(self):
+        self.vm_src = self.create_vm('-src')
+        self.vm_src.launch()
+        self.vm_dst = None
+        if self.incoming:
+            self.launch_dst(self.incoming)
+
+    def tearDown(self):
+        self.vm_src.shutdown()
+        if self.vm_dst:
+            self.vm_dst.shutdown()
+        if os.path.exists(self.migration_sock):
+            os.remove(self.migration_sock)
+
+    def launch_dst(self, uri):
+        self.vm_dst = self.create_vm('-dst').add_incoming(uri)
+        self.vm_dst.launch()
+
+    def set_capabilities(self, caps):
+        '''Set migration capabilities of vm_src from a name -> bool dict'''
+        capabilities = [{ 'capability': cap, 'state': state }
+                        for cap, state in caps.items()]
+        result = self.vm_src.qmp('migrate-set-capabilities',
+                                 capabilities=capabilities)
+        self.assert_qmp(result, 'return', {})
+
+    def migrate(self, uri=None, **args):
+        result = self.vm_src.qmp('migrate', uri=uri or self.migration_uri,
+                                 **args)
+        self.assert_qmp(result, 'return', {})
+
+    def wait_migration(self):
+        '''Wait for the migration to end, return the last query-migrate'''
+        while True:
+            result = self.vm_src.qmp('query-migrate')
+            if result['return']['status'] not in ('active', 'postcopy-active'):
+                return result
+            time.sleep(0.1)
+
+    def migrate_and_wait(self, uri=None, **args):
+        self.migrate(uri, **args)
+        result = self.wait_migration()
+        self.assert_qmp(result, 'return/status', 'completed')
+        return result
+
+    def assert_dst_running(self):
+        '''vm_dst starts once it has loaded the state of the devices'''
+        for i in range(100):
+            result = self.vm_dst.qmp('query-status')
+            if result['return']['status'] != 'inmigrate':
+                break
+            time.sleep(0.1)
+        self.assert_qmp(result, 'return/status', 'running')
+
+    def write_pages(self, vm, addr, pages, seed=0):
+        '''Write a word, different for each page, to the given pages from
+        guest physical address addr'''
+        replies = vm.qtest_batch(['write 0x%x 4 0x%08x' %
+                                  (addr + i * self.page_size, seed + i)
+                                  for i in pages])
+        self.assertEqual(replies, ['OK'] * len(replies))
+
+    def assert_pages(self, vm, addr, pages, seed=0):
+        '''Check the words that write_pages() wrote, in the order given'''
+        replies = vm.qtest_batch(['read 0x%x 4' % (addr + i * self.page_size)
+                                  for i in pages])
+        self.assertEqual(replies, ['OK 0x%08x' % (seed + i) for i in pages])
+
 def notrun(reason):
     '''Skip this test suite'''
     # Each test in qemu-iotests has a number ("seq")
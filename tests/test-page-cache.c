@@ -0,0 +1,137 @@
+/*
+ * Set-associative page cache unit-tests.
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* With 64 pages there are 8 sets, so these addresses all share a set */
+#define CACHE_PAGES 64
+#define SET_ADDR(i) ((uint64_t)(i) * (CACHE_PAGES / PAGE_CACHE_WAYS) * PAGE_SIZE)
+
+static uint8_t *new_page(uint64_t addr)
+{
+    return g_memdup(&addr, sizeof(addr));
+}
+
+static uint64_t page_addr(PageCache *cache, uint64_t addr)
+{
+    uint64_t val;
+
+    memcpy(&val, get_cached_data(cache, addr), sizeof(val));
+    return val;
+}
+
+static void test_page_cache_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr));
+        cache_insert(cache, addr, new_page(addr));
+    }
+
+    /* A cache as large as the working set holds all of it */
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        g_assert_cmpint(page_addr(cache, addr), ==, addr);
+    }
+    g_assert(get_cached_data(cache, CACHE_PAGES * PAGE_SIZE) == NULL);
+
+    /* Inserting again replaces the data */
+    cache_insert(cache, 0, new_page(42));
+    g_assert_cmpint(page_addr(cache, 0), ==, 42);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_page_cache_lru(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    int i;
+
+    /* One page more than the set can hold: the first one is evicted */
+    for (i = 0; i <= PAGE_CACHE_WAYS; i++) {
+        cache_insert(cache, SET_ADDR(i), new_page(SET_ADDR(i)));
+    }
+    g_assert(!cache_is_cached(cache, SET_ADDR(0)));
+    for (i = 1; i <= PAGE_CACHE_WAYS; i++) {
+        g_assert(cache_is_cached(cache, SET_ADDR(i)));
+    }
+
+    /* A hit makes the page the most recently used one */
+    g_assert(cache_is_cached(cache, SET_ADDR(1)));
+    cache_insert(cache, SET_ADDR(0), new_page(SET_ADDR(0)));
+    g_assert(cache_is_cached(cache, SET_ADDR(1)));
+    g_assert(!cache_is_cached(cache, SET_ADDR(2)));
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.ways, ==, PAGE_CACHE_WAYS);
+    g_assert_cmpint(stats.evictions, ==, 2);
+    g_assert_cmpint(stats.misses, ==, 2);
+    g_assert_cmpint(stats.hits, ==, PAGE_CACHE_WAYS + 2);
+    /* Walking the set in insertion order always hits the least recently
+     * used page, the last lookup came right after SET_ADDR(0) */
+    g_assert_cmpint(stats.way_hits[PAGE_CACHE_WAYS - 1], ==,
+                    PAGE_CACHE_WAYS + 1);
+    g_assert_cmpint(stats.way_hits[1], ==, 1);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_page_cache_resize(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint64_t addr;
+    int n;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        cache_insert(cache, addr, new_page(addr));
+    }
+
+    /* Growing keeps every page */
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES * 4), ==, CACHE_PAGES * 4);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        g_assert_cmpint(page_addr(cache, addr), ==, addr);
+    }
+
+    /* Shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 17), ==, 16);
+    n = 0;
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (get_cached_data(cache, addr)) {
+            g_assert_cmpint(page_addr(cache, addr), ==, addr);
+            g_assert_cmpint(addr, >=, (CACHE_PAGES - 16) * PAGE_SIZE);
+            n++;
+        }
+    }
+    g_assert_cmpint(n, ==, 16);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert", test_page_cache_insert);
+    g_test_add_func("/page-cache/lru", test_page_cache_lru);
+    g_test_add_func("/page-cache/resize", test_page_cache_resize);
+    g_test_run();
+
+    return 0;
+}
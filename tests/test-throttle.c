@@ -0,0 +1,191 @@
+/*
+ * Token bucket throttling unit-tests.
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/throttle.h"
+
+#define NS_PER_SEC  1000000000LL
+
+/* Submit @count requests of @bytes each as fast as the throttle allows and
+ * return the simulated time at which the last one was submitted.
+ */
+static int64_t simulate(ThrottleState *ts, bool is_write, uint64_t bytes,
+                        int count)
+{
+    int64_t now = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int64_t wait;
+
+        while ((wait = throttle_compute_wait(ts, is_write, now)) > 0) {
+            now += wait;
+        }
+        throttle_account(ts, is_write, bytes);
+    }
+    return now;
+}
+
+static void test_throttle_disabled(void)
+{
+    ThrottleState ts;
+
+    memset(&ts, 0, sizeof(ts));
+    g_assert(!throttle_enabled(&ts));
+    g_assert_cmpint(simulate(&ts, false, 1 << 20, 1000), ==, 0);
+
+    throttle_set_limit(&ts, THROTTLE_BPS_WRITE, 1000, 0);
+    g_assert(throttle_enabled(&ts));
+    throttle_set_limit(&ts, THROTTLE_BPS_WRITE, 0, 0);
+    g_assert(!throttle_enabled(&ts));
+}
+
+static void test_throttle_rate(void)
+{
+    ThrottleState ts;
+    int64_t end;
+
+    /* 1 MB/s, 100 requests of 64 KB: 6.4 MB -> about 6.4 seconds */
+    memset(&ts, 0, sizeof(ts));
+    throttle_set_limit(&ts, THROTTLE_BPS_TOTAL, 1000000, 0);
+    end = simulate(&ts, false, 64000, 100);
+    g_assert_cmpint(end, >=, 6.3 * NS_PER_SEC);
+    g_assert_cmpint(end, <=, 6.4 * NS_PER_SEC);
+
+    /* 100 IOPS, 1000 requests -> about 10 seconds */
+    memset(&ts, 0, sizeof(ts));
+    throttle_set_limit(&ts, THROTTLE_OPS_TOTAL, 100, 0);
+    end = simulate(&ts, true, 512, 1000);
+    g_assert_cmpint(end, >=, 9.9 * NS_PER_SEC);
+    g_assert_cmpint(end, <=, 10 * NS_PER_SEC);
+}
+
+static void test_throttle_burst(void)
+{
+    ThrottleState ts;
+    int64_t wait;
+    int i;
+
+    /* 10 IOPS with a burst of 50: the first 51 requests go through at once */
+    memset(&ts, 0, sizeof(ts));
+    throttle_set_limit(&ts, THROTTLE_OPS_TOTAL, 10, 50);
+    for (i = 0; i <= 50; i++) {
+        g_assert_cmpint(throttle_compute_wait(&ts, false, 0), ==, 0);
+        throttle_account(&ts, false, 4096);
+    }
+
+    /* ...then the bucket has to drain one request worth of level */
+    wait = throttle_compute_wait(&ts, false, 0);
+    g_assert_cmpint(wait, ==, NS_PER_SEC / 10);
+
+    /* After idling for the whole burst, it is available again */
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 6 * NS_PER_SEC), ==, 0);
+    for (i = 0; i < 50; i++) {
+        g_assert_cmpint(throttle_compute_wait(&ts, false, 6 * NS_PER_SEC),
+                        ==, 0);
+        throttle_account(&ts, false, 4096);
+    }
+}
+
+static void test_throttle_read_write(void)
+{
+    ThrottleState ts;
+
+    /* A write limit does not delay reads and vice versa */
+    memset(&ts, 0, sizeof(ts));
+    throttle_set_limit(&ts, THROTTLE_BPS_WRITE, 1000, 0);
+    throttle_set_limit(&ts, THROTTLE_OPS_READ, 1, 0);
+
+    throttle_account(&ts, true, 1000000);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 0), ==, 0);
+    g_assert_cmpint(throttle_compute_wait(&ts, true, 0), >, 0);
+
+    throttle_account(&ts, false, 1);
+    throttle_account(&ts, false, 1);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 0), >, 0);
+
+    /* The total bucket applies to both directions */
+    memset(&ts, 0, sizeof(ts));
+    throttle_set_limit(&ts, THROTTLE_BPS_TOTAL, 1000, 0);
+    throttle_account(&ts, true, 1000000);
+    g_assert_cmpint(throttle_compute_wait(&ts, false, 0), >, 0);
+    g_assert_cmpint(throttle_compute_wait(&ts, true, 0), >, 0);
+}
+
+static void test_throttle_group(void)
+{
+    static const uint64_t bytes[2] = { 64000, 4000 };
+    ThrottleState dev[2], group;
+    int64_t ready[2] = { 0, 0 };
+    int seq[2] = { 0, 1 };
+    uint64_t done[2] = { 0, 0 };
+    int ops[2] = { 0, 0 };
+    int64_t now = 0;
+    int counter = 2;
+
+    /* Two devices sharing a 1 MB/s group quota keep issuing requests, one
+     * of 64 KB and the other of 4 KB each.  Like the block layer, a device
+     * that has to wait arms a timer, timers that expire at the same time run
+     * in the order they were armed, and a device that got through only
+     * tries its next request after the timers that were already due.
+     */
+    memset(dev, 0, sizeof(dev));
+    memset(&group, 0, sizeof(group));
+    throttle_set_limit(&dev[0], THROTTLE_BPS_TOTAL, 10000000, 0);
+    throttle_set_limit(&dev[1], THROTTLE_BPS_TOTAL, 10000000, 0);
+    throttle_set_limit(&group, THROTTLE_BPS_TOTAL, 1000000, 0);
+
+    for (;;) {
+        int i = (ready[0] < ready[1] ||
+                 (ready[0] == ready[1] && seq[0] < seq[1])) ? 0 : 1;
+        int64_t wait;
+
+        now = ready[i];
+        if (now > 10 * NS_PER_SEC) {
+            break;
+        }
+
+        wait = MAX(throttle_compute_wait(&dev[i], false, now),
+                   throttle_compute_wait(&group, false, now));
+        seq[i] = counter++;
+        if (wait) {
+            ready[i] = now + wait;
+            continue;
+        }
+
+        throttle_account(&dev[i], false, bytes[i]);
+        throttle_account(&group, false, bytes[i]);
+        done[i] += bytes[i];
+        ops[i]++;
+    }
+
+    /* Neither device is starved: they take turns despite the unequal loads */
+    g_assert_cmpint(ops[1], >, 100);
+    g_assert_cmpint(ops[0] * 10, >=, ops[1] * 9);
+    g_assert_cmpint(ops[1] * 10, >=, ops[0] * 9);
+
+    /* Together they stay within the group rate */
+    g_assert_cmpint(done[0] + done[1], <=,
+                    1000000.0 * now / NS_PER_SEC + 1000 + bytes[0]);
+    g_assert_cmpint(done[0] + done[1], >=, 0.99 * 1000000 * 10);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/disabled", test_throttle_disabled);
+    g_test_add_func("/throttle/rate", test_throttle_rate);
+    g_test_add_func("/throttle/burst", test_throttle_burst);
+    g_test_add_func("/throttle/read-write", test_throttle_read_write);
+    g_test_add_func("/throttle/group", test_throttle_group);
+    g_test_run();
+
+    return 0;
+}
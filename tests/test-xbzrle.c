@@ -179,6 +179,289 @@ static void test_encode_decode(void)
     }
 }
 
+/* Page change patterns seen when migrating desktop guests */
+typedef enum {
+    PATTERN_SPARSE,     /* a few scattered bytes */
+    PATTERN_WORDS,      /* counters and pointers updated in place */
+    PATTERN_CLUSTER,    /* one contiguous region rewritten */
+    PATTERN_DENSE,      /* most of the page rewritten, overflows */
+    PATTERN_MAX,
+} XbzrlePattern;
+
+static const char *pattern_names[PATTERN_MAX] = {
+    [PATTERN_SPARSE] = "sparse",
+    [PATTERN_WORDS] = "words",
+    [PATTERN_CLUSTER] = "cluster",
+    [PATTERN_DENSE] = "dense",
+};
+
+static void fill_random(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* Copy @old to @new and apply @pattern to @new */
+static void make_page(XbzrlePattern pattern, const uint8_t *old, uint8_t *new)
+{
+    int i, n, start;
+
+    memcpy(new, old, PAGE_SIZE);
+
+    switch (pattern) {
+    case PATTERN_SPARSE:
+        n = g_test_rand_int_range(1, 16);
+        for (i = 0; i < n; i++) {
+            new[g_test_rand_int_range(0, PAGE_SIZE)] ^= 0x5a;
+        }
+        break;
+    case PATTERN_WORDS:
+        n = g_test_rand_int_range(1, 64);
+        for (i = 0; i < n; i++) {
+            uint64_t *word = (uint64_t *)new +
+                             g_test_rand_int_range(0, PAGE_SIZE / 8);
+            *word += g_test_rand_int_range(1, 1000);
+        }
+        break;
+    case PATTERN_CLUSTER:
+        n = g_test_rand_int_range(64, 1024);
+        start = g_test_rand_int_range(0, PAGE_SIZE - n);
+        for (i = start; i < start + n; i++) {
+            new[i] = ~old[i];
+        }
+        break;
+    case PATTERN_DENSE:
+        for (i = 0; i < PAGE_SIZE; i += 2) {
+            new[i] = ~old[i];
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void encode_decode_pattern(XbzrlePattern pattern, int len)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int dlen, rc;
+
+    fill_random(old, PAGE_SIZE);
+    make_page(pattern, old, new);
+
+    dlen = xbzrle_encode_buffer(old, new, len, compressed, len);
+    if (pattern == PATTERN_DENSE) {
+        g_assert_cmpint(dlen, ==, -1);
+    } else if (dlen > 0) {
+        rc = xbzrle_decode_buffer(compressed, dlen, old, len);
+        g_assert_cmpint(rc, <=, len);
+        g_assert(memcmp(old, new, len) == 0);
+    } else {
+        /* only possible if all changes were beyond len */
+        g_assert_cmpint(dlen, ==, 0);
+        g_assert(memcmp(old, new, len) == 0);
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
+static void test_encode_decode_patterns(void)
+{
+    XbzrlePattern pattern;
+    int i;
+
+    for (pattern = 0; pattern < PATTERN_MAX; pattern++) {
+        for (i = 0; i < 1000; i++) {
+            encode_decode_pattern(pattern, PAGE_SIZE);
+            /* not a multiple of 64 bytes */
+            encode_decode_pattern(pattern, PAGE_SIZE - sizeof(long));
+        }
+    }
+}
+
+/* Lengths around the 64-byte blocks and the 8 KiB limit of the vector
+ * encoder */
+static const int vector_lengths[] = {
+    8, 56, 64, 72, 120, 128, 136,
+    PAGE_SIZE - 64, PAGE_SIZE - 8, PAGE_SIZE, PAGE_SIZE + 8, PAGE_SIZE + 64,
+    2 * PAGE_SIZE - 8, 2 * PAGE_SIZE, 2 * PAGE_SIZE + 64,
+};
+
+#define VECTOR_MAX_LEN (2 * PAGE_SIZE + 64)
+
+/* Inputs for comparing the vector and scalar encoders */
+typedef enum {
+    VECTOR_SPARSE,      /* a few bytes, often the first and last ones */
+    VECTOR_MIXED,       /* every byte changed with a 1 in 4 chance */
+    VECTOR_RUNS,        /* alternating runs of 1 to 130 bytes */
+    VECTOR_RANDOM,      /* a new random page */
+    VECTOR_MAX,
+} VectorInput;
+
+/* Copy @old to @new and change @len bytes of it as described by @input */
+static void make_vector_page(VectorInput input, const uint8_t *old,
+                             uint8_t *new, int len)
+{
+    int i, j, n;
+    bool changed;
+
+    memcpy(new, old, len);
+
+    switch (input) {
+    case VECTOR_SPARSE:
+        n = g_test_rand_int_range(0, 16);
+        for (i = 0; i < n; i++) {
+            new[g_test_rand_int_range(0, len)] ^= 0x5a;
+        }
+        if (g_test_rand_bit()) {
+            new[0] ^= 0x5a;
+        }
+        if (g_test_rand_bit()) {
+            new[len - 1] ^= 0x5a;
+        }
+        break;
+    case VECTOR_MIXED:
+        for (i = 0; i < len; i++) {
+            if (g_test_rand_int_range(0, 4) == 0) {
+                new[i] = ~old[i];
+            }
+        }
+        break;
+    case VECTOR_RUNS:
+        /* crosses the 64-byte blocks and both length encodings */
+        changed = g_test_rand_bit();
+        for (i = 0; i < len; i += n) {
+            n = g_test_rand_int_range(1, 131);
+            for (j = i; changed && j < i + n && j < len; j++) {
+                new[j] = ~old[j];
+            }
+            changed = !changed;
+        }
+        break;
+    case VECTOR_RANDOM:
+        fill_random(new, len);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void encode_vector_scalar(uint8_t *old, uint8_t *new, int len,
+                                 int dlen)
+{
+    uint8_t *vector = g_malloc(VECTOR_MAX_LEN);
+    uint8_t *scalar = g_malloc(VECTOR_MAX_LEN);
+    int vector_len, scalar_len;
+
+    vector_len = xbzrle_encode_buffer(old, new, len, vector, dlen);
+    scalar_len = xbzrle_encode_buffer_scalar(old, new, len, scalar, dlen);
+    g_assert_cmpint(vector_len, ==, scalar_len);
+    if (vector_len > 0) {
+        g_assert(memcmp(vector, scalar, vector_len) == 0);
+    }
+
+    g_free(vector);
+    g_free(scalar);
+}
+
+static void test_encode_vector_scalar(void)
+{
+    uint8_t *old = g_malloc(VECTOR_MAX_LEN);
+    uint8_t *new = g_malloc(VECTOR_MAX_LEN);
+    VectorInput input;
+    int i, j;
+
+    for (input = 0; input < VECTOR_MAX; input++) {
+        for (i = 0; i < ARRAY_SIZE(vector_lengths); i++) {
+            int len = vector_lengths[i];
+
+            for (j = 0; j < 100; j++) {
+                fill_random(old, len);
+                make_vector_page(input, old, new, len);
+
+                encode_vector_scalar(old, new, len, len);
+                /* both must overflow at the same point */
+                encode_vector_scalar(old, new, len,
+                                     g_test_rand_int_range(0, len));
+            }
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+}
+
+#define PERF_PAGES 1024
+#define PERF_ROUNDS 100
+
+static void perf_pattern(XbzrlePattern pattern)
+{
+    uint8_t *old = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PERF_PAGES * PAGE_SIZE);
+    int *dlen = g_new(int, PERF_PAGES);
+    uint64_t bytes = 0;
+    double encode, decode;
+    int i, j;
+
+    fill_random(old, PERF_PAGES * PAGE_SIZE);
+    for (i = 0; i < PERF_PAGES; i++) {
+        make_page(pattern, old + i * PAGE_SIZE, new + i * PAGE_SIZE);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            dlen[i] = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                           new + i * PAGE_SIZE, PAGE_SIZE,
+                                           compressed + i * PAGE_SIZE,
+                                           PAGE_SIZE);
+        }
+    }
+    encode = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            if (dlen[i] > 0) {
+                xbzrle_decode_buffer(compressed + i * PAGE_SIZE, dlen[i],
+                                     old + i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+    }
+    decode = g_test_timer_elapsed();
+
+    for (i = 0; i < PERF_PAGES; i++) {
+        bytes += dlen[i] > 0 ? dlen[i] : PAGE_SIZE;
+    }
+
+    g_test_message("%-8s encode %8.1f MB/s, decode %8.1f MB/s, "
+                   "%5.1f%% of page size\n", pattern_names[pattern],
+                   (double)PERF_ROUNDS * PERF_PAGES * PAGE_SIZE / encode / 1e6,
+                   (double)PERF_ROUNDS * PERF_PAGES * PAGE_SIZE / decode / 1e6,
+                   100.0 * bytes / (PERF_PAGES * PAGE_SIZE));
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(dlen);
+}
+
+static void perf_encode_decode(void)
+{
+    XbzrlePattern pattern;
+
+    for (pattern = 0; pattern < PATTERN_MAX; pattern++) {
+        perf_pattern(pattern);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +474,13 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_patterns",
+                    test_encode_decode_patterns);
+    g_test_add_func("/xbzrle/encode_vector_scalar",
+                    test_encode_vector_scalar);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode_decode", perf_encode_decode);
+    }
 
     return g_test_run();
 }
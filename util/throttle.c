@@ -0,0 +1,137 @@
+/*
+ * Token bucket I/O throttling
+ *
+ * Copyright (c) 2014 Citrix Systems Ltd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+#include "qemu/throttle.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+/* When no burst is configured, allow 1ms worth of I/O to be queued up in the
+ * bucket so that requests slightly larger than the average are not delayed
+ * by a full period.
+ */
+#define THROTTLE_DEFAULT_BURST_NS 1000000LL
+
+void throttle_set_limit(ThrottleState *ts, ThrottleBucketType type,
+                        double rate, double burst)
+{
+    ThrottleBucket *b = &ts->buckets[type];
+
+    b->rate = rate;
+    b->burst = burst;
+    if (!rate) {
+        b->level = 0;
+    }
+}
+
+bool throttle_enabled(ThrottleState *ts)
+{
+    int i;
+
+    for (i = 0; i < THROTTLE_BUCKETS; i++) {
+        if (ts->buckets[i].rate > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void throttle_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta = now - ts->last_leak;
+    int i;
+
+    if (delta <= 0) {
+        return;
+    }
+    ts->last_leak = now;
+
+    for (i = 0; i < THROTTLE_BUCKETS; i++) {
+        ThrottleBucket *b = &ts->buckets[i];
+        double leak = b->rate * delta / NANOSECONDS_PER_SECOND;
+
+        b->level = b->level > leak ? b->level - leak : 0;
+    }
+}
+
+static int64_t throttle_bucket_wait(ThrottleBucket *b)
+{
+    double capacity, extra;
+
+    if (!b->rate) {
+        return 0;
+    }
+
+    capacity = b->burst;
+    if (!capacity) {
+        capacity = b->rate * THROTTLE_DEFAULT_BURST_NS / NANOSECONDS_PER_SECOND;
+    }
+
+    if (b->level <= capacity) {
+        return 0;
+    }
+
+    extra = b->level - capacity;
+    return (int64_t)ceil(extra * NANOSECONDS_PER_SECOND / b->rate);
+}
+
+int64_t throttle_compute_wait(ThrottleState *ts, bool is_write, int64_t now)
+{
+    static const ThrottleBucketType read_buckets[] = {
+        THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ,
+        THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ,
+    };
+    static const ThrottleBucketType write_buckets[] = {
+        THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE,
+        THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE,
+    };
+    const ThrottleBucketType *types = is_write ? write_buckets : read_buckets;
+    int64_t wait = 0;
+    int i;
+
+    throttle_leak(ts, now);
+
+    for (i = 0; i < 4; i++) {
+        int64_t w = throttle_bucket_wait(&ts->buckets[types[i]]);
+        if (w > wait) {
+            wait = w;
+        }
+    }
+    return wait;
+}
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t bytes)
+{
+    ThrottleBucket *b = ts->buckets;
+
+    if (b[THROTTLE_BPS_TOTAL].rate) {
+        b[THROTTLE_BPS_TOTAL].level += bytes;
+    }
+    if (b[THROTTLE_OPS_TOTAL].rate) {
+        b[THROTTLE_OPS_TOTAL].level += 1;
+    }
+
+    if (is_write) {
+        if (b[THROTTLE_BPS_WRITE].rate) {
+            b[THROTTLE_BPS_WRITE].level += bytes;
+        }
+        if (b[THROTTLE_OPS_WRITE].rate) {
+            b[THROTTLE_OPS_WRITE].level += 1;
+        }
+    } else {
+        if (b[THROTTLE_BPS_READ].rate) {
+            b[THROTTLE_BPS_READ].level += bytes;
+        }
+        if (b[THROTTLE_OPS_READ].rate) {
+            b[THROTTLE_OPS_READ].level += 1;
+        }
+    }
+}
@@ -11,8 +11,16 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -23,17 +31,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res, xor;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -123,6 +128,199 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * Vector encoder
+ *
+ * The vector kernels only compare the two pages, producing a bitmap with
+ * one bit set for every byte that did not change.  The runs are then found
+ * 64 bytes at a time with ctz64() on the bitmap, so the output is exactly
+ * the same as the scalar encoder's.
+ *
+ * Pages larger than XBZRLE_VECTOR_MAX_LEN, or whose size is not a multiple
+ * of 64, use the scalar encoder.
+ */
+#define XBZRLE_VECTOR_MAX_LEN 8192
+
+typedef void XbzrleEqBitmapFunc(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int slen,
+                                uint64_t *eq);
+
+static XbzrleEqBitmapFunc *xbzrle_eq_bitmap;
+
+#ifdef __SSE2__
+static void xbzrle_eq_bitmap_sse2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int slen,
+                                  uint64_t *eq)
+{
+    int i, j;
+
+    for (i = 0; i < slen; i += 64) {
+        uint64_t mask = 0;
+
+        for (j = 0; j < 64; j += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(old_buf + i + j));
+            __m128i y = _mm_loadu_si128((const __m128i *)(new_buf + i + j));
+            uint16_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+            mask |= (uint64_t)m << j;
+        }
+        eq[i / 64] = mask;
+    }
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void xbzrle_eq_bitmap_avx2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int slen,
+                                  uint64_t *eq)
+{
+    int i;
+
+    for (i = 0; i < slen; i += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i y0 = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(old_buf + i + 32));
+        __m256i y1 = _mm256_loadu_si256((const __m256i *)(new_buf + i + 32));
+        uint32_t m0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+        uint32_t m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+
+        eq[i / 64] = m0 | ((uint64_t)m1 << 32);
+    }
+}
+#pragma GCC pop_options
+
+static bool xbzrle_cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    /* The OS must save the YMM registers on context switch */
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#endif
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+#ifdef __SSE2__
+    xbzrle_eq_bitmap = xbzrle_eq_bitmap_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (xbzrle_cpu_has_avx2()) {
+        xbzrle_eq_bitmap = xbzrle_eq_bitmap_avx2;
+    }
+#endif
+}
+
+/* Return the first byte at or after i that is (@equal) or is not (!@equal)
+ * unchanged, or slen if there is none */
+static inline int xbzrle_find_next(const uint64_t *eq, int slen, int i,
+                                   bool equal)
+{
+    while (i < slen) {
+        uint64_t word = equal ? eq[i / 64] : ~eq[i / 64];
+
+        word &= ~0ULL << (i % 64);
+        if (word) {
+            return (i & ~63) + ctz64(word);
+        }
+        i = (i & ~63) + 64;
+    }
+    return slen;
+}
+
+static int xbzrle_encode_buffer_vector(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    uint64_t eq[XBZRLE_VECTOR_MAX_LEN / 64];
+    int zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    xbzrle_eq_bitmap(old_buf, new_buf, slen, eq);
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = xbzrle_find_next(eq, slen, i, false);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = xbzrle_find_next(eq, slen, i, true);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    if (xbzrle_eq_bitmap && slen <= XBZRLE_VECTOR_MAX_LEN && !(slen % 64)) {
+        return xbzrle_encode_buffer_vector(old_buf, new_buf, slen, dst, dlen);
+    }
+    return xbzrle_encode_buffer_scalar(old_buf, new_buf, slen, dst, dlen);
+}
+
+/* Most runs are shorter than 128 bytes, so decode the single byte form of
+ * the length inline */
+static inline int xbzrle_decode_length(const uint8_t *in, uint32_t *n)
+{
+    if (!(*in & 0x80)) {
+        *n = *in;
+        return 1;
+    }
+    return uleb128_decode_small(in, n);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -136,7 +334,7 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        ret = uleb128_decode_small(src + i, &count);
+        ret = xbzrle_decode_length(src + i, &count);
         if (ret < 0 || (i && !count)) {
             return -1;
         }
@@ -153,7 +351,7 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        ret = uleb128_decode_small(src + i, &count);
+        ret = xbzrle_decode_length(src + i, &count);
         if (ret < 0 || !count) {
             return -1;
         }